@@ -2,83 +2,168 @@
 
 #include <stddef.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 
 #define WORD_SIZE sizeof(size_t)
 #define ALIGN(v) (v % WORD_SIZE == 0 ? v : v + WORD_SIZE - v % WORD_SIZE)
 
+// pages stop growing after reaching that size
+#define MAX_PAGE_SIZE (1 << 20)
+
 struct Page {
 	Page   *next;
-	char   *data;
+	size_t size;
 	size_t taken;
+	char   data[];
 };
 
-static void Page_drop(Page *self)
-{
-	free(self->data);
-	free(self);
-}
-
-static Page *Page_new(size_t page_size)
+static Page *Page_new(size_t size)
 {
-	Page *self = malloc(sizeof(*self));
+	Page *self = malloc(sizeof(*self) + size);
 	if (!self) {
 		return NULL;
 	}
-	self->data = malloc(page_size);
-	if (!self->data) {
-		free(self);
-		return NULL;
-	}
 	self->next = NULL;
+	self->size = size;
 	self->taken = 0;
 	return self;
 }
 
+static void Page_drop_all(Page *p)
+{
+	while (p) {
+		Page *next = p->next;
+		free(p);
+		p = next;
+	}
+}
+
 Arena Arena_make(size_t page_size)
 {
 	Arena self = {0};
-	self.first = Page_new(page_size);
 	self.page_size = ALIGN(page_size);
+	self.first = Page_new(self.page_size);
+	self.curr = self.first;
 	return self;
 }
 
-void *Arena_alloc(Arena *self, size_t size)
+static void *Arena_alloc_large(Arena *self, size_t size)
 {
-	size = ALIGN(size);
-	if (size > self->page_size) {
+	Page *chunk = Page_new(size);
+	if (!chunk) {
 		return NULL;
 	}
-	Page *p = self->first;
-	while (p) {
-		if (self->page_size - p->taken >= size) {
-			char *mem = p->data + p->taken;
-			p->taken += size;
-			return mem;
+	chunk->taken = size;
+	chunk->next = self->large;
+	self->large = chunk;
+	return chunk->data;
+}
+
+// Moves the cursor to the next page that is able to hold `size` bytes,
+// reusing the pages that were emptied by a reset or a rollback.
+static Page *Arena_next_page(Arena *self, size_t size)
+{
+	Page *p = self->curr;
+	while (p->next) {
+		p = p->next;
+		p->taken = 0;
+		if (p->size >= size) {
+			self->curr = p;
+			return p;
 		}
-		if (p->next == NULL) {
-			p->next = Page_new(self->page_size);
+	}
+	if (self->page_size < MAX_PAGE_SIZE) {
+		self->page_size *= 2;
+	}
+	Page *new = Page_new(self->page_size);
+	if (!new) {
+		return NULL;
+	}
+	// NOTE: the new page is linked right after the current one,
+	// so the skipped too-small pages stay around for the next reset
+	new->next = self->curr->next;
+	self->curr->next = new;
+	self->curr = new;
+	return new;
+}
+
+void *Arena_alloc(Arena *self, size_t size)
+{
+	size = ALIGN(size);
+	if (size > self->page_size / 2) {
+		return Arena_alloc_large(self, size);
+	}
+	Page *p = self->curr;
+	if (p->size - p->taken < size) {
+		p = Arena_next_page(self, size);
+		if (!p) {
+			return NULL;
 		}
-		p = p->next;
 	}
-	return NULL;
+	char *mem = p->data + p->taken;
+	p->taken += size;
+	return mem;
 }
 
-void Arena_reset(Arena *self)
+ArenaMark Arena_mark(const Arena *self)
 {
-	Page *p = self->first;
-	while (p) {
-		p->taken = 0;
-		p = p->next;
+	return (ArenaMark){self->curr, self->curr->taken, self->large};
+}
+
+void Arena_rollback(Arena *self, ArenaMark mark)
+{
+	while (self->large != mark.large) {
+		Page *next = self->large->next;
+		free(self->large);
+		self->large = next;
 	}
+	self->curr = mark.page;
+	self->curr->taken = mark.taken;
+}
+
+void Arena_reset(Arena *self)
+{
+	Page_drop_all(self->large);
+	self->large = NULL;
+	self->curr = self->first;
+	self->curr->taken = 0;
 }
 
 void Arena_destroy(Arena self)
 {
-	Page *p = self.first;
-	while (p) {
-		Page *next = p->next;
-		Page_drop(p);
-		p = next;
+	Page_drop_all(self.first);
+	Page_drop_all(self.large);
+}
+
+ArenaStats Arena_stats(const Arena *self)
+{
+	ArenaStats stats = {0};
+	int filled = 1;
+	for (Page *p = self->first; p; p = p->next) {
+		stats.pages += 1;
+		stats.capacity += p->size;
+		if (filled) {
+			stats.used += p->taken;
+			if (p != self->curr) {
+				stats.waste += p->size - p->taken;
+			}
+		}
+		if (p == self->curr) {
+			filled = 0;
+		}
+	}
+	for (Page *p = self->large; p; p = p->next) {
+		stats.large += 1;
+		stats.capacity += p->size;
+		stats.used += p->size;
 	}
+	return stats;
+}
+
+void Arena_print_stats(const Arena *self, const char *name)
+{
+	ArenaStats stats = Arena_stats(self);
+	fprintf(stderr, "%s: %zu bytes used, %zu bytes wasted, %zu bytes owned in %d pages and %d large chunks\n",
+		name, stats.used, stats.waste, stats.capacity, stats.pages, stats.large);
 }
@@ -7,12 +7,33 @@ typedef struct Page Page;
 
 typedef struct {
 	Page   *first;
-	size_t page_size;
+	Page   *curr;      // the page allocations are currently served from
+	Page   *large;     // dedicated chunks for the allocations that don't fit a page
+	size_t page_size;  // the size of the next page to be allocated
 } Arena;
 
-Arena Arena_make(size_t page_size);
-void  *Arena_alloc(Arena *self, size_t bytes);
-void  Arena_reset(Arena *self);
-void  Arena_destroy(Arena self);
+// NOTE: a mark is only valid until the arena is reset or rolled back past it
+typedef struct {
+	Page   *page;
+	size_t taken;
+	Page   *large;
+} ArenaMark;
+
+typedef struct {
+	size_t used;     // bytes handed out
+	size_t capacity; // bytes owned by the pages and large chunks
+	size_t waste;    // bytes left unused at the end of the filled pages
+	int    pages;
+	int    large;
+} ArenaStats;
+
+Arena      Arena_make(size_t page_size);
+void       *Arena_alloc(Arena *self, size_t bytes);
+ArenaMark  Arena_mark(const Arena *self);
+void       Arena_rollback(Arena *self, ArenaMark mark);
+void       Arena_reset(Arena *self);
+void       Arena_destroy(Arena self);
+ArenaStats Arena_stats(const Arena *self);
+void       Arena_print_stats(const Arena *self, const char *name);
 
 #endif // ARENA_INCLUDED
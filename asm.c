@@ -0,0 +1,951 @@
+#include "asm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <elf.h>
+
+#include "error.h"
+
+
+#define ASM_AREA_SIZE    4096 // the first capacity of the areas that grow
+#define ASM_LABELS_SIZE  4096 // the first number of buckets
+
+static void asm_fail(const char *what, const char *where)
+{
+	errorf("assembler error: %s: '%s'", what, where);
+	exit(1);
+}
+
+Asm *Asm_new(char *memory, const size_t sizes[SECTIONS])
+{
+	Asm *self = calloc(1, sizeof(*self));
+	self->fixed = memory != NULL;
+	self->buckets = ASM_LABELS_SIZE;
+	self->labels = calloc(self->buckets, sizeof(*self->labels));
+	for (int i = 0; i < SECTIONS; i++) {
+		if (memory) {
+			self->areas[i] = (Area){memory, 0, sizes[i]};
+			memory += sizes[i];
+		} else {
+			self->areas[i] = (Area){malloc(ASM_AREA_SIZE), 0, ASM_AREA_SIZE};
+		}
+	}
+	return self;
+}
+
+void Asm_drop(Asm *self)
+{
+	for (size_t i = 0; i < self->buckets; i++) {
+		Label *label = self->labels[i];
+		while (label) {
+			Label *next = label->next;
+			free(label->name);
+			free(label);
+			label = next;
+		}
+	}
+	free(self->labels);
+	for (int i = 0; !self->fixed && i < SECTIONS; i++) {
+		free(self->areas[i].base);
+	}
+	for (int i = 0; i < self->exports_count; i++) {
+		free(self->exports[i]);
+	}
+	Asm_clear_fixups(self);
+	free(self->fixups);
+	free(self->scratch);
+	free(self->exports);
+	free(self);
+}
+
+static unsigned long label_hash(const char *name)
+{
+	unsigned long hash = 5381;
+	for (; *name; name++) {
+		hash = ((hash << 5) + hash) + *name;
+	}
+	return hash;
+}
+
+const Label *Asm_lookup(const Asm *self, const char *name)
+{
+	for (Label *label = self->labels[label_hash(name) % self->buckets]; label; label = label->next) {
+		if (!strcmp(label->name, name)) {
+			return label;
+		}
+	}
+	return NULL;
+}
+
+static void Asm_rehash(Asm *self)
+{
+	size_t buckets = self->buckets * 4;
+	Label **labels = calloc(buckets, sizeof(*labels));
+	for (size_t i = 0; i < self->buckets; i++) {
+		Label *label = self->labels[i];
+		while (label) {
+			Label *next = label->next;
+			label->next = labels[label_hash(label->name) % buckets];
+			labels[label_hash(label->name) % buckets] = label;
+			label = next;
+		}
+	}
+	free(self->labels);
+	self->labels = labels;
+	self->buckets = buckets;
+}
+
+void Asm_define(Asm *self, const char *name, Section section, size_t value)
+{
+	if (Asm_lookup(self, name)) {
+		asm_fail("label defined twice", name);
+	}
+	Label *label = calloc(1, sizeof(*label));
+	label->name = strdup(name);
+	label->section = section;
+	label->value = value;
+	label->next = self->labels[label_hash(name) % self->buckets];
+	self->labels[label_hash(name) % self->buckets] = label;
+	self->labels_count += 1;
+	if (self->labels_count * 2 > self->buckets) {
+		Asm_rehash(self);
+	}
+}
+
+char *Asm_reserve(Asm *self, Section section, size_t size)
+{
+	Area *area = &self->areas[section];
+	if (area->size + size > area->capacity) {
+		if (self->fixed) {
+			self->full = 1;
+			if (size > self->scratch_size) {
+				self->scratch_size = size;
+				self->scratch = realloc(self->scratch, size);
+			}
+			return self->scratch;
+		}
+		while (area->size + size > area->capacity) {
+			area->capacity *= 2;
+		}
+		area->base = realloc(area->base, area->capacity);
+	}
+	char *at = area->base + area->size;
+	area->size += size;
+	return at;
+}
+
+static void Asm_put(Asm *self, const void *bytes, size_t size)
+{
+	memcpy(Asm_reserve(self, self->section, size), bytes, size);
+}
+
+static void Asm_fixup(Asm *self, FixupKind kind, size_t at, size_t end, const char *name, long addend)
+{
+	if (self->fixups_count == self->fixups_capacity) {
+		self->fixups_capacity = self->fixups_capacity ? self->fixups_capacity * 2 : 256;
+		self->fixups = realloc(self->fixups, self->fixups_capacity * sizeof(*self->fixups));
+	}
+	self->fixups[self->fixups_count] = (Fixup){kind, self->section, at, end, strdup(name), addend};
+	self->fixups_count += 1;
+}
+
+void Asm_clear_fixups(Asm *self)
+{
+	for (int i = 0; i < self->fixups_count; i++) {
+		free(self->fixups[i].name);
+	}
+	self->fixups_count = 0;
+}
+
+/* operands */
+
+#define REG_RIP -1
+#define REG_ABS -2 // an absolute address, only with %fs
+
+typedef enum {
+	OperandReg,
+	OperandImm,
+	OperandMem,
+	OperandLabel,
+} OperandKind;
+
+typedef struct {
+	OperandKind kind;
+	int         reg;      // of OperandReg, or the base of OperandMem
+	int         size;     // of OperandReg: 4, 8, or 16 for xmm
+	long        imm;      // of OperandImm, or the displacement
+	int         fs;
+	int         indirect; // a jump target prefixed with '*'
+	char        *name;    // of OperandLabel, the symbol of rip-relative or %fs OperandMem,
+	                      // or of OperandImm standing for an absolute label
+} Operand;
+
+static const char *regs64[] = {
+	"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+	"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+static const char *regs32[] = {
+	"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+	"r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+};
+
+static void parse_reg(const char *name, int *reg, int *size)
+{
+	for (int i = 0; i < 16; i++) {
+		// NOTE: most of them differ in the second letter already
+		if (name[1] != regs64[i][1] && name[1] != regs32[i][1]) {
+			continue;
+		}
+		if (!strcmp(name, regs64[i])) {
+			*reg = i;
+			*size = 8;
+			return;
+		}
+		if (!strcmp(name, regs32[i])) {
+			*reg = i;
+			*size = 4;
+			return;
+		}
+	}
+	if (!strcmp(name, "rip")) {
+		*reg = REG_RIP;
+		*size = 8;
+		return;
+	}
+	if (!strncmp(name, "xmm", 3) && isdigit(name[3])) {
+		*reg = atoi(name + 3);
+		*size = 16;
+		if (*reg < 16) {
+			return;
+		}
+	}
+	asm_fail("unknown register", name);
+}
+
+static long parse_number(const char *text)
+{
+	char *end;
+	long value = strtol(text, &end, 10);
+	if (end == text || *end) {
+		asm_fail("bad number", text);
+	}
+	return value;
+}
+
+// NOTE: `text` is modified
+static void parse_operand(char *text, Operand *op)
+{
+	memset(op, 0, sizeof(*op));
+	if (*text == '*') {
+		op->indirect = 1;
+		text++;
+	}
+	if (*text == '$') {
+		op->kind = OperandImm;
+		if (isdigit(text[1]) || text[1] == '-') {
+			op->imm = parse_number(text + 1);
+		} else {
+			op->name = text + 1;
+		}
+		return;
+	}
+	if (!strncmp(text, "%fs:", 4)) {
+		char *at = strchr(text, '@');
+		if (!at || strcmp(at, "@tpoff")) {
+			asm_fail("bad thread-local reference", text);
+		}
+		*at = '\0';
+		op->kind = OperandMem;
+		op->reg = REG_ABS;
+		op->fs = 1;
+		op->name = text + 4;
+		return;
+	}
+	if (*text == '%') {
+		op->kind = OperandReg;
+		parse_reg(text + 1, &op->reg, &op->size);
+		return;
+	}
+	char *paren = strchr(text, '(');
+	if (!paren) {
+		op->kind = OperandLabel;
+		op->name = text;
+		return;
+	}
+	char *close = strchr(paren, ')');
+	if (paren[1] != '%' || !close || close[1]) {
+		asm_fail("bad memory operand", text);
+	}
+	*paren = '\0';
+	*close = '\0';
+	op->kind = OperandMem;
+	parse_reg(paren + 2, &op->reg, &op->size);
+	if (op->reg != REG_RIP) {
+		op->imm = *text ? parse_number(text) : 0;
+		return;
+	}
+	// symbol, symbol+offset or symbol-offset
+	char *sign = strpbrk(text, "+-");
+	if (sign) {
+		op->imm = parse_number(sign);
+		*sign = '\0';
+	}
+	op->name = text;
+}
+
+/* instructions */
+
+typedef struct {
+	unsigned char bytes[32];
+	int           len;
+	int           at;    // of the 32-bit reference to `name`, -1 when none
+	FixupKind     kind;
+	const char    *name;
+	long          addend;
+} Inst;
+
+static void Inst_byte(Inst *inst, int byte)
+{
+	inst->bytes[inst->len] = byte;
+	inst->len += 1;
+}
+
+static void Inst_long(Inst *inst, long value)
+{
+	int32_t v = value;
+	memcpy(inst->bytes + inst->len, &v, sizeof(v));
+	inst->len += sizeof(v);
+}
+
+static void Inst_ref32(Inst *inst, FixupKind kind, const char *name, long addend)
+{
+	inst->at = inst->len;
+	inst->kind = kind;
+	inst->name = name;
+	inst->addend = addend;
+	Inst_long(inst, 0);
+}
+
+static void Inst_imm32(Inst *inst, const Operand *imm)
+{
+	if (imm->name) {
+		Inst_ref32(inst, FixupAbs32, imm->name, 0);
+	} else {
+		Inst_long(inst, imm->imm);
+	}
+}
+
+// `prefix` is 0 or a mandatory prefix, the opcode bytes are up to three
+static void Inst_encode(Inst *inst, int prefix, int wide, unsigned opcode, int reg, const Operand *rm)
+{
+	int base = rm->kind == OperandReg || rm->reg >= 0 ? rm->reg : 0;
+	if (rm->fs) {
+		Inst_byte(inst, 0x64);
+	}
+	if (prefix) {
+		Inst_byte(inst, prefix);
+	}
+	int rex = (wide ? 8 : 0) | (reg >> 3 & 1) << 2 | (base >> 3 & 1);
+	if (rex) {
+		Inst_byte(inst, 0x40 | rex);
+	}
+	for (int shift = 16; shift >= 0; shift -= 8) {
+		if (opcode >> shift || !shift) {
+			Inst_byte(inst, opcode >> shift & 0xff);
+		}
+	}
+	reg = (reg & 7) << 3;
+	if (rm->kind == OperandReg) {
+		Inst_byte(inst, 0xc0 | reg | (rm->reg & 7));
+	} else if (rm->reg == REG_RIP) {
+		Inst_byte(inst, 0x05 | reg);
+		Inst_ref32(inst, FixupRel32, rm->name, rm->imm);
+	} else if (rm->reg == REG_ABS) {
+		Inst_byte(inst, 0x04 | reg);
+		Inst_byte(inst, 0x25);
+		Inst_ref32(inst, FixupTpoff32, rm->name, rm->imm);
+	} else {
+		int mod = 0x80;
+		if (rm->imm == 0 && (base & 7) != 5) {
+			mod = 0x00;
+		} else if (rm->imm >= -128 && rm->imm < 128) {
+			mod = 0x40;
+		}
+		Inst_byte(inst, mod | reg | (base & 7));
+		if ((base & 7) == 4) {
+			Inst_byte(inst, 0x24);
+		}
+		if (mod == 0x40) {
+			Inst_byte(inst, rm->imm & 0xff);
+		} else if (mod == 0x80) {
+			Inst_long(inst, rm->imm);
+		}
+	}
+}
+
+static int is_xmm(const Operand *op)
+{
+	return op->kind == OperandReg && op->size == 16;
+}
+
+static const struct {
+	const char *name;
+	int        digit;  // of the immediate form
+	unsigned   store;  // r/m <- reg
+	unsigned   load;   // reg <- r/m
+} alu[] = {
+	{"add",  0, 0x01, 0x03},
+	{"and",  4, 0x21, 0x23},
+	{"sub",  5, 0x29, 0x2b},
+	{"cmp",  7, 0x39, 0x3b},
+	{"test", 0, 0x85, 0x85},
+};
+
+static const struct {
+	const char *name;
+	int        prefix;
+	unsigned   opcode;
+} sse[] = {
+	{"addsd",  0xf2, 0x0f58},
+	{"mulsd",  0xf2, 0x0f59},
+	{"subsd",  0xf2, 0x0f5c},
+	{"divsd",  0xf2, 0x0f5e},
+	{"comisd", 0x66, 0x0f2f},
+	{"ucomisd", 0x66, 0x0f2e},
+	{"xorpd",  0x66, 0x0f57},
+};
+
+static const struct {
+	const char *name;
+	int        cond;
+} jumps[] = {
+	{"jo", 0x0}, {"jno", 0x1}, {"jb", 0x2}, {"jae", 0x3},
+	{"je", 0x4}, {"jne", 0x5}, {"jbe", 0x6}, {"ja", 0x7},
+	{"js", 0x8}, {"jns", 0x9}, {"jp", 0xa}, {"jnp", 0xb},
+	{"jl", 0xc}, {"jge", 0xd}, {"jle", 0xe}, {"jg", 0xf},
+};
+
+#define LENGTH(array) (sizeof(array) / sizeof(*(array)))
+
+// whether `mnemonic` is `name` with an optional size suffix, which is returned
+static int suffixed(const char *mnemonic, const char *name, int *size)
+{
+	size_t len = strlen(name);
+	if (strncmp(mnemonic, name, len)) {
+		return 0;
+	}
+	if (!mnemonic[len]) {
+		return 1;
+	}
+	if (mnemonic[len + 1]) {
+		return 0;
+	}
+	switch (mnemonic[len]) {
+		case 'l': *size = 4; return 1;
+		case 'q': *size = 8; return 1;
+		default:  return 0;
+	}
+}
+
+static void encode_mov(Inst *inst, int size, const Operand *src, const Operand *dst)
+{
+	if (is_xmm(dst)) {
+		Inst_encode(inst, 0x66, 1, 0x0f6e, dst->reg, src);
+	} else if (is_xmm(src)) {
+		Inst_encode(inst, 0x66, 1, 0x0f7e, src->reg, dst);
+	} else if (src->kind == OperandImm && dst->kind == OperandReg && size == 4) {
+		if (dst->reg >= 8) {
+			Inst_byte(inst, 0x41);
+		}
+		Inst_byte(inst, 0xb8 + (dst->reg & 7));
+		Inst_imm32(inst, src);
+	} else if (src->kind == OperandImm) {
+		Inst_encode(inst, 0, size == 8, 0xc7, 0, dst);
+		Inst_imm32(inst, src);
+	} else if (src->kind == OperandReg) {
+		Inst_encode(inst, 0, size == 8, 0x89, src->reg, dst);
+	} else if (dst->kind == OperandReg) {
+		Inst_encode(inst, 0, size == 8, 0x8b, dst->reg, src);
+	} else {
+		asm_fail("bad operands of", "mov");
+	}
+}
+
+// `ops` are in the AT&T order, the source first
+static void Asm_encode(Asm *self, Inst *inst, const char *mnemonic, Operand *ops, int count)
+{
+	const Operand *src = &ops[0];
+	const Operand *dst = &ops[count - 1];
+	int size = 0;
+	for (int i = 0; i < count; i++) {
+		if (ops[i].kind == OperandReg && ops[i].size != 16 && !size) {
+			size = ops[i].size;
+		}
+	}
+	// NOTE: by far the most common
+	if (count == 2 && suffixed(mnemonic, "mov", &size)) {
+		encode_mov(inst, size ? size : 8, src, dst);
+		return;
+	}
+	if (!strcmp(mnemonic, "ret")) {
+		Inst_byte(inst, 0xc3);
+		return;
+	}
+	if (!strcmp(mnemonic, "leave")) {
+		Inst_byte(inst, 0xc9);
+		return;
+	}
+	if (count == 0) {
+		asm_fail("unknown instruction", mnemonic);
+	}
+	if (!strcmp(mnemonic, "push") || !strcmp(mnemonic, "pop")) {
+		int pop = mnemonic[1] == 'o';
+		if (src->kind == OperandReg) {
+			if (src->reg >= 8) {
+				Inst_byte(inst, 0x41);
+			}
+			Inst_byte(inst, (pop ? 0x58 : 0x50) + (src->reg & 7));
+		} else if (!pop && src->kind == OperandImm) {
+			int small = !src->name && src->imm >= -128 && src->imm < 128;
+			Inst_byte(inst, small ? 0x6a : 0x68);
+			if (small) {
+				Inst_byte(inst, src->imm & 0xff);
+			} else {
+				Inst_imm32(inst, src);
+			}
+		} else if (!pop) {
+			Inst_encode(inst, 0, 0, 0xff, 6, src);
+		} else {
+			Inst_encode(inst, 0, 0, 0x8f, 0, src);
+		}
+		return;
+	}
+	if (!strcmp(mnemonic, "jmp") || !strcmp(mnemonic, "call")) {
+		int call = mnemonic[0] == 'c';
+		const Label *slot = NULL;
+		if (src->indirect) {
+			Inst_encode(inst, 0, 0, 0xff, call ? 2 : 4, src);
+		} else if (src->kind != OperandLabel) {
+			asm_fail("bad jump target", mnemonic);
+		} else if (call && (slot = Asm_lookup(self, src->name)) && slot->section == SectionData) {
+			Operand mem = {.kind = OperandMem, .reg = REG_RIP, .name = src->name};
+			Inst_encode(inst, 0, 0, 0xff, 2, &mem);
+		} else {
+			Inst_byte(inst, call ? 0xe8 : 0xe9);
+			Inst_ref32(inst, FixupRel32, src->name, 0);
+		}
+		return;
+	}
+	for (size_t i = 0; mnemonic[0] == 'j' && i < LENGTH(jumps); i++) {
+		if (!strcmp(mnemonic, jumps[i].name) && src->kind == OperandLabel) {
+			Inst_byte(inst, 0x0f);
+			Inst_byte(inst, 0x80 | jumps[i].cond);
+			Inst_ref32(inst, FixupRel32, src->name, 0);
+			return;
+		}
+	}
+	if (count != 2) {
+		asm_fail("unknown instruction", mnemonic);
+	}
+	if (!strcmp(mnemonic, "lea")) {
+		Inst_encode(inst, 0, 1, 0x8d, dst->reg, src);
+		return;
+	}
+	if (!strcmp(mnemonic, "movsd")) {
+		if (is_xmm(dst)) {
+			Inst_encode(inst, 0xf2, 0, 0x0f10, dst->reg, src);
+		} else {
+			Inst_encode(inst, 0xf2, 0, 0x0f11, src->reg, dst);
+		}
+		return;
+	}
+	for (size_t i = 0; i < LENGTH(sse); i++) {
+		if (!strcmp(mnemonic, sse[i].name)) {
+			Inst_encode(inst, sse[i].prefix, 0, sse[i].opcode, dst->reg, src);
+			return;
+		}
+	}
+	for (size_t i = 0; i < LENGTH(alu); i++) {
+		if (!suffixed(mnemonic, alu[i].name, &size)) {
+			continue;
+		}
+		int wide = (size ? size : 8) == 8;
+		if (src->kind == OperandImm) {
+			int small = !src->name && src->imm >= -128 && src->imm < 128;
+			Inst_encode(inst, 0, wide, small ? 0x83 : 0x81, alu[i].digit, dst);
+			if (small) {
+				Inst_byte(inst, src->imm & 0xff);
+			} else {
+				Inst_imm32(inst, src);
+			}
+		} else if (src->kind == OperandReg) {
+			Inst_encode(inst, 0, wide, alu[i].store, src->reg, dst);
+		} else {
+			Inst_encode(inst, 0, wide, alu[i].load, dst->reg, src);
+		}
+		return;
+	}
+	asm_fail("unknown instruction", mnemonic);
+}
+
+/* directives */
+
+static void Asm_directive(Asm *self, char *name, char *args)
+{
+	Area *area = &self->areas[self->section];
+	if (!strcmp(name, ".text")) {
+		self->section = SectionText;
+	} else if (!strcmp(name, ".data")) {
+		self->section = SectionData;
+	} else if (!strcmp(name, ".section")) {
+		self->section = !strncmp(args, "stackmaps", 9) ? SectionMaps : SectionData;
+	} else if (!strcmp(name, ".global")) {
+		self->exports = realloc(self->exports, (self->exports_count + 1) * sizeof(*self->exports));
+		self->exports[self->exports_count] = strdup(args);
+		self->exports_count += 1;
+	} else if (!strcmp(name, ".set")) {
+		char *comma = strchr(args, ',');
+		if (!comma) {
+			asm_fail("bad .set", args);
+		}
+		*comma = '\0';
+		Asm_define(self, args, SectionAbs, parse_number(comma + 1 + strspn(comma + 1, " ")));
+	} else if (!strcmp(name, ".balign")) {
+		long align = parse_number(args);
+		size_t pad = -area->size & (align - 1);
+		memset(Asm_reserve(self, self->section, pad), 0, pad);
+	} else if (!strcmp(name, ".zero")) {
+		memset(Asm_reserve(self, self->section, parse_number(args)), 0, parse_number(args));
+	} else if (!strcmp(name, ".double")) {
+		double value = strtod(args, NULL);
+		Asm_put(self, &value, sizeof(value));
+	} else if (!strcmp(name, ".long")) {
+		int32_t value = parse_number(args);
+		Asm_put(self, &value, sizeof(value));
+	} else if (!strcmp(name, ".byte")) {
+		for (char *byte = strtok(args, ", "); byte; byte = strtok(NULL, ", ")) {
+			int8_t value = parse_number(byte);
+			Asm_put(self, &value, sizeof(value));
+		}
+	} else if (!strcmp(name, ".quad")) {
+		int64_t value = 0;
+		if (isdigit(args[0]) || args[0] == '-') {
+			value = parse_number(args);
+		} else {
+			Asm_fixup(self, FixupAbs64, area->size, area->size + sizeof(value), args, 0);
+		}
+		Asm_put(self, &value, sizeof(value));
+	} else {
+		asm_fail("unknown directive", name);
+	}
+}
+
+static char *trim(char *text)
+{
+	while (isspace(*text)) {
+		text++;
+	}
+	char *end = text + strlen(text);
+	while (end > text && isspace(end[-1])) {
+		end--;
+	}
+	*end = '\0';
+	return text;
+}
+
+#define MAX_OPERANDS 3
+
+static void Asm_line(Asm *self, char *line)
+{
+	line = trim(line);
+	if (!*line || !strncmp(line, "//", 2)) {
+		return;
+	}
+	char *name = line;
+	while (isalnum(*line) || *line == '_' || *line == '.') {
+		line++;
+	}
+	if (*line == ':') {
+		*line = '\0';
+		Asm_define(self, name, self->section, self->areas[self->section].size);
+		return Asm_line(self, line + 1);
+	}
+	char *args = line + strcspn(line, " \t");
+	if (*args) {
+		*args = '\0';
+		args = trim(args + 1);
+	}
+	if (*name == '.') {
+		return Asm_directive(self, name, args);
+	}
+	Operand ops[MAX_OPERANDS];
+	int count = 0;
+	while (*args) {
+		if (count == MAX_OPERANDS) {
+			asm_fail("too many operands", name);
+		}
+		char *comma = args;
+		for (int depth = 0; *comma && (*comma != ',' || depth); comma++) {
+			depth += (*comma == '(') - (*comma == ')');
+		}
+		char *next = *comma ? comma + 1 : comma;
+		*comma = '\0';
+		parse_operand(trim(args), &ops[count]);
+		count += 1;
+		args = next;
+	}
+	Inst inst = {.at = -1};
+	Asm_encode(self, &inst, name, ops, count);
+	if (self->section != SectionText) {
+		asm_fail("instruction outside of .text", name);
+	}
+	size_t start = self->areas[SectionText].size;
+	Asm_put(self, inst.bytes, inst.len);
+	if (inst.at >= 0) {
+		Asm_fixup(self, inst.kind, start + inst.at, start + inst.len, inst.name, inst.addend);
+	}
+}
+
+void Asm_assemble(Asm *self, char *text)
+{
+	for (char *line = text, *next; *line; line = next) {
+		next = line + strcspn(line, "\n");
+		if (*next) {
+			*next++ = '\0';
+		}
+		Asm_line(self, line);
+	}
+}
+
+/* object files */
+
+// NOTE: the section headers, in the order of their indices
+enum {
+	ShNull,
+	ShText,
+	ShData,
+	ShMaps,
+	ShRelaText,
+	ShRelaData,
+	ShRelaMaps,
+	ShSymtab,
+	ShStrtab,
+	ShShstrtab,
+	ShNote, // an empty .note.GNU-stack, the stack isn't executable
+	SH_COUNT,
+};
+
+typedef struct {
+	char   *bytes;
+	size_t size;
+	size_t capacity;
+} Buffer;
+
+static size_t Buffer_put(Buffer *self, const void *bytes, size_t size)
+{
+	if (self->size + size > self->capacity) {
+		self->capacity = self->capacity ? self->capacity * 2 : 4096;
+		while (self->size + size > self->capacity) {
+			self->capacity *= 2;
+		}
+		self->bytes = realloc(self->bytes, self->capacity);
+	}
+	memcpy(self->bytes + self->size, bytes, size);
+	size_t at = self->size;
+	self->size += size;
+	return at;
+}
+
+static int Asm_exported(const Asm *self, const char *name)
+{
+	for (int i = 0; i < self->exports_count; i++) {
+		if (!strcmp(self->exports[i], name)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void Asm_symbol(Buffer *symtab, Buffer *strtab, Label *label, int global)
+{
+	Elf64_Sym sym = {0};
+	sym.st_name = Buffer_put(strtab, label->name, strlen(label->name) + 1);
+	if (label->section == SectionAbs) {
+		sym.st_shndx = SHN_ABS;
+	} else if (label->section != SectionExtern) {
+		sym.st_shndx = ShText + label->section;
+	}
+	int type = label->section == SectionExtern ? label->value : STT_NOTYPE;
+	sym.st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, type);
+	sym.st_value = label->section == SectionExtern ? 0 : label->value;
+	label->symbol = symtab->size / sizeof(sym);
+	Buffer_put(symtab, &sym, sizeof(sym));
+}
+
+// NOTE: the references within a section are resolved here, the others
+// are relocated against the symbol of their section or of the import
+static void Asm_relocate(Asm *self, Buffer relas[SECTIONS])
+{
+	for (int i = 0; i < self->fixups_count; i++) {
+		const Fixup *fixup = &self->fixups[i];
+		const Label *label = Asm_lookup(self, fixup->name);
+		char *at = self->areas[fixup->section].base + fixup->at;
+		long addend = fixup->addend;
+		if (label->section != SectionExtern) {
+			addend += label->value;
+		}
+		if (label->section == SectionAbs && fixup->kind != FixupRel32) {
+			if (fixup->kind == FixupAbs64) {
+				memcpy(at, &addend, sizeof(addend));
+			} else {
+				int32_t value = addend;
+				memcpy(at, &value, sizeof(value));
+			}
+			continue;
+		}
+		if (label->section == fixup->section && fixup->kind == FixupRel32) {
+			int32_t rel = addend - fixup->end;
+			memcpy(at, &rel, sizeof(rel));
+			continue;
+		}
+		int sym = label->section < SECTIONS ? 1 + (int)label->section : label->symbol;
+		int type = R_X86_64_64;
+		switch (fixup->kind) {
+			case FixupRel32:
+				if (label->section == SectionAbs) {
+					asm_fail("relative reference to an absolute label", fixup->name);
+				}
+				type = label->section == SectionExtern ? R_X86_64_PLT32 : R_X86_64_PC32;
+				addend -= fixup->end - fixup->at;
+				break;
+			case FixupAbs32:   type = R_X86_64_32S;     break;
+			case FixupAbs64:   type = R_X86_64_64;      break;
+			case FixupTpoff32: type = R_X86_64_TPOFF32; break;
+		}
+		Elf64_Rela rela = {fixup->at, ELF64_R_INFO(sym, type), addend};
+		Buffer_put(&relas[fixup->section], &rela, sizeof(rela));
+	}
+	Asm_clear_fixups(self);
+}
+
+static void Shdr_set(Elf64_Shdr *self, int type, int flags, size_t align, size_t entsize)
+{
+	self->sh_type = type;
+	self->sh_flags = flags;
+	self->sh_addralign = align;
+	self->sh_entsize = entsize;
+}
+
+void Asm_write_object(Asm *self, FILE *out)
+{
+	// the labels it doesn't define are imported, the type is the symbol's
+	for (int i = 0; i < self->fixups_count; i++) {
+		const Fixup *fixup = &self->fixups[i];
+		if (!Asm_lookup(self, fixup->name)) {
+			int type = fixup->kind == FixupTpoff32 ? STT_TLS : STT_NOTYPE;
+			Asm_define(self, fixup->name, SectionExtern, type);
+		}
+	}
+	Buffer symtab = {0};
+	Buffer strtab = {0};
+	Elf64_Sym null = {0};
+	Buffer_put(&symtab, &null, sizeof(null));
+	Buffer_put(&strtab, "", 1);
+	for (int i = 0; i < SECTIONS; i++) {
+		Elf64_Sym sym = {.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION), .st_shndx = ShText + i};
+		Buffer_put(&symtab, &sym, sizeof(sym));
+	}
+	// NOTE: the local symbols come first
+	int locals = 0;
+	for (int global = 0; global < 2; global++) {
+		for (size_t i = 0; i < self->buckets; i++) {
+			for (Label *label = self->labels[i]; label; label = label->next) {
+				int exported = label->section == SectionExtern || Asm_exported(self, label->name);
+				if (exported == global) {
+					Asm_symbol(&symtab, &strtab, label, global);
+				}
+			}
+		}
+		if (!global) {
+			locals = symtab.size / sizeof(Elf64_Sym);
+		}
+	}
+	Buffer relas[SECTIONS] = {{0}};
+	Asm_relocate(self, relas);
+	static const char *names[SH_COUNT] = {
+		"", ".text", ".data", "stackmaps", ".rela.text", ".rela.data", ".rela.stackmaps",
+		".symtab", ".strtab", ".shstrtab", ".note.GNU-stack",
+	};
+	Buffer shstrtab = {0};
+	Elf64_Shdr shdrs[SH_COUNT] = {{0}};
+	for (int i = 0; i < SH_COUNT; i++) {
+		shdrs[i].sh_name = Buffer_put(&shstrtab, names[i], strlen(names[i]) + 1);
+	}
+	const void *contents[SH_COUNT] = {NULL};
+	for (int i = 0; i < SECTIONS; i++) {
+		int flags = SHF_ALLOC | (i == SectionText ? SHF_EXECINSTR : SHF_WRITE);
+		Shdr_set(&shdrs[ShText + i], SHT_PROGBITS, flags, 16, 0);
+		shdrs[ShText + i].sh_size = self->areas[i].size;
+		contents[ShText + i] = self->areas[i].base;
+		Shdr_set(&shdrs[ShRelaText + i], SHT_RELA, SHF_INFO_LINK, 8, sizeof(Elf64_Rela));
+		shdrs[ShRelaText + i].sh_link = ShSymtab;
+		shdrs[ShRelaText + i].sh_info = ShText + i;
+		shdrs[ShRelaText + i].sh_size = relas[i].size;
+		contents[ShRelaText + i] = relas[i].bytes;
+	}
+	Shdr_set(&shdrs[ShSymtab], SHT_SYMTAB, 0, 8, sizeof(Elf64_Sym));
+	shdrs[ShSymtab].sh_link = ShStrtab;
+	shdrs[ShSymtab].sh_info = locals;
+	shdrs[ShSymtab].sh_size = symtab.size;
+	contents[ShSymtab] = symtab.bytes;
+	Shdr_set(&shdrs[ShStrtab], SHT_STRTAB, 0, 1, 0);
+	shdrs[ShStrtab].sh_size = strtab.size;
+	contents[ShStrtab] = strtab.bytes;
+	Shdr_set(&shdrs[ShShstrtab], SHT_STRTAB, 0, 1, 0);
+	shdrs[ShShstrtab].sh_size = shstrtab.size;
+	contents[ShShstrtab] = shstrtab.bytes;
+	Shdr_set(&shdrs[ShNote], SHT_PROGBITS, 0, 1, 0);
+	// the contents follow the ELF header, the section headers go last
+	size_t offset = sizeof(Elf64_Ehdr);
+	for (int i = 1; i < SH_COUNT; i++) {
+		offset += -offset & (shdrs[i].sh_addralign - 1);
+		shdrs[i].sh_offset = offset;
+		offset += shdrs[i].sh_size;
+	}
+	Elf64_Ehdr ehdr = {
+		.e_ident = {
+			ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3,
+			ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV,
+		},
+		.e_type = ET_REL,
+		.e_machine = EM_X86_64,
+		.e_version = EV_CURRENT,
+		.e_shoff = offset + (-offset & 7),
+		.e_ehsize = sizeof(Elf64_Ehdr),
+		.e_shentsize = sizeof(Elf64_Shdr),
+		.e_shnum = SH_COUNT,
+		.e_shstrndx = ShShstrtab,
+	};
+	fwrite(&ehdr, sizeof(ehdr), 1, out);
+	offset = sizeof(ehdr);
+	for (int i = 1; i < SH_COUNT; i++) {
+		for (; offset < shdrs[i].sh_offset; offset++) {
+			fputc(0, out);
+		}
+		fwrite(contents[i], 1, shdrs[i].sh_size, out);
+		offset += shdrs[i].sh_size;
+	}
+	for (; offset < ehdr.e_shoff; offset++) {
+		fputc(0, out);
+	}
+	fwrite(shdrs, sizeof(shdrs), 1, out);
+	for (int i = 0; i < SECTIONS; i++) {
+		free(relas[i].bytes);
+	}
+	free(symtab.bytes);
+	free(strtab.bytes);
+	free(shstrtab.bytes);
+}
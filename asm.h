@@ -0,0 +1,85 @@
+#ifndef ASM_INCLUDED
+#define ASM_INCLUDED
+
+#include <stdio.h>
+#include <stddef.h>
+
+// The assembly the code generator emits is encoded by a small assembler
+// that knows just the instructions and directives it uses. What it can't
+// resolve by itself is left in the fixups: the JIT resolves them against
+// the memory the code runs in, or they are written out as the relocations
+// of an object file for the system linker.
+typedef enum {
+	SectionText,
+	SectionData, // and .rodata
+	SectionMaps,
+	SECTIONS,
+	SectionAbs = SECTIONS, // of the labels with an absolute value
+	SectionExtern,         // of the labels an object file imports
+} Section;
+
+typedef struct {
+	char   *base;
+	size_t size;
+	size_t capacity;
+} Area;
+
+typedef struct Label Label;
+
+struct Label {
+	char    *name;
+	Section section;
+	size_t  value;  // the offset into the section, the ELF symbol type of an import
+	int     symbol; // its index in the symbol table of an object file
+	Label   *next;
+};
+
+typedef enum {
+	FixupRel32,   // to the end of the instruction
+	FixupAbs32,   // sign-extended
+	FixupAbs64,
+	FixupTpoff32, // of a thread-local, relative to %fs
+} FixupKind;
+
+typedef struct {
+	FixupKind kind;
+	Section   section;
+	size_t    at;
+	size_t    end;
+	char      *name;
+	long      addend;
+} Fixup;
+
+typedef struct {
+	Area    areas[SECTIONS];
+	int     fixed; // the areas don't grow, the code in them may be running
+	int     full;  // one of them ran out, what didn't fit went to `scratch`
+	char    *scratch;
+	size_t  scratch_size;
+	Section section;
+	Label   **labels; // the buckets, twice as many as labels at most
+	size_t  buckets;
+	size_t  labels_count;
+	Fixup   *fixups; // the references to labels that may not be defined yet
+	int     fixups_count;
+	int     fixups_capacity;
+	char    **exports; // the names declared .global
+	int     exports_count;
+} Asm;
+
+// NOTE: the areas are carved out of `memory` when it isn't NULL, they are
+// allocated and grow otherwise. What doesn't fit in the fixed ones sets
+// `full`, the caller drops the code it was assembling then.
+Asm         *Asm_new(char *memory, const size_t sizes[SECTIONS]);
+void        Asm_drop(Asm *self);
+const Label *Asm_lookup(const Asm *self, const char *name);
+void        Asm_define(Asm *self, const char *name, Section section, size_t value);
+char        *Asm_reserve(Asm *self, Section section, size_t size);
+// NOTE: `text` is modified. A call of a label in the data section is made
+// through the address it holds.
+void        Asm_assemble(Asm *self, char *text);
+void        Asm_clear_fixups(Asm *self);
+// writes an ELF64 relocatable object, the undefined labels are its imports
+void        Asm_write_object(Asm *self, FILE *out);
+
+#endif // ASM_INCLUDED
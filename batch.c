@@ -0,0 +1,319 @@
+#include "batch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "node.h"
+#include "types.h"
+#include "infer.h"
+#include "symbol.h"
+#include "arena.h"
+
+
+#define INITIAL_BATCH_SIZE 256
+#define GRAPH_ARENA_PAGE_SIZE 4096
+#define RESULT_ARENA_PAGE_SIZE 4096
+
+typedef struct Edge Edge;
+
+struct Edge {
+	int  job;
+	Edge *next;
+};
+
+struct Job {
+	Edge   *dependents; // the jobs waiting for this one
+	int    waiting;     // the number of unfinished jobs this one waits for
+	double time;        // seconds spent in inference
+	char   *errors;     // what inference reported, printed in input order
+	size_t errors_size;
+};
+
+static double seconds(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+Batch Batch_make(void)
+{
+	Batch batch = {0};
+	batch.graph = Arena_make(GRAPH_ARENA_PAGE_SIZE);
+	return batch;
+}
+
+void Batch_add(Batch *self, Node *expr)
+{
+	if (self->count == self->capacity) {
+		self->capacity = self->capacity ? self->capacity * 2 : INITIAL_BATCH_SIZE;
+		self->exprs = realloc(self->exprs, self->capacity * sizeof(*self->exprs));
+	}
+	self->exprs[self->count] = expr;
+	self->count += 1;
+}
+
+static Edge *Edge_new(Arena *a, int job, Edge *next)
+{
+	Edge *edge = Arena_alloc(a, sizeof(*edge));
+	edge->job = job;
+	edge->next = next;
+	return edge;
+}
+
+// `to` waits for `from`
+static void depend(Batch *self, int from, int to)
+{
+	if (from < 0 || from == to) {
+		return;
+	}
+	self->jobs[from].dependents = Edge_new(&self->graph, to, self->jobs[from].dependents);
+	self->jobs[to].waiting += 1;
+}
+
+// The last job that defined each symbol and the jobs that read it since.
+typedef struct {
+	int  *last_def;
+	Edge **readers;
+} Uses;
+
+typedef struct Bound Bound;
+
+struct Bound {
+	Symbol      name;
+	const Bound *prev;
+};
+
+static int is_bound(const Bound *bound, Symbol name)
+{
+	for (; bound; bound = bound->prev) {
+		if (bound->name == name) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void collect_reads(Batch *self, Uses *uses, int job, const Node *expr, const Bound *bound)
+{
+	switch (expr->type) {
+		case NumberNode:
+			return;
+		case IdNode:
+			Symbol name = IdNode_symbol(expr);
+			if (!is_bound(bound, name)) {
+				depend(self, uses->last_def[name], job);
+				uses->readers[name] = Edge_new(&self->graph, job, uses->readers[name]);
+			}
+			return;
+		case IfNode:
+			collect_reads(self, uses, job, IfNode_cond(expr), bound);
+			collect_reads(self, uses, job, IfNode_true(expr), bound);
+			collect_reads(self, uses, job, IfNode_false(expr), bound);
+			return;
+		case FnNode:
+			Bound param = {IdNode_symbol(FnNode_param(expr)), bound};
+			collect_reads(self, uses, job, FnNode_body(expr), &param);
+			return;
+		case LetNode:
+			Bound let = {IdNode_symbol(LetNode_name(expr)), bound};
+			collect_reads(self, uses, job, LetNode_value(expr), &let);
+			return;
+		case ApplNode:
+		case SumNode:
+		case ProdNode:
+		case ExptNode:
+		case CmpNode:
+		case AndNode:
+		case OrNode:
+			collect_reads(self, uses, job, PairNode_left(expr), bound);
+			collect_reads(self, uses, job, PairNode_right(expr), bound);
+			return;
+	}
+}
+
+// NOTE: a definition can only refer to the earlier ones, so every edge goes
+// forward and the graph is acyclic: each strongly connected component is a
+// single expression and the input order is already a topological one.
+// Besides waiting for the definitions it reads, a definition also waits for
+// the earlier readers of its name, which must still see it unbound.
+static void build_graph(Batch *self)
+{
+	int symbols = Symbol_count();
+	Uses uses = {
+		malloc(symbols * sizeof(*uses.last_def)),
+		calloc(symbols, sizeof(*uses.readers)),
+	};
+	for (int i = 0; i < symbols; i++) {
+		uses.last_def[i] = -1;
+	}
+	self->jobs = calloc(self->count, sizeof(*self->jobs));
+	for (int i = 0; i < self->count; i++) {
+		const Node *expr = self->exprs[i];
+		collect_reads(self, &uses, i, expr, NULL);
+		if (expr->type == LetNode) {
+			Symbol name = IdNode_symbol(LetNode_name(expr));
+			depend(self, uses.last_def[name], i);
+			for (Edge *reader = uses.readers[name]; reader; reader = reader->next) {
+				depend(self, reader->job, i);
+			}
+			uses.readers[name] = NULL;
+			uses.last_def[name] = i;
+		}
+	}
+	free(uses.last_def);
+	free(uses.readers);
+}
+
+typedef struct {
+	Batch           *batch;
+	TypeEnv         *tenv;
+	int             *ready;
+	int             head;
+	int             tail;
+	int             done;
+	pthread_mutex_t lock;
+	pthread_cond_t  wake;
+} Pool;
+
+typedef struct {
+	Pool  *pool;
+	Arena *arena;
+} Worker;
+
+static void *work(void *param)
+{
+	Worker *worker = param;
+	Pool *pool = worker->pool;
+	Batch *batch = pool->batch;
+	pthread_mutex_lock(&pool->lock);
+	while (pool->done < batch->count) {
+		if (pool->head == pool->tail) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+			continue;
+		}
+		int job = pool->ready[pool->head];
+		pool->head += 1;
+		pthread_mutex_unlock(&pool->lock);
+		// NOTE: cpu time, so that the workers being preempted doesn't count
+		double start = seconds(CLOCK_THREAD_CPUTIME_ID);
+		FILE *errors = open_memstream(&batch->jobs[job].errors, &batch->jobs[job].errors_size);
+		infer_report(errors);
+		batch->types[job] = infer(batch->exprs[job], pool->tenv, worker->arena);
+		infer_report(NULL);
+		fclose(errors);
+		batch->jobs[job].time = seconds(CLOCK_THREAD_CPUTIME_ID) - start;
+		pthread_mutex_lock(&pool->lock);
+		for (Edge *edge = batch->jobs[job].dependents; edge; edge = edge->next) {
+			batch->jobs[edge->job].waiting -= 1;
+			if (!batch->jobs[edge->job].waiting) {
+				pool->ready[pool->tail] = edge->job;
+				pool->tail += 1;
+			}
+		}
+		pool->done += 1;
+		pthread_cond_broadcast(&pool->wake);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+// NOTE: the workers only ever write the slot of the name being defined,
+// so the environment is sized for every symbol upfront and never moves.
+// The errors are printed once all of it is checked, in the input order
+void Batch_infer(Batch *self, TypeEnv *tenv, int workers)
+{
+	double start = seconds(CLOCK_MONOTONIC);
+	if (workers < 1) {
+		workers = 1;
+	}
+	if (workers > self->count) {
+		workers = self->count ? self->count : 1;
+	}
+	build_graph(self);
+	TypeEnv_reserve(tenv, Symbol_count());
+	self->types = calloc(self->count, sizeof(*self->types));
+	self->workers = workers;
+	self->results = malloc(workers * sizeof(*self->results));
+	Pool pool = {.batch = self, .tenv = tenv, .ready = malloc(self->count * sizeof(int))};
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+	for (int i = 0; i < self->count; i++) {
+		if (!self->jobs[i].waiting) {
+			pool.ready[pool.tail] = i;
+			pool.tail += 1;
+		}
+	}
+	Worker *states = malloc(workers * sizeof(*states));
+	pthread_t *threads = malloc(workers * sizeof(*threads));
+	for (int i = 0; i < workers; i++) {
+		self->results[i] = Arena_make(RESULT_ARENA_PAGE_SIZE);
+		states[i] = (Worker){&pool, &self->results[i]};
+	}
+	// the calling thread is the first worker
+	for (int i = 1; i < workers; i++) {
+		pthread_create(&threads[i], NULL, work, &states[i]);
+	}
+	work(&states[0]);
+	for (int i = 1; i < workers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.wake);
+	free(pool.ready);
+	free(states);
+	free(threads);
+	self->wall = seconds(CLOCK_MONOTONIC) - start;
+	for (int i = 0; i < self->count; i++) {
+		fwrite(self->jobs[i].errors, 1, self->jobs[i].errors_size, stderr);
+		free(self->jobs[i].errors);
+		self->jobs[i].errors = NULL;
+	}
+}
+
+// The critical path is the most expensive chain of dependent inferences,
+// the total work divided by it bounds the speedup of any schedule.
+void Batch_print_stats(const Batch *self)
+{
+	double *starts = calloc(self->count, sizeof(*starts));
+	int *depths = calloc(self->count, sizeof(*depths));
+	double work = 0;
+	double path = 0;
+	int longest = 0;
+	for (int i = 0; i < self->count; i++) {
+		double finish = starts[i] + self->jobs[i].time;
+		int depth = depths[i] + 1;
+		work += self->jobs[i].time;
+		path = finish > path ? finish : path;
+		longest = depth > longest ? depth : longest;
+		for (Edge *edge = self->jobs[i].dependents; edge; edge = edge->next) {
+			if (starts[edge->job] < finish) {
+				starts[edge->job] = finish;
+			}
+			if (depths[edge->job] < depth) {
+				depths[edge->job] = depth;
+			}
+		}
+	}
+	fprintf(stderr, "typecheck: %d expressions on %d workers, %.3fs of work, %.3fs wall\n",
+		self->count, self->workers, work, self->wall);
+	fprintf(stderr, "typecheck: critical path of %.3fs through %d expressions, parallelism %.2f available, %.2f achieved\n",
+		path, longest, path > 0 ? work / path : 0, self->wall > 0 ? work / self->wall : 0);
+	free(starts);
+	free(depths);
+}
+
+void Batch_destroy(Batch self)
+{
+	for (int i = 0; i < self.workers; i++) {
+		Arena_destroy(self.results[i]);
+	}
+	Arena_destroy(self.graph);
+	free(self.results);
+	free(self.jobs);
+	free(self.types);
+	free(self.exprs);
+}
@@ -0,0 +1,31 @@
+#ifndef BATCH_INCLUDED
+#define BATCH_INCLUDED
+
+#include "node.h"
+#include "types.h"
+#include "arena.h"
+
+// A whole file of top-level expressions that is type checked at once.
+// Each expression only waits for the earlier ones that touch the same
+// global names, so the independent ones are inferred concurrently.
+typedef struct Job Job;
+
+typedef struct {
+	Node   **exprs;
+	Type   **types;   // the inferred types, NULL where inference failed
+	int    count;
+	int    capacity;
+	Job    *jobs;
+	Arena  graph;     // the dependency edges
+	Arena  *results;  // one arena per worker, the types are kept there
+	int    workers;
+	double wall;      // seconds spent in Batch_infer
+} Batch;
+
+Batch Batch_make(void);
+void  Batch_add(Batch *self, Node *expr);
+void  Batch_infer(Batch *self, TypeEnv *tenv, int workers);
+void  Batch_print_stats(const Batch *self);
+void  Batch_destroy(Batch self);
+
+#endif // BATCH_INCLUDED
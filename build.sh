@@ -5,6 +5,6 @@ CFLAGS='-g -Wall -Wextra -std=gnu99' # -fsanitize=address,undefined'
 cc $CFLAGS -c -o runtime.o runtime.c &
 cc $CFLAGS -c -o common.o common.c &
 wait
-cc $CFLAGS -o interp -lm context.c eval.c interp.c runtime.o common.o &
-cc $CFLAGS -o comp codegen.c comp.c runtime.o common.o &
+cc $CFLAGS -o interp batch.c context.c eval.c interp.c jit.c asm.c codegen.c peep.c cgen.c ir.c runtime.o common.o -lm -lpthread &
+cc $CFLAGS -o comp codegen.c peep.c cgen.c ir.c asm.c comp.c runtime.o common.o -lm &
 wait
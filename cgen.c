@@ -0,0 +1,920 @@
+#include "cgen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "codegen.h"
+#include "ir.h"
+#include "node.h"
+#include "object.h"
+#include "error.h"
+
+static const char *c_prelude =
+	"#include <math.h>\n"
+	"#include <pthread.h>\n"
+	"#include <stdint.h>\n"
+	"#include <stdlib.h>\n"
+	"#include <string.h>\n"
+	"\n"
+	"#include \"gc.h\"\n"
+	"#include \"stack.h\"\n"
+	"#include \"values.h\"\n"
+	"\n"
+	"typedef Object *(*Code)(Object *env, Object *arg);\n"
+	"\n"
+	"#define STACK_SIZE  ((size_t)1 << 30)\n"
+	"#define SHADOW_SIZE (1 << 24)\n"
+	"\n"
+	"static GC     *gc;\n"
+	"static char   *heap; // the allocation cursor, see gc.h\n"
+	"static Object *shadow;\n"
+	"static Object **top;\n"
+	"static Object **limit;\n"
+	"static Num    nil = {0, {.type = NumObject, .mark = GC_PERMANENT}};\n"
+	"\n"
+	"#define ROOT(obj) ((obj) ? (obj) : &nil.handle)\n"
+	"\n"
+	"// NOTE: a tail call reuses the C frame where the compiler can be told\n"
+	"// to, otherwise it returns to the trampoline in run\n"
+	"#if defined(__has_attribute)\n"
+	"#if __has_attribute(musttail)\n"
+	"#define MUSTTAIL __attribute__((musttail))\n"
+	"#endif\n"
+	"#endif\n"
+	"\n"
+	"#ifdef MUSTTAIL\n"
+	"#define TAIL_CALL(code, env, arg) MUSTTAIL return (code)((env), (arg))\n"
+	"#else\n"
+	"static Object tail;\n"
+	"static Code   tail_code;\n"
+	"static Object *tail_env;\n"
+	"static Object *tail_arg;\n"
+	"#define TAIL_CALL(code, env, arg) do {\\\n"
+	"\ttail_code = (code);\\\n"
+	"\ttail_env = (env);\\\n"
+	"\ttail_arg = (arg);\\\n"
+	"\treturn &tail;\\\n"
+	"} while (0)\n"
+	"#endif\n"
+	"\n"
+	"static void __attribute__((noreturn)) failure(void)\n"
+	"{\n"
+	"\texit(1);\n"
+	"}\n"
+	"\n"
+	"static inline int truthy(double num)\n"
+	"{\n"
+	"\treturn num != 0;\n"
+	"}\n"
+	"\n"
+	"static void collect(void)\n"
+	"{\n"
+	"\tStackObj_stack(shadow)->size = top - StackObj_stack(shadow)->objects;\n"
+	"\tGC_collect_comp(gc, shadow, NULL, NULL);\n"
+	"}\n"
+	"\n"
+	"// NOTE: a body is entered here when a collection is pending\n"
+	"// or it may run out of the shadow stack\n"
+	"static void enter(Object **s, Object *env, Object *arg, int slots)\n"
+	"{\n"
+	"\tif (s + slots > limit) {\n"
+	"\t\tfailure();\n"
+	"\t}\n"
+	"\ts[0] = ROOT(env);\n"
+	"\ts[1] = ROOT(arg);\n"
+	"\ttop = s + 2;\n"
+	"\tif (GC_collect_pending) {\n"
+	"\t\tcollect();\n"
+	"\t}\n"
+	"}\n"
+	"\n"
+	"static inline void *alloc(size_t size, size_t handle, ObjectType type)\n"
+	"{\n"
+	"\theap += size;\n"
+	"\tif (heap > GC_region_limit) {\n"
+	"\t\theap = GC_region_refill(gc, size);\n"
+	"\t}\n"
+	"\tObject *obj = (Object *)(heap - size + handle);\n"
+	"\tobj->type = type;\n"
+	"\tobj->mark = GC_FRESH;\n"
+	"\tobj->region = 1;\n"
+	"\treturn heap - size;\n"
+	"}\n"
+	"\n"
+	"#define ALLOC(type, otype) ((type *)alloc(sizeof(type), offsetof(type, handle), otype))\n"
+	"\n"
+	"static inline Object *box(double num)\n"
+	"{\n"
+	"\tNum *val = ALLOC(Num, NumObject);\n"
+	"\tval->num = num;\n"
+	"\treturn ValToObj(val);\n"
+	"}\n"
+	"\n"
+	"static inline Object *new_frame(Object *prev, Object *value)\n"
+	"{\n"
+	"\tFrame *val = ALLOC(Frame, FrameObject);\n"
+	"\tval->prev = prev;\n"
+	"\tval->value = value;\n"
+	"\treturn ValToObj(val);\n"
+	"}\n"
+	"\n"
+	"static inline Object *new_closure(Object *env, Code code)\n"
+	"{\n"
+	"\tCompFn *val = ALLOC(CompFn, CompfnObject);\n"
+	"\tval->arg = NULL;\n"
+	"\tval->env = env;\n"
+	"\tval->text = (void *)code;\n"
+	"\treturn ValToObj(val);\n"
+	"}\n"
+	"\n"
+	"static inline Object *new_thunk(Object *env, Code code)\n"
+	"{\n"
+	"\tCompThunk *val = ALLOC(CompThunk, CompthunkObject);\n"
+	"\tval->env = env;\n"
+	"\tval->text = (void *)code;\n"
+	"\tval->value = NULL;\n"
+	"\treturn ValToObj(val);\n"
+	"}\n"
+	"\n"
+	"// calls `code` and then what it tail calls, the slots below `base` are live\n"
+	"static inline Object *run(Code code, Object *env, Object *arg, Object **base)\n"
+	"{\n"
+	"\ttop = base;\n"
+	"\tObject *value = code(env, arg);\n"
+	"#ifndef MUSTTAIL\n"
+	"\twhile (value == &tail) {\n"
+	"\t\ttop = base;\n"
+	"\t\tvalue = tail_code(tail_env, tail_arg);\n"
+	"\t}\n"
+	"#endif\n"
+	"\treturn value;\n"
+	"}\n"
+	"\n"
+	"static inline Object *apply(Object *fn, Object *arg, Object **base)\n"
+	"{\n"
+	"\treturn run((Code)CompFnObj_text(fn), CompFnObj_env(fn), arg, base);\n"
+	"}\n"
+	"\n"
+	"static inline Object *force(Object *value, Object **base)\n"
+	"{\n"
+	"\tif (value->type != CompthunkObject) {\n"
+	"\t\treturn value;\n"
+	"\t}\n"
+	"\tif (!CompThunkObj_value(value)) {\n"
+	"\t\tbase[0] = value;\n"
+	"\t\tObject *result = run((Code)CompThunkObj_text(value), CompThunkObj_env(value), NULL, base + 1);\n"
+	"\t\tCompThunkObj_value(value) = force(result, base + 1);\n"
+	"\t}\n"
+	"\treturn CompThunkObj_value(value);\n"
+	"}\n"
+	"\n";
+
+static struct {
+	FILE          *out;     // where the program goes once it is complete
+	Kernel *const *kernels; // indexed by symbol, NULL for the other names
+	FILE          *decls;   // the prototypes and the static objects
+	char          *decls_text;
+	size_t        decls_size;
+	FILE          *defs;    // the functions
+	char          *defs_text;
+	size_t        defs_size;
+	FILE          *lines;   // the body of main
+	char          *lines_text;
+	size_t        lines_size;
+	int           ids;      // the last one generated
+	// the line being lowered
+	const Ir      *ir;
+	const IrBody  **pending; // to be defined once the current one is
+	int           count;
+	int           capacity;
+	// the body being lowered
+	const IrBody  *body;
+	int           framed;  // a function whose frame is captured
+	Temp          *temps;  // the ones it defines
+	int           temps_count;
+	int           temps_capacity;
+	char          *defined; // by the code lowered so far
+	int           slots;    // that it stores at most
+	int           depth;    // of the blocks, for the indentation
+	const Kernel  *kernel;  // when it is the one of a kernel
+} csrc = {0};
+
+// one of the above, or the buffer of a body
+static FILE *out = NULL;
+
+static void emit(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(out, fmt, args);
+	va_end(args);
+}
+
+// the names of the numbers and the values of the kernels only need to
+// differ from each other
+static int generate_id(void)
+{
+	csrc.ids += 1;
+	return csrc.ids;
+}
+
+static void lower_c_indent(void)
+{
+	for (int i = 0; i < csrc.depth; i++) {
+		emit("\t");
+	}
+}
+
+static void lower_c_line(const char *fmt, ...)
+{
+	lower_c_indent();
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(out, fmt, args);
+	va_end(args);
+	emit("\n");
+}
+
+// the C of the binary operation `op`: before, between and after the operands
+static const char *const *lower_c_operation(int op)
+{
+	static const char *pow_op[] = {"pow(", ", ", ")"};
+	static const char *mod_op[] = {"fmod(", ", ", ")"};
+	static const char *mul_op[] = {"(", " * ", ")"};
+	static const char *div_op[] = {"(", " / ", ")"};
+	static const char *add_op[] = {"(", " + ", ")"};
+	static const char *sub_op[] = {"(", " - ", ")"};
+	static const char *gt_op[] = {"(double)(", " > ", ")"};
+	static const char *lt_op[] = {"(double)(", " < ", ")"};
+	static const char *eq_op[] = {"(double)(", " == ", ")"};
+	switch (op) {
+		case '^': return pow_op;
+		case '%': return mod_op;
+		case '*': return mul_op;
+		case '/': return div_op;
+		case '+': return add_op;
+		case '-': return sub_op;
+		case '>': return gt_op;
+		case '<': return lt_op;
+		case '=': return eq_op;
+	}
+	errorf("compillation error: unknown binary operation: '%c'", op);
+	return NULL;
+}
+
+static void lower_c_float(const Node *expr);
+
+// NOTE: the body of a kernel calls nothing but the kernels
+static const Kernel *lower_c_callee(const Node *call)
+{
+	while (call->type == ApplNode) {
+		call = PairNode_left(call);
+	}
+	return csrc.kernels[IdNode_symbol(call)];
+}
+
+static void lower_c_float_pair(const Node *expr)
+{
+	const char *const *op = lower_c_operation(PairNode_op(expr));
+	if (!op) {
+		return;
+	}
+	emit("%s", op[0]);
+	lower_c_float(PairNode_left(expr));
+	emit("%s", op[1]);
+	lower_c_float(PairNode_right(expr));
+	emit("%s", op[2]);
+}
+
+static void lower_c_float_args(const Kernel *kernel, const Node *call)
+{
+	const Node *args[MAX_KERNEL_ARITY];
+	call_args(call, kernel->arity, args);
+	for (int i = 0; i < kernel->arity; i++) {
+		emit(i ? ", " : "");
+		lower_c_float(args[i]);
+	}
+}
+
+// an expression of the body of a kernel (see compile_float)
+static void lower_c_float(const Node *expr)
+{
+	int id;
+	const Kernel *kernel;
+	switch (expr->type) {
+		case NumberNode:
+			emit("%a", NumNode_value(expr));
+			return;
+		case ExptNode:
+		case ProdNode:
+		case SumNode:
+		case CmpNode:
+			return lower_c_float_pair(expr);
+		case IdNode:
+			emit("p%d", kernel_param(csrc.kernel, IdNode_symbol(expr)));
+			return;
+		case ApplNode:
+			kernel = lower_c_callee(expr);
+			emit("nf%d(", kernel->id);
+			lower_c_float_args(kernel, expr);
+			emit(")");
+			return;
+		case IfNode:
+			emit("(truthy(");
+			lower_c_float(IfNode_cond(expr));
+			emit(") ? ");
+			lower_c_float(IfNode_true(expr));
+			emit(" : ");
+			lower_c_float(IfNode_false(expr));
+			emit(")");
+			return;
+		case AndNode:
+		case OrNode:
+			id = generate_id();
+			emit("({ double v%d = ", id);
+			lower_c_float(PairNode_left(expr));
+			emit("; truthy(v%d) ? ", id);
+			if (expr->type == AndNode) {
+				lower_c_float(PairNode_right(expr));
+				emit(" : v%d; })", id);
+			} else {
+				emit("v%d : ", id);
+				lower_c_float(PairNode_right(expr));
+				emit("; })");
+			}
+			return;
+		case FnNode:
+		case LetNode:
+			break;
+	}
+	error("compillation error: not a part of a kernel");
+}
+
+// NOTE: a call of the kernel itself in a tail position jumps back
+// to its start, like compile_kernel_tail
+static void lower_c_kernel_tail(const Kernel *kernel, const Node *expr)
+{
+	int id;
+	const Node *args[MAX_KERNEL_ARITY];
+	switch (expr->type) {
+		case IfNode:
+			lower_c_indent();
+			emit("if (truthy(");
+			lower_c_float(IfNode_cond(expr));
+			emit(")) {\n");
+			csrc.depth += 1;
+			lower_c_kernel_tail(kernel, IfNode_true(expr));
+			csrc.depth -= 1;
+			lower_c_line("} else {");
+			csrc.depth += 1;
+			lower_c_kernel_tail(kernel, IfNode_false(expr));
+			csrc.depth -= 1;
+			lower_c_line("}");
+			return;
+		case AndNode:
+		case OrNode:
+			id = generate_id();
+			lower_c_indent();
+			emit("double v%d = ", id);
+			lower_c_float(PairNode_left(expr));
+			emit(";\n");
+			lower_c_line("if (%struthy(v%d)) {", expr->type == AndNode ? "!" : "", id);
+			lower_c_line("\treturn v%d;", id);
+			lower_c_line("}");
+			return lower_c_kernel_tail(kernel, PairNode_right(expr));
+		case ApplNode:
+			if (lower_c_callee(expr) != kernel) {
+				break;
+			}
+			call_args(expr, kernel->arity, args);
+			lower_c_line("{");
+			for (int i = 0; i < kernel->arity; i++) {
+				lower_c_indent();
+				emit("\tdouble a%d = ", i);
+				lower_c_float(args[i]);
+				emit(";\n");
+			}
+			for (int i = 0; i < kernel->arity; i++) {
+				lower_c_line("\tp%d = a%d;", i, i);
+			}
+			lower_c_line("}");
+			lower_c_line("goto start;");
+			return;
+		default:
+			break;
+	}
+	lower_c_indent();
+	emit("return ");
+	lower_c_float(expr);
+	emit(";\n");
+}
+
+static void lower_c_kernel(const Kernel *kernel)
+{
+	FILE *outer = out;
+	out = csrc.decls;
+	emit("static double nf%d(", kernel->id);
+	for (int i = 0; i < kernel->arity; i++) {
+		emit(i ? ", double" : "double");
+	}
+	emit(");\n");
+	out = csrc.defs;
+	emit("static double nf%d(", kernel->id);
+	for (int i = 0; i < kernel->arity; i++) {
+		emit(i ? ", double p%d" : "double p%d", i);
+	}
+	emit(")\n{\nstart: __attribute__((unused));\n");
+	csrc.kernel = kernel;
+	csrc.depth = 1;
+	lower_c_kernel_tail(kernel, kernel->body);
+	csrc.kernel = NULL;
+	emit("}\n\n");
+	out = outer;
+}
+
+// the code of `body` is defined after the one being lowered
+static void lower_c_pend(const IrBody *body)
+{
+	if (csrc.count == csrc.capacity) {
+		csrc.capacity = csrc.capacity ? csrc.capacity * 2 : 16;
+		csrc.pending = realloc(csrc.pending, csrc.capacity * sizeof(*csrc.pending));
+	}
+	csrc.pending[csrc.count] = body;
+	csrc.count += 1;
+	fprintf(csrc.decls, "static Object *%s%d(Object *env, Object *arg);\n", body->kind == BodyFn ? "fn" : "thunk", body->id);
+}
+
+// collects the temporaries the code of `block` defines
+static void lower_c_scan(const IrBlock *block)
+{
+	for (const IrInstr *instr = block->first; instr; instr = instr->next) {
+		if (instr->dead) {
+			continue;
+		}
+		if (instr->dst >= 0) {
+			if (csrc.temps_count == csrc.temps_capacity) {
+				csrc.temps_capacity = csrc.temps_capacity ? csrc.temps_capacity * 2 : 64;
+				csrc.temps = realloc(csrc.temps, csrc.temps_capacity * sizeof(*csrc.temps));
+			}
+			csrc.temps[csrc.temps_count] = instr->dst;
+			csrc.temps_count += 1;
+		}
+		switch (instr->op) {
+			case IrIf:
+				lower_c_scan(&instr->other);
+				// fallthrough
+			case IrAnd:
+			case IrOr:
+				lower_c_scan(&instr->then);
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+// the environment the closures and the thunks created by the body capture
+static const char *lower_c_env(void)
+{
+	switch (csrc.body->kind) {
+		case BodyFn:
+			return "frame";
+		case BodyThunk:
+			return "env";
+		default:
+			return "NULL";
+	}
+}
+
+// stores the objects that are live across `instr` into the slots, but
+// `except`, returns how many there are
+static int lower_c_roots(const IrInstr *instr, Temp except)
+{
+	int count = 0;
+	if (instr->env && csrc.body->kind != BodyLine) {
+		if (csrc.framed) {
+			lower_c_line("s[%d] = frame;", count++);
+		} else {
+			lower_c_line("s[%d] = ROOT(env);", count++);
+			if (csrc.body->kind == BodyFn) {
+				lower_c_line("s[%d] = arg;", count++);
+			}
+		}
+	}
+	for (int i = 0; i < csrc.temps_count; i++) {
+		Temp temp = csrc.temps[i];
+		if (
+			temp != except && csrc.defined[temp] &&
+			csrc.ir->temps[temp].kind == TempBoxed && csrc.ir->temps[temp].last > instr->seq
+		) {
+			lower_c_line("s[%d] = t%d;", count++, temp);
+		}
+	}
+	if (count + 1 > csrc.slots) {
+		csrc.slots = count + 1; // NOTE: force stores the thunk too
+	}
+	return count;
+}
+
+static void lower_c_param(const IrInstr *instr)
+{
+	int depth = instr->depth;
+	if (csrc.body->kind == BodyFn) {
+		if (!depth) {
+			return lower_c_line("t%d = arg;", instr->dst);
+		}
+		depth -= 1;
+	}
+	lower_c_indent();
+	emit("t%d = FrameObj_value(", instr->dst);
+	for (int i = 0; i < depth; i++) {
+		emit("FrameObj_prev(");
+	}
+	emit("env");
+	for (int i = 0; i < depth; i++) {
+		emit(")");
+	}
+	emit(");\n");
+}
+
+// the environment of the closure or the thunk `instr`, see lower_copies
+static void lower_c_captured(const IrInstr *instr)
+{
+	if (!instr->count) {
+		return emit("%s", lower_c_env());
+	}
+	for (int i = 0; i < instr->count; i++) {
+		emit("new_frame(");
+	}
+	emit("NULL");
+	for (int i = instr->count - 1; i >= 0; i--) {
+		emit(", t%d)", instr->args[i]);
+	}
+}
+
+static void lower_c_closure(const IrInstr *instr)
+{
+	lower_c_pend(instr->body);
+	if (!instr->closed) {
+		lower_c_indent();
+		emit("t%d = new_closure(", instr->dst);
+		lower_c_captured(instr);
+		return emit(", fn%d);\n", instr->id);
+	}
+	fprintf(
+		csrc.decls, "static CompFn c%d = {NULL, NULL, (void *)fn%d, {.type = CompfnObject, .mark = GC_PERMANENT}};\n",
+		instr->id, instr->id
+	);
+	lower_c_line("t%d = &c%d.handle;", instr->dst, instr->id);
+}
+
+static void lower_c_force(const IrInstr *instr)
+{
+	lower_c_line("if (t%d->type == CompthunkObject) {", instr->a);
+	csrc.depth += 1;
+	if (instr->evaluated) {
+		lower_c_line("t%d = CompThunkObj_value(t%d);", instr->a, instr->a);
+	} else {
+		int count = lower_c_roots(instr, instr->a);
+		lower_c_line("t%d = force(t%d, s + %d);", instr->a, instr->a, count);
+	}
+	csrc.depth -= 1;
+	lower_c_line("}");
+}
+
+static void lower_c_arith(const IrInstr *instr)
+{
+	const char *const *op = lower_c_operation(instr->arith);
+	if (op) {
+		lower_c_line("f%d = %sf%d%sf%d%s;", instr->dst, op[0], instr->a, op[1], instr->b, op[2]);
+	}
+}
+
+static void lower_c_native(const IrInstr *instr)
+{
+	lower_c_indent();
+	emit("f%d = nf%d(", instr->dst, instr->id);
+	for (int i = 0; i < instr->count; i++) {
+		emit(i ? ", f%d" : "f%d", instr->args[i]);
+	}
+	emit(");\n");
+}
+
+static void lower_c_call(const IrInstr *instr)
+{
+	if (instr->tail) {
+		lower_c_line("top = s;");
+		if (instr->a < 0) {
+			return lower_c_line("TAIL_CALL(fn%d, NULL, t%d);", instr->id, instr->b);
+		}
+		return lower_c_line("TAIL_CALL((Code)CompFnObj_text(t%d), CompFnObj_env(t%d), t%d);", instr->a, instr->a, instr->b);
+	}
+	int count = lower_c_roots(instr, -1);
+	if (instr->a < 0) {
+		lower_c_line("t%d = run(fn%d, NULL, t%d, s + %d);", instr->dst, instr->id, instr->b, count);
+	} else {
+		lower_c_line("t%d = apply(t%d, t%d, s + %d);", instr->dst, instr->a, instr->b, count);
+	}
+}
+
+// NOTE: like lower_loop, `arg` is the frame of the last parameter
+static void lower_c_loop(const IrInstr *instr)
+{
+	int last = instr->count - 1;
+	if (last > 0) {
+		lower_c_line("if (!owned) {");
+		lower_c_line("\tenv = NULL;");
+		for (int i = 0; i < last; i++) {
+			lower_c_line("\tenv = new_frame(env, NULL);");
+		}
+		lower_c_line("\towned = 1;");
+		lower_c_line("}");
+	}
+	for (int i = 0; i < last; i++) {
+		lower_c_indent();
+		emit("FrameObj_value(");
+		for (int j = i + 1; j < last; j++) {
+			emit("FrameObj_prev(");
+		}
+		emit("env");
+		for (int j = i + 1; j < last; j++) {
+			emit(")");
+		}
+		emit(") = t%d;\n", instr->args[i]);
+	}
+	lower_c_line("arg = t%d;", instr->args[last]);
+	lower_c_line("goto loop;");
+}
+
+static void lower_c_block(const IrBlock *block);
+
+// the condition `temp` as a C expression
+static void lower_c_test(const char *fmt, Temp temp)
+{
+	if (csrc.ir->temps[temp].kind == TempFloat) {
+		lower_c_line(fmt, "truthy(f", temp, ")");
+	} else {
+		lower_c_line(fmt, "truthy(NumObj_num(t", temp, "))");
+	}
+}
+
+static void lower_c_branch(const IrInstr *instr, const IrBlock *block)
+{
+	csrc.depth += 1;
+	lower_c_block(block);
+	if (!instr->tail) {
+		lower_c_line("t%d = t%d;", instr->dst, block->result);
+	}
+	csrc.depth -= 1;
+}
+
+static void lower_c_if(const IrInstr *instr)
+{
+	lower_c_test("if (%s%d%s) {", instr->a);
+	lower_c_branch(instr, &instr->then);
+	lower_c_line("} else {");
+	lower_c_branch(instr, &instr->other);
+	lower_c_line("}");
+}
+
+// NOTE: the left operand is the value when it decides
+static void lower_c_logic(const IrInstr *instr)
+{
+	if (!instr->tail) {
+		lower_c_line("t%d = t%d;", instr->dst, instr->a);
+	}
+	lower_c_test(instr->op == IrAnd ? "if (%s%d%s) {" : "if (!%s%d%s) {", instr->a);
+	lower_c_branch(instr, &instr->then);
+	lower_c_line("}");
+	if (instr->tail) {
+		lower_c_line("return t%d;", instr->a);
+	}
+}
+
+static void lower_c_instr(const IrInstr *instr)
+{
+	int id;
+	if (instr->dead) {
+		return;
+	}
+	switch (instr->op) {
+		case IrNum:
+			id = generate_id();
+			fprintf(csrc.decls, "static Num n%d = {%a, {.type = NumObject, .mark = GC_PERMANENT}};\n", id, instr->num);
+			lower_c_line("t%d = &n%d.handle;", instr->dst, id);
+			break;
+		case IrParam:
+			lower_c_param(instr);
+			break;
+		case IrGlobal:
+			lower_c_line("t%d = globals[%d];", instr->dst, instr->slot);
+			if (!instr->bound) {
+				lower_c_line("if (!t%d) {", instr->dst);
+				lower_c_line("\tfailure();");
+				lower_c_line("}");
+			}
+			break;
+		case IrClosure:
+			lower_c_closure(instr);
+			break;
+		case IrThunk:
+			lower_c_pend(instr->body);
+			lower_c_indent();
+			emit("t%d = new_thunk(", instr->dst);
+			lower_c_captured(instr);
+			emit(", thunk%d);\n", instr->id);
+			break;
+		case IrForce:
+			lower_c_force(instr);
+			break;
+		case IrAssert:
+			lower_c_line("if (t%d->type != %s) {", instr->a, instr->type == NumObject ? "NumObject" : "CompfnObject");
+			lower_c_line("\tfailure();");
+			lower_c_line("}");
+			break;
+		case IrConst:
+			lower_c_line("f%d = %a;", instr->dst, instr->num);
+			break;
+		case IrUnbox:
+			lower_c_line("f%d = NumObj_num(t%d);", instr->dst, instr->a);
+			break;
+		case IrArith:
+			lower_c_arith(instr);
+			break;
+		case IrNative:
+			lower_c_native(instr);
+			break;
+		case IrBox:
+			lower_c_line("t%d = box(f%d);", instr->dst, instr->a);
+			break;
+		case IrSpill:
+			break;
+		case IrRestore:
+			lower_c_line("f%d = f%d;", instr->dst, instr->a);
+			break;
+		case IrCall:
+			lower_c_call(instr);
+			break;
+		case IrIf:
+			lower_c_if(instr);
+			break;
+		case IrAnd:
+		case IrOr:
+			lower_c_logic(instr);
+			break;
+		case IrSet:
+			lower_c_line("globals[%d] = t%d;", instr->slot, instr->a);
+			break;
+		case IrReturn:
+			lower_c_line("return t%d;", instr->a);
+			break;
+		case IrLoop:
+			lower_c_loop(instr);
+			break;
+	}
+	if (instr->dst >= 0) {
+		csrc.defined[instr->dst] = 1;
+	}
+}
+
+static void lower_c_block(const IrBlock *block)
+{
+	for (const IrInstr *instr = block->first; instr; instr = instr->next) {
+		lower_c_instr(instr);
+	}
+}
+
+// NOTE: the code goes to a buffer first, what precedes it depends on all of it
+static void lower_c_body(const IrBody *body)
+{
+	char *code;
+	size_t size;
+	FILE *outer = out;
+	out = open_memstream(&code, &size);
+	csrc.body = body;
+	csrc.framed = 0;
+	csrc.temps_count = 0;
+	csrc.defined = calloc(csrc.ir->count, sizeof(*csrc.defined));
+	csrc.slots = 2;
+	csrc.depth = body->kind == BodyLine ? 2 : 1;
+	lower_c_scan(&body->code);
+	csrc.framed = body->kind == BodyFn && body->escapes;
+	lower_c_block(&body->code);
+	if (body->kind == BodyLine && body->code.result >= 0) {
+		lower_c_line("Object_println(t%d);", body->code.result);
+	}
+	fclose(out);
+	free(csrc.defined);
+	if (body->kind == BodyLine) {
+		out = csrc.lines;
+		emit("\t{\n");
+	} else {
+		out = csrc.defs;
+		emit("static Object *%s%d(Object *env, Object *arg)\n{\n", body->kind == BodyFn ? "fn" : "thunk", body->id);
+		emit("\tObject **s = top;\n");
+	}
+	for (int i = 0; i < csrc.temps_count; i++) {
+		Temp temp = csrc.temps[i];
+		emit(body->kind == BodyLine ? "\t\t" : "\t");
+		emit(csrc.ir->temps[temp].kind == TempFloat ? "double f%d;\n" : "Object *t%d;\n", temp);
+	}
+	if (csrc.framed) {
+		emit("\tObject *frame = new_frame(env, arg);\n");
+	}
+	if (body->loops > 1) {
+		emit("\tint owned = 0;\n");
+	}
+	if (body->loops) {
+		emit("loop:\n");
+	}
+	if (body->kind != BodyLine) {
+		emit("\tif (GC_collect_pending || s + %d > limit) {\n", csrc.slots);
+		emit("\t\tenter(s, %s, %d);\n", csrc.framed ? "frame, NULL" : "env, arg", csrc.slots);
+		emit("\t}\n");
+	}
+	fwrite(code, 1, size, out);
+	free(code);
+	if (body->kind == BodyLine) {
+		emit("\t\ttop = s;\n");
+		emit("\t\tif (GC_collect_pending) {\n");
+		emit("\t\t\tcollect();\n");
+		emit("\t\t}\n");
+		emit("\t}\n");
+	} else {
+		emit("}\n\n");
+	}
+	out = outer;
+}
+
+void cgen_kernel(const Kernel *kernel)
+{
+	lower_c_kernel(kernel);
+}
+
+// NOTE: the bodies of the closures and the thunks of the line follow it
+void cgen_line(const Ir *ir, const IrBody *body)
+{
+	csrc.ir = ir;
+	lower_c_body(body);
+	while (csrc.count) {
+		csrc.count -= 1;
+		lower_c_body(csrc.pending[csrc.count]);
+	}
+	csrc.ir = NULL;
+}
+
+void cgen_begin(FILE *output, Kernel *const *kernels)
+{
+	csrc.out = output;
+	csrc.kernels = kernels;
+	csrc.decls = open_memstream(&csrc.decls_text, &csrc.decls_size);
+	csrc.defs = open_memstream(&csrc.defs_text, &csrc.defs_size);
+	csrc.lines = open_memstream(&csrc.lines_text, &csrc.lines_size);
+}
+
+void cgen_end(int globals)
+{
+	fclose(csrc.decls);
+	fclose(csrc.defs);
+	fclose(csrc.lines);
+	out = csrc.out;
+	emit("%s", c_prelude);
+	emit("static Object *globals[%d];\n\n", globals ? globals : 1);
+	emit("%s\n%s", csrc.decls_text, csrc.defs_text);
+	emit("// NOTE: runs on a thread of its own, so that the stack is as deep\n");
+	emit("// as the one of the other backends, which takes less per call\n");
+	emit("static void *program(void *arg)\n{\n");
+	emit("\t(void)arg;\n");
+	emit("\tgc = GC_new();\n");
+	emit("\tGC_set_roots(gc, globals, %d);\n", globals);
+	emit("\tshadow = GC_alloc_stack(gc);\n");
+	emit("\tStack *stack = StackObj_stack(shadow);\n");
+	emit("\tstack->objects = realloc(stack->objects, SHADOW_SIZE * sizeof(*stack->objects));\n");
+	emit("\tstack->capacity = SHADOW_SIZE;\n");
+	emit("\ttop = stack->objects;\n");
+	emit("\tlimit = top + SHADOW_SIZE;\n");
+	emit("\tObject **s = top;\n");
+	emit("%s", csrc.lines_text);
+	emit("\tGC_collect(gc, NULL, NULL);\n");
+	emit("\tGC_drop(gc);\n");
+	emit("\treturn NULL;\n");
+	emit("}\n\n");
+	emit("int main(void)\n{\n");
+	emit("\tpthread_attr_t attr;\n");
+	emit("\tpthread_t thread;\n");
+	emit("\tpthread_attr_init(&attr);\n");
+	emit("\tpthread_attr_setstacksize(&attr, STACK_SIZE);\n");
+	emit("\tif (pthread_create(&thread, &attr, program, NULL)) {\n");
+	emit("\t\treturn 1;\n");
+	emit("\t}\n");
+	emit("\tpthread_join(thread, NULL);\n");
+	emit("\treturn 0;\n");
+	emit("}\n");
+	free(csrc.decls_text);
+	free(csrc.defs_text);
+	free(csrc.lines_text);
+	free(csrc.pending);
+	free(csrc.temps);
+}
+
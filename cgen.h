@@ -0,0 +1,23 @@
+#ifndef CGEN_INCLUDED
+#define CGEN_INCLUDED
+
+#include <stdio.h>
+
+#include "codegen.h"
+#include "ir.h"
+
+// With -c the IR is lowered to C instead, a function per body, and the
+// system C compiler does the rest. It uses the objects and the GC of the
+// runtime as a library. The C stack can't be walked, so the objects live
+// across a call are stored into a shadow stack first: a Stack object that
+// is the root of every collection, the slots of a body start at `s` and
+// a call stores what is live there before setting `top` past it.
+//
+// The code generator builds and analyzes the IR of each line, this lowers
+// it. The program is written to `output` once it is complete, by cgen_end.
+void cgen_begin(FILE *output, Kernel *const *kernels); // indexed by symbol
+void cgen_kernel(const Kernel *kernel);
+void cgen_line(const Ir *ir, const IrBody *body);
+void cgen_end(int globals); // how many slots the globals take
+
+#endif // CGEN_INCLUDED
@@ -1,30 +1,48 @@
 #include "codegen.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
 
+#include "ir.h"
+#include "cgen.h"
+#include "peep.h"
 #include "node.h"
 #include "object.h"
 #include "values.h"
-#include "env.h"
 #include "error.h"
 #include "gc.h"
 #include "opts.h"
+#include "types.h"
+#include "symbol.h"
+#include "arena.h"
 
 
-// TODO: only do type assertions where necessary
-// TODO: only save registers when they need to be saved
-// TODO: lexical addressing
-
 #define REG_VAL  "%r12"
 #define REG_ENV  "%r13"
 #define REG_LINK "%r14"
 #define REG_TMP  "%r15"
+#define REG_HEAP "%rbx" // the allocation cursor, see gc.h
 
 typedef enum {
 	LinkNext,
 	LinkReturn
 } Linkage;
 
+// the assembly goes to stdout, or to the JIT
+static FILE *out = NULL;
+static int  in_process = 0; // whether the code runs along with the interpreter
+
+// NOTE: the assembly goes through the peephole pass
+static void emit(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	peep_emit(fmt, args);
+	va_end(args);
+}
+
 static int generate_id(void)
 {
 	static int id = 0;
@@ -32,442 +50,2254 @@ static int generate_id(void)
 	return id;
 }
 
-static int forceable(const Node *expr)
+// Variables are resolved at compile time. A parameter is found by walking
+// up the frames of the enclosing functions, everything else is a global
+// and lives in a static slot of the `globals` array.
+typedef struct Scope Scope;
+
+struct Scope {
+	Symbol      name;
+	const Scope *prev;
+};
+
+static const Scope *scope = NULL;
+
+static struct {
+	int *slots; // indexed by symbol, -1 for the symbols without a slot
+	int size;
+	int count;
+} globals = {0};
+
+// In-process, a load of a global that may be unbound jumps to a stub that
+// tells the JIT which one was (see Failure), they follow the unit.
+static struct {
+	int *ids;
+	int *slots;
+	int count;
+	int capacity;
+} unbound = {0};
+
+static int global_slot(Symbol name)
 {
-	if (!lazy)
-		return 0;
-	switch (expr->type) {
-		case IdNode:
-			return 1;
-		case ApplNode:
-			return 1;
-		case IfNode:
-			return forceable(IfNode_true(expr)) || forceable(IfNode_false(expr));
-		case ExptNode:
-		case ProdNode:
-		case SumNode:
-		case CmpNode:
-		case AndNode:
-		case OrNode:
-			return forceable(PairNode_left(expr)) || forceable(PairNode_right(expr));
-		case LetNode:
-		case NumberNode:
-		case FnNode:
+	if (name >= globals.size) {
+		int size = globals.size ? globals.size * 2 : 256;
+		while (size <= name) {
+			size *= 2;
+		}
+		globals.slots = realloc(globals.slots, size * sizeof(*globals.slots));
+		for (int i = globals.size; i < size; i++) {
+			globals.slots[i] = -1;
+		}
+		globals.size = size;
 	}
-	return 0;
+	if (globals.slots[name] < 0) {
+		globals.slots[name] = globals.count;
+		globals.count += 1;
+	}
+	return globals.slots[name];
+}
+
+// The other functions bound only once at the top level, those that aren't
+// kernels (see codegen.h), are known from where their definition is
+// compiled on: they are called by jumping to their code directly.
+typedef struct {
+	int id;      // the label of the code
+	int defined; // whether the definition has been compiled
+} Known;
+
+static struct {
+	const Node **lets;    // the top-level definitions, in order
+	const Type **types;
+	int        count;
+	int        capacity;
+	Kernel     **kernels; // indexed by symbol, NULL for the other names
+	Known      **known;   // likewise
+	int        size;
+} program = {0};
+
+static const Kernel *native = NULL; // the kernel being compiled
+
+// The slots pushed since the entry of the code being compiled, the deepest
+// first. They are what the stack maps of its continuations describe (see
+// gc.h). A function or a thunk that calls anything starts its segment by
+// saving REG_LINK.
+static struct {
+	PtrType *types;
+	int     depth;
+	int     capacity;
+	int     base;      // where the segment of the code being compiled starts
+	int     outermost; // whether it is main
+	int     maps;      // emitted so far
+} slots = {0};
+
+typedef struct {
+	int base;
+	int outermost;
+} Segment;
+
+static Segment slots_enter(void)
+{
+	Segment outer = {slots.base, slots.outermost};
+	slots.base = slots.depth;
+	slots.outermost = 0;
+	return outer;
+}
+
+static void slots_leave(Segment outer)
+{
+	slots.depth = slots.base;
+	slots.base = outer.base;
+	slots.outermost = outer.outermost;
+}
+
+static void slots_push(PtrType type)
+{
+	if (slots.depth == slots.capacity) {
+		slots.capacity = slots.capacity ? slots.capacity * 2 : 64;
+		slots.types = realloc(slots.types, slots.capacity * sizeof(*slots.types));
+	}
+	slots.types[slots.depth] = type;
+	slots.depth += 1;
+}
+
+static void slots_pop(void)
+{
+	slots.depth -= 1;
+}
+
+// defines the label of a continuation along with its stack map,
+// `label` is a format for `id`
+static void compile_continuation(const char *label, int id)
+{
+	int map = generate_id();
+	emit(label, id);
+	emit(":\n");
+	emit(".section .rodata\n");
+	emit("sm%d:\n", map);
+	for (int i = slots.depth - 1; i >= slots.base; i--) {
+		emit(i == slots.depth - 1 ? "	.byte %d" : ", %d", slots.types[i]);
+		emit(i > slots.base ? "" : "\n");
+	}
+	emit(".section stackmaps, \"aw\"\n");
+	emit("	.quad ");
+	emit(label, id);
+	emit("\n");
+	emit("	.long %d\n", slots.depth - slots.base);
+	emit("	.long %d\n", slots.outermost);
+	emit("	.quad sm%d\n", map);
+	emit(".text\n");
+	slots.maps += 1;
 }
 
-static void compile_dispatch(const Node *expr, Linkage l);
+// NOTE: the stack of compiled code grows by single slots,
+// so it is aligned for the C calls
+static void compile_c_call(const char *fn)
+{
+	emit("	push %%rsp\n");
+	emit("	push (%%rsp)\n");
+	emit("	and $-16, %%rsp\n");
+	emit("	call %s\n", fn);
+	emit("	mov 8(%%rsp), %%rsp\n");
+}
 
+// NOTE: compiled code only allocates from the regions, so the GC can only
+// have something to do once GC_region_refill has asked for a collection.
+// The environment is empty at the top level, REG_ENV isn't kept there.
 static void compile_gc_call(void)
 {
-	printf("	mov gc(%%rip), %%rdi\n");
-	printf("	mov %s, %%rsi\n", REG_ENV);
-	printf("	mov %%rsp, %%rdx\n");
-	printf("	mov %%rbp, %%rcx\n");
-	printf("	call GC_collect_comp\n");
+	int id = generate_id();
+	emit("	cmpl $0, %%fs:GC_collect_pending@tpoff\n");
+	emit("	je gc_skip%d\n", id);
+	emit("	mov gc(%%rip), %%rdi\n");
+	emit("	mov %%rsp, %%rdx\n");
+	if (slots.outermost) {
+		emit("	mov $0, %%rsi\n");
+		emit("	mov $0, %%rcx\n");
+	} else {
+		emit("	mov %s, %%rsi\n", REG_ENV);
+		emit("	mov %s, %%rcx\n", REG_LINK);
+	}
+	compile_c_call("GC_collect_comp");
+	emit("gc_skip%d:\n", id);
 }
 
 static void compile_stack_push(PtrType type, const char *reg)
 {
-	printf("	push %s\n", reg);
-	printf("	pushq $%d\n", type);
+	emit("	push %s\n", reg);
+	slots_push(type);
 }
 
 static void compile_stack_pop(const char *reg)
 {
-	printf("	add $8, %%rsp\n");
-	printf("	pop %s\n", reg);
+	emit("	pop %s\n", reg);
+	slots_pop();
+}
+
+static const IrBody *current = NULL; // the body being lowered
+
+// the slots of the frame of a function that keeps it on the stack
+static int frame_slots(const IrBody *body)
+{
+	return body->stacked ? (int)sizeof(Frame) / 8 : 0;
+}
+
+// NOTE: the code that follows a return or a tail call is reached
+// with the saved link still on the stack, and the frame and the flag
+// of lower_loop above it
+static void compile_link_pop(void)
+{
+	int slots = frame_slots(current) + (current->loops > 1);
+	if (slots) {
+		emit("	add $%d, %%rsp\n", 8 * slots);
+	}
+	if (current->link) {
+		emit("	pop %s\n", REG_LINK);
+	}
 }
 
 static void compile_ret(void)
 {
-	compile_stack_pop(REG_LINK);
-	printf("	jmp *%s\n", REG_LINK);
+	compile_link_pop();
+	emit("	jmp *%s\n", REG_LINK);
 }
 
 static void compile_force_sub(void)
 {
-	printf("force:\n");
-	printf("	cmpl $%d, (%s)\n", CompthunkObject, REG_VAL);
-	printf("	jne force_ret\n");
-	printf("	cmpq $0, %d(%s)\n", ObjFldOff(CompThunk, value), REG_VAL);
-	printf("	jne force_get_value\n");
+	emit("force:\n");
+	emit("	cmpl $%d, (%s)\n", CompthunkObject, REG_VAL);
+	emit("	jne force_ret\n");
+	emit("	cmpq $0, %d(%s)\n", ObjFldOff(CompThunk, value), REG_VAL);
+	emit("	jne force_get_value\n");
 	compile_stack_push(PTR_ADDR, REG_LINK);
 	compile_stack_push(PTR_OBJ, REG_VAL);
-	printf("	lea force_recurse(%%rip), %s\n", REG_LINK);
-	printf("	mov %d(%s), %s\n", ObjFldOff(CompThunk, env), REG_VAL, REG_ENV);
-	printf("	jmp *%d(%s)\n", ObjFldOff(CompThunk, text), REG_VAL);
-	printf("force_recurse:\n");
-	printf("	lea force_computed(%%rip), %s\n", REG_LINK);
-	printf("	jmp force\n");
-	printf("force_computed:\n");
+	emit("	lea force_recurse(%%rip), %s\n", REG_LINK);
+	emit("	mov %d(%s), %s\n", ObjFldOff(CompThunk, env), REG_VAL, REG_ENV);
+	emit("	jmp *%d(%s)\n", ObjFldOff(CompThunk, text), REG_VAL);
+	compile_continuation("force_recurse", 0);
+	emit("	lea force_computed(%%rip), %s\n", REG_LINK);
+	emit("	jmp force\n");
+	compile_continuation("force_computed", 0);
 	compile_stack_pop(REG_TMP);
 	compile_stack_pop(REG_LINK);
-	printf("	movq %s, %d(%s)\n", REG_VAL, ObjFldOff(CompThunk, value), REG_TMP);
-	printf("	jmp force_ret\n");
-	printf("force_get_value:\n");
-	printf("	mov %d(%s), %s\n", ObjFldOff(CompThunk, value), REG_VAL, REG_VAL);
-	printf("force_ret:\n");
-	printf("	jmp *%s\n", REG_LINK);
+	emit("	movq %s, %d(%s)\n", REG_VAL, ObjFldOff(CompThunk, value), REG_TMP);
+	emit("	jmp force_ret\n");
+	emit("force_get_value:\n");
+	emit("	mov %d(%s), %s\n", ObjFldOff(CompThunk, value), REG_VAL, REG_VAL);
+	emit("force_ret:\n");
+	emit("	jmp *%s\n", REG_LINK);
 }
 
-static void compile_force_call(void)
+// Arithmetic and comparisons are compiled unboxed: a subtree of them keeps
+// its intermediate results in xmm registers and only the final result is
+// boxed. Registers are allocated like a stack, the result of an expression
+// compiled into xmm<reg> goes there and xmm0..xmm<reg-1> hold live values,
+// which are spilled around anything that may clobber them (calls).
+#define XMM_REGS    15 // allocatable registers
+#define XMM_SCRATCH 15 // used for the right operand once they run out
+#define XMM_ALL     16
+
+// NOTE: the region is refilled with the floats still live, allocating
+// never clobbers the xmm registers
+static void compile_refill_sub(void)
 {
-	int id = generate_id();
-	printf("	cmpl $%d, (%s)\n", CompthunkObject, REG_VAL);
-	printf("	jne force_end%d\n", id);
-	compile_stack_push(PTR_OBJ, REG_ENV);
-	printf("	lea force_done%d(%%rip), %s\n", id, REG_LINK);
-	printf("	jmp force\n");
-	printf("force_done%d:\n", id);
-	compile_stack_pop(REG_ENV);
-	printf("force_end%d:\n", id);
+	emit("region_refill:\n");
+	emit("	sub $%d, %%rsp\n", 8 * XMM_ALL);
+	for (int i = 0; i < XMM_ALL; i++) {
+		emit("	movsd %%xmm%d, %d(%%rsp)\n", i, 8 * i);
+	}
+	emit("	mov gc(%%rip), %%rdi\n");
+	compile_c_call("GC_region_refill");
+	emit("	mov %%rax, %s\n", REG_HEAP);
+	for (int i = 0; i < XMM_ALL; i++) {
+		emit("	movsd %d(%%rsp), %%xmm%d\n", 8 * i, i);
+	}
+	emit("	add $%d, %%rsp\n", 8 * XMM_ALL);
+	emit("	ret\n");
 }
 
-static void compile_type_assertion(ObjectType type)
+// leaves the handle of the new object in %rax, its fields are for the caller
+#define compile_alloc(type, otype) \
+	compile_alloc_object(sizeof(type), offsetof(type, handle), otype)
+
+static void compile_alloc_object(int size, int handle, ObjectType type)
 {
-	printf("	cmpl $%d, (%s)\n", type, REG_VAL);
-	printf("	jne failure\n");
+	int id = generate_id();
+	emit("	add $%d, %s\n", size, REG_HEAP);
+	emit("	cmp %%fs:GC_region_limit@tpoff, %s\n", REG_HEAP);
+	emit("	jbe alloc%d\n", id);
+	emit("	mov $%d, %%esi\n", size);
+	emit("	call region_refill\n");
+	emit("alloc%d:\n", id);
+	emit("	lea %d(%s), %%rax\n", handle - size, REG_HEAP);
+	emit("	movl $%d, %d(%%rax)\n", type, (int)offsetof(Object, type));
+	emit("	movl $%d, %d(%%rax)\n", GC_FRESH, (int)offsetof(Object, mark));
+	emit("	movl $1, %d(%%rax)\n", (int)offsetof(Object, region));
 }
 
-static void compile_num(const Node *expr)
+static void compile_type_assertion(ObjectType type)
 {
-	int id = generate_id();
-	printf(".data\n");
-	printf("v%d: .double %lf\n", id, NumNode_value(expr));
-	printf(".text\n");
-	printf("	mov gc(%%rip), %%rdi\n");
-	printf("	movsd v%d(%%rip), %%xmm0\n", id);
-	printf("	call GC_alloc_number\n");
-	printf("	mov %%rax, %s\n", REG_VAL);
+	emit("	cmpl $%d, (%s)\n", type, REG_VAL);
+	emit("	jne fail_type\n");
 }
 
-static void compile_id(const Node *expr)
+// NOTE: in-process, the closures of the interpreter are called like the
+// compiled ones (see values.h)
+static void compile_callee_assertion(void)
 {
+	if (!in_process) {
+		return compile_type_assertion(CompfnObject);
+	}
 	int id = generate_id();
-	printf(".data\n");
-	printf("i%d: .asciz \"%s\"\n", id, IdNode_value(expr));
-	printf(".text\n");
-	printf("	lea %d(%s), %%rdi\n", ObjValOff(Env), REG_ENV);
-	printf("	lea i%d(%%rip), %%rsi\n", id);
-	printf("	call Env_get\n");
-	printf("	cmpq $0, %%rax\n");
-	printf("	je failure\n");
-	printf("	mov %%rax, %s\n", REG_VAL);
+	emit("	cmpl $%d, (%s)\n", CompfnObject, REG_VAL);
+	emit("	je callee%d\n", id);
+	compile_type_assertion(FnObject);
+	emit("callee%d:\n", id);
 }
 
-static void compile_if(const Node *expr, Linkage l)
+// Literals and the functions that don't capture any parameters are
+// allocated statically, in the data section. The objects are marked as
+// permanent, so the GC neither scans nor frees them.
+static void compile_static_handle(ObjectType type)
 {
-	int id = generate_id();
-	compile_dispatch(IfNode_cond(expr), LinkNext);
-	if (forceable(IfNode_cond(expr))) {
-		compile_force_call();
-	}
-	if (!typed) {
-		compile_type_assertion(NumObject);
-	}
-	printf("	cmpq $0, %d(%s)\n", ObjFldOff(Num, num), REG_VAL);
-	printf("	je false_branch%d\n", id);
-	printf("true_branch%d:\n", id);
-	compile_dispatch(IfNode_true(expr), l);
-	printf("	jmp if_end%d\n", id);
-	printf("false_branch%d:\n", id);
-	compile_dispatch(IfNode_false(expr), l);
-	printf("if_end%d:\n", id);
+	emit("	.long %d\n", type);
+	emit("	.zero %d\n", (int)(offsetof(Object, next) - sizeof(ObjectType)));
+	emit("	.quad 0\n");
+	emit("	.long %d\n", GC_PERMANENT);
+	emit("	.zero %d\n", (int)(sizeof(Object) - offsetof(Object, mark) - sizeof(int)));
 }
 
-static void compile_fn(const Node *expr)
+static void compile_num(double value)
 {
 	int id = generate_id();
-	printf(".data\n");
-	printf("	a%d: .asciz \"%s\"\n", id, FnNode_param_value(expr));
-	printf(".text\n");
-	printf("	jmp fn_end%d\n", id);
-	printf("fn%d:\n", id);
-	printf("	mov gc(%%rip), %%rdi\n");
-	printf("	mov %s, %%rsi\n", REG_ENV);
-	printf("	call GC_alloc_env\n");
-	printf("	mov %%rax, %s\n", REG_ENV);
-	printf("	lea %d(%%rax), %%rdi\n", ObjValOff(Env));
-	printf("	lea a%d(%%rip), %%rsi\n", id);
-	printf("	mov %s, %%rdx\n", REG_VAL);
-	printf("	call Env_add\n");
-	compile_gc_call();
-	compile_stack_push(PTR_ADDR, REG_LINK);
-	compile_dispatch(FnNode_body(expr), LinkReturn);
-	printf("fn_end%d:\n", id);
-	printf("	mov gc(%%rip), %%rdi\n");
-	printf("	mov %s, %%rsi\n", REG_ENV);
-	printf("	lea fn%d(%%rip), %%rdx\n", id);
-	printf("	call GC_alloc_compfn\n");
-	printf("	mov %%rax, %s\n", REG_VAL);
+	emit(".data\n");
+	emit("	.balign 8\n");
+	emit("	.double %.17e\n", value);
+	emit("n%d:\n", id);
+	compile_static_handle(NumObject);
+	emit(".text\n");
+	emit("	lea n%d(%%rip), %s\n", id, REG_VAL);
 }
 
-static void compile_application(const Node *expr, Linkage l)
+static void compile_xmm_spill(int count)
 {
-	int id = generate_id();
-	compile_dispatch(PairNode_left(expr), LinkNext);
-	if (forceable(PairNode_left(expr))) {
-		compile_force_call();
-	}
-	if (!typed) {
-		compile_type_assertion(CompfnObject);
-	}
-	compile_stack_push(PTR_OBJ, REG_VAL);
-	if (lazy) {
-		printf("	jmp thunk_end%d\n", id);
-		printf("thunk%d:\n", id);
-		compile_stack_push(PTR_ADDR, REG_LINK);
-		compile_gc_call();
-		compile_dispatch(PairNode_right(expr), LinkReturn);
-		printf("thunk_end%d:\n", id);
-		printf("	mov gc(%%rip), %%rdi\n");
-		printf("	mov %s, %%rsi\n", REG_ENV);
-		printf("	lea thunk%d(%%rip), %%rdx\n", id);
-		printf("	call GC_alloc_compthunk\n");
-		printf("	mov %%rax, %s\n", REG_VAL);
-	} else {
-		compile_dispatch(PairNode_right(expr), LinkNext);
-	}
-	compile_stack_pop(REG_TMP);
-	if (l == LinkNext) {
-		compile_stack_push(PTR_OBJ, REG_ENV);
-	}
-	printf("	mov %d(%s), %s\n", ObjFldOff(CompFn, env), REG_TMP, REG_ENV);
-	if (l == LinkNext) {
-		printf("	lea after_call%d(%%rip), %s\n", id, REG_LINK);
-		printf("	jmp *%d(%s)\n", ObjFldOff(CompFn, text), REG_TMP);
-		printf("after_call%d:\n", id);
-		compile_stack_pop(REG_ENV);
-	} else {
-		compile_stack_pop(REG_LINK);
-		printf("	jmp *%d(%s)\n", ObjFldOff(CompFn, text), REG_TMP);
+	for (int i = 0; i < count; i++) {
+		emit("	sub $8, %%rsp\n");
+		emit("	movsd %%xmm%d, (%%rsp)\n", i);
+		slots_push(PTR_ADDR);
 	}
 }
 
-static void compile_let(const Node *expr)
+static void compile_xmm_restore(int count)
 {
-	int id = generate_id();
-	printf(".data\n");
-	printf("i%d: .asciz \"%s\"\n", id, LetNode_name_value(expr));
-	printf(".text\n");
-	compile_dispatch(LetNode_value(expr), LinkNext);
-	printf("	lea %d(%s), %%rdi\n", ObjValOff(Env), REG_ENV);
-	printf("	lea i%d(%%rip), %%rsi\n", id);
-	printf("	mov %s, %%rdx\n", REG_VAL);
-	printf("	call Env_add\n");
+	for (int i = count - 1; i >= 0; i--) {
+		emit("	movsd (%%rsp), %%xmm%d\n", i);
+		emit("	add $8, %%rsp\n");
+		slots_pop();
+	}
 }
 
-static void compile_cmp_pair(int op)
+static void compile_cmp_pair(int op, int left, int right)
 {
 	int id = generate_id();
-	printf("	comisd %%xmm1, %%xmm0\n");
-	printf("	jp cmp_false%d\n", id); /* NAN */
+	emit("	comisd %%xmm%d, %%xmm%d\n", right, left);
+	emit("	jp cmp_false%d\n", id); /* NAN */
 	switch (op) {
 		case '>':
-			printf("	jbe cmp_false%d\n", id);
+			emit("	jbe cmp_false%d\n", id);
 			break;
 		case '<':
-			printf("	jae cmp_false%d\n", id);
+			emit("	jae cmp_false%d\n", id);
 			break;
 		case '=':
-			printf("	jne cmp_false%d\n", id);
+			emit("	jne cmp_false%d\n", id);
 			break;
 	}
-	printf("	movq true(%%rip), %%xmm0\n");
-	printf("	jmp cmp_end%d\n", id);
-	printf("cmp_false%d:\n", id);
-	printf("	movq false(%%rip), %%xmm0\n");
-	printf("cmp_end%d:\n", id);
+	emit("	movq true(%%rip), %%xmm%d\n", left);
+	emit("	jmp cmp_end%d\n", id);
+	emit("cmp_false%d:\n", id);
+	emit("	movq false(%%rip), %%xmm%d\n", left);
+	emit("cmp_end%d:\n", id);
+}
+
+// The truth of a number is decided by comparing it with 0, like the
+// interpreter does: -0 is false and NAN is true, as the raw bits wouldn't
+// tell. `operand` is an xmm register or a memory operand.
+static void compile_test(const char *operand)
+{
+	emit("	xorpd %%xmm%d, %%xmm%d\n", XMM_SCRATCH, XMM_SCRATCH);
+	emit("	ucomisd %s, %%xmm%d\n", operand, XMM_SCRATCH);
 }
 
-static void compile_pair(const Node *expr)
+// jumps to the `label` (a format for `id`) when the number compile_test
+// compared is `truth`, the unordered NAN sets ZF too
+static void compile_test_jump(int truth, const char *label, int id)
 {
-	int op = PairNode_op(expr);
-	compile_dispatch(PairNode_left(expr), LinkNext);
-	if (forceable(PairNode_left(expr))) {
-		compile_force_call();
+	char target[64];
+	snprintf(target, sizeof(target), label, id);
+	if (truth) {
+		emit("	jp %s\n", target);
+		emit("	jne %s\n", target);
+	} else {
+		int nan = generate_id();
+		emit("	jp test_nan%d\n", nan);
+		emit("	je %s\n", target);
+		emit("test_nan%d:\n", nan);
 	}
-	if (!typed) {
-		compile_type_assertion(NumObject);
+}
+
+static void compile_test_xmm(int reg)
+{
+	char operand[16];
+	snprintf(operand, sizeof(operand), "%%xmm%d", reg);
+	compile_test(operand);
+}
+
+// NOTE: the libm calls take their arguments in xmm0 and xmm1
+static void compile_libm_pair(const char *fn, int left, int right)
+{
+	compile_xmm_spill(left);
+	if (left != 0) {
+		emit("	movsd %%xmm%d, %%xmm0\n", left);
 	}
-	compile_stack_push(PTR_OBJ, REG_VAL);
-	compile_dispatch(PairNode_right(expr), LinkNext);
-	if (forceable(PairNode_right(expr))) {
-		compile_force_call();
+	if (right != 1) {
+		emit("	movsd %%xmm%d, %%xmm1\n", right);
 	}
-	if (!typed) {
-		compile_type_assertion(NumObject);
+	compile_c_call(fn);
+	if (left != 0) {
+		emit("	movsd %%xmm0, %%xmm%d\n", left);
 	}
-	compile_stack_pop(REG_TMP);
-	printf("	movq %d(%s), %%xmm0\n", ObjFldOff(Num, num), REG_TMP);
-	printf("	movq %d(%s), %%xmm1\n", ObjFldOff(Num, num), REG_VAL);
+	compile_xmm_restore(left);
+}
+
+// xmm<left> = xmm<left> `op` xmm<right>
+static int compile_float_op(int op, int left, int right)
+{
 	switch (op) {
 		case '^':
-			printf("	call pow\n");
+			compile_libm_pair("pow", left, right);
 			break;
 		case '*':
-			printf("	mulsd %%xmm1, %%xmm0\n");
+			emit("	mulsd %%xmm%d, %%xmm%d\n", right, left);
 			break;
 		case '/':
-			printf("	divsd %%xmm1, %%xmm0\n");
+			emit("	divsd %%xmm%d, %%xmm%d\n", right, left);
 			break;
 		case '%':
-			printf("	call fmod\n");
+			compile_libm_pair("fmod", left, right);
 			break;
 		case '+':
-			printf("	addsd %%xmm1, %%xmm0\n");
+			emit("	addsd %%xmm%d, %%xmm%d\n", right, left);
 			break;
 		case '-':
-			printf("	subsd %%xmm1, %%xmm0\n");
+			emit("	subsd %%xmm%d, %%xmm%d\n", right, left);
 			break;
 		case '>':
 		case '<':
 		case '=':
-			compile_cmp_pair(op);
+			compile_cmp_pair(op, left, right);
 			break;
 		default:
 			errorf("compillation error: unknown binary operation: '%c'", op);
-			return;
+			return 0;
 	}
-	printf("	mov gc(%%rip), %%rdi\n");
-	printf("	call GC_alloc_number\n");
-	printf("	mov %%rax, %s\n", REG_VAL);
+	return 1;
 }
 
-static void compile_and(const Node *expr, Linkage l)
+/* kernels */
+
+static int compile_float(const Node *expr, int reg);
+
+static int compile_float_pair(const Node *expr, int reg)
 {
-	int id = generate_id();
-	compile_dispatch(PairNode_left(expr), LinkNext);
-	if (forceable(PairNode_left(expr))) {
-		compile_force_call();
-	}
-	if (!typed) {
-		compile_type_assertion(NumObject);
-	}
-	printf("	cmpq $0, %d(%s)\n", ObjFldOff(Num, num), REG_VAL);
-	printf("	je and_false%d\n", id);
-	compile_dispatch(PairNode_right(expr), l);
-	printf("and_false%d:\n", id);
-	if (l == LinkReturn) {
-		compile_ret();
+	if (!compile_float(PairNode_left(expr), reg)) {
+		return 0;
+	}
+	int right = reg + 1;
+	if (right < XMM_REGS) {
+		if (!compile_float(PairNode_right(expr), right)) {
+			return 0;
+		}
+	} else {
+		compile_xmm_spill(reg + 1);
+		if (!compile_float(PairNode_right(expr), 0)) {
+			return 0;
+		}
+		emit("	movsd %%xmm0, %%xmm%d\n", XMM_SCRATCH);
+		compile_xmm_restore(reg + 1);
+		right = XMM_SCRATCH;
 	}
+	return compile_float_op(PairNode_op(expr), reg, right);
 }
 
-static void compile_or(const Node *expr, Linkage l)
+int kernel_param(const Kernel *kernel, Symbol name)
 {
-	int id = generate_id();
-	compile_dispatch(PairNode_left(expr), LinkNext);
-	if (forceable(PairNode_left(expr))) {
-		compile_force_call();
-	}
-	if (!typed) {
-		compile_type_assertion(NumObject);
-	}
-	printf("	cmpq $0, %d(%s)\n", ObjFldOff(Num, num), REG_VAL);
-	printf("	jne or_true%d\n", id); // ????
-	compile_dispatch(PairNode_right(expr), l);
-	printf("or_true%d:\n", id);
-	if (l == LinkReturn) {
-		compile_ret();
+	for (int i = kernel->arity - 1; i >= 0; i--) {
+		if (IdNode_symbol(kernel->params[i]) == name) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int bound_locally(Symbol name)
+{
+	if (native) {
+		return kernel_param(native, name) >= 0;
+	}
+	for (const Scope *s = scope; s; s = s->prev) {
+		if (s->name == name) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// the kernel `call` applies to all of its arguments, if any
+static const Kernel *kernel_call(const Node *call)
+{
+	int args = 0;
+	const Node *head = call;
+	for (; head->type == ApplNode; head = PairNode_left(head)) {
+		args += 1;
+	}
+	if (head->type != IdNode || IdNode_symbol(head) >= program.size) {
+		return NULL;
+	}
+	const Kernel *kernel = program.kernels[IdNode_symbol(head)];
+	if (!kernel || kernel->arity != args || bound_locally(IdNode_symbol(head))) {
+		return NULL;
+	}
+	return kernel;
+}
+
+void call_args(const Node *call, int arity, const Node **args)
+{
+	for (int i = arity - 1; i >= 0; i--) {
+		args[i] = PairNode_right(call);
+		call = PairNode_left(call);
+	}
+}
+
+// NOTE: the arguments are computed one by one on the stack (except for the
+// last one), so nothing but the spilled registers is live while they are
+static void compile_native_call(const Kernel *kernel, const Node *const *args, int reg)
+{
+	int last = kernel->arity - 1;
+	compile_xmm_spill(reg);
+	for (int i = 0; i < last; i++) {
+		compile_float(args[i], 0);
+		compile_xmm_spill(1);
+	}
+	compile_float(args[last], 0);
+	if (last != 0) {
+		emit("	movsd %%xmm0, %%xmm%d\n", last);
 	}
+	for (int i = last - 1; i >= 0; i--) {
+		emit("	movsd (%%rsp), %%xmm%d\n", i);
+		emit("	add $8, %%rsp\n");
+		slots_pop();
+	}
+	emit("	call nf%d\n", kernel->id);
+	if (reg != 0) {
+		emit("	movsd %%xmm0, %%xmm%d\n", reg);
+	}
+	compile_xmm_restore(reg);
+}
+
+static void compile_float_if(const Node *expr, int reg)
+{
+	int id = generate_id();
+	compile_float(IfNode_cond(expr), reg);
+	compile_test_xmm(reg);
+	compile_test_jump(0, "float_false%d", id);
+	compile_float(IfNode_true(expr), reg);
+	emit("	jmp float_end%d\n", id);
+	emit("float_false%d:\n", id);
+	compile_float(IfNode_false(expr), reg);
+	emit("float_end%d:\n", id);
+}
+
+static void compile_float_logic(const Node *expr, int reg)
+{
+	int id = generate_id();
+	compile_float(PairNode_left(expr), reg);
+	compile_test_xmm(reg);
+	compile_test_jump(expr->type == OrNode, "float_end%d", id);
+	compile_float(PairNode_right(expr), reg);
+	emit("float_end%d:\n", id);
 }
 
-static void compile_dispatch(const Node *expr, Linkage l)
+// the body of a kernel, where everything is a number (see kernel_compatible)
+static int compile_float(const Node *expr, int reg)
 {
-	printf("// "); Node_println(expr);
+	int id;
+	const Kernel *kernel;
+	const Node *args[MAX_KERNEL_ARITY];
 	switch (expr->type) {
 		case NumberNode:
-			compile_num(expr);
-			break;
+			id = generate_id();
+			emit(".data\n");
+			emit("v%d: .double %.17e\n", id, NumNode_value(expr));
+			emit(".text\n");
+			emit("	movsd v%d(%%rip), %%xmm%d\n", id, reg);
+			return 1;
+		case ExptNode:
+		case ProdNode:
+		case SumNode:
+		case CmpNode:
+			return compile_float_pair(expr, reg);
+		case IdNode:
+			emit("	movsd %d(%%rbp), %%xmm%d\n", -8 * (kernel_param(native, IdNode_symbol(expr)) + 1), reg);
+			return 1;
+		case ApplNode:
+			kernel = kernel_call(expr);
+			call_args(expr, kernel->arity, args);
+			compile_native_call(kernel, args, reg);
+			return 1;
+		case IfNode:
+			compile_float_if(expr, reg);
+			return 1;
+		case AndNode:
+		case OrNode:
+			compile_float_logic(expr, reg);
+			return 1;
 		case FnNode:
-			compile_fn(expr);
+		case LetNode:
 			break;
-		case IdNode:
-			compile_id(expr);
+	}
+	error("compillation error: not a part of a kernel");
+	return 0;
+}
+
+// NOTE: a call of the kernel itself in a tail position reuses the frame
+static void compile_kernel_tail(const Kernel *kernel, const Node *expr)
+{
+	int id;
+	switch (expr->type) {
+		case IfNode:
+			id = generate_id();
+			compile_float(IfNode_cond(expr), 0);
+			compile_test_xmm(0);
+			compile_test_jump(0, "tail_false%d", id);
+			compile_kernel_tail(kernel, IfNode_true(expr));
+			emit("tail_false%d:\n", id);
+			compile_kernel_tail(kernel, IfNode_false(expr));
+			return;
+		case AndNode:
+		case OrNode:
+			compile_float(PairNode_left(expr), 0);
+			compile_test_xmm(0);
+			compile_test_jump(expr->type == OrNode, "nf%d_ret", kernel->id);
+			compile_kernel_tail(kernel, PairNode_right(expr));
+			return;
+		case ApplNode:
+			if (kernel_call(expr) == kernel) {
+				const Node *args[MAX_KERNEL_ARITY];
+				call_args(expr, kernel->arity, args);
+				for (int i = 0; i < kernel->arity; i++) {
+					compile_float(args[i], 0);
+					compile_xmm_spill(1);
+				}
+				for (int i = kernel->arity - 1; i >= 0; i--) {
+					emit("	movsd (%%rsp), %%xmm0\n");
+					emit("	add $8, %%rsp\n");
+					slots_pop();
+					emit("	movsd %%xmm0, %d(%%rbp)\n", -8 * (i + 1));
+				}
+				emit("	jmp nf%d_body\n", kernel->id);
+				return;
+			}
+			break;
+		default:
 			break;
+	}
+	compile_float(expr, 0);
+	emit("	jmp nf%d_ret\n", kernel->id);
+}
+
+static void compile_kernel(const Kernel *kernel)
+{
+	emit("	jmp nf%d_end\n", kernel->id);
+	emit("nf%d:\n", kernel->id);
+	emit("	push %%rbp\n");
+	emit("	mov %%rsp, %%rbp\n");
+	emit("	and $-16, %%rsp\n");
+	emit("	sub $%d, %%rsp\n", 16 * ((kernel->arity + 1) / 2));
+	for (int i = 0; i < kernel->arity; i++) {
+		emit("	movsd %%xmm%d, %d(%%rbp)\n", i, -8 * (i + 1));
+	}
+	emit("nf%d_body:\n", kernel->id);
+	// NOTE: the native frames are never walked, there is no GC call in them
+	Segment outer = slots_enter();
+	native = kernel;
+	compile_kernel_tail(kernel, kernel->body);
+	native = NULL;
+	slots_leave(outer);
+	emit("nf%d_ret:\n", kernel->id);
+	emit("	leave\n");
+	emit("	ret\n");
+	emit("nf%d_end:\n", kernel->id);
+}
+
+// whether `expr` can be a part of the body of `kernel`
+static int kernel_compatible(const Kernel *kernel, const Node *expr)
+{
+	switch (expr->type) {
+		case NumberNode:
+			return 1;
+		case IdNode:
+			return kernel_param(kernel, IdNode_symbol(expr)) >= 0;
+		case IfNode:
+			return (
+				kernel_compatible(kernel, IfNode_cond(expr)) &&
+				kernel_compatible(kernel, IfNode_true(expr)) &&
+				kernel_compatible(kernel, IfNode_false(expr))
+			);
 		case ExptNode:
 		case ProdNode:
 		case SumNode:
 		case CmpNode:
-			compile_pair(expr);
-			break;
 		case AndNode:
-			return compile_and(expr, l);
 		case OrNode:
-			return compile_or(expr, l);
-		case IfNode:
-			return compile_if(expr, l);
+			return (
+				kernel_compatible(kernel, PairNode_left(expr)) &&
+				kernel_compatible(kernel, PairNode_right(expr))
+			);
 		case ApplNode:
-			return compile_application(expr, l);
+			native = kernel;
+			const Kernel *callee = kernel_call(expr);
+			native = NULL;
+			if (!callee) {
+				return 0;
+			}
+			const Node *args[MAX_KERNEL_ARITY];
+			call_args(expr, callee->arity, args);
+			for (int i = 0; i < callee->arity; i++) {
+				if (!kernel_compatible(kernel, args[i])) {
+					return 0;
+				}
+			}
+			return 1;
+		case FnNode:
 		case LetNode:
-			compile_let(expr);
-			break;
+			return 0;
 	}
-	// NOTE: AndNode, OrNode, IfNode and ApplNode
-	// must handle linkage themselves
-	if (l == LinkReturn) {
-		compile_ret();
+	return 0;
+}
+
+// n for num -> ... -> num with n arrows, -1 for the other types
+static int numeric_arity(const Type *type)
+{
+	if (type->kind == GenType) {
+		type = GenType_inner(type);
 	}
+	int arity = 0;
+	for (; type->kind == FnType; type = FnType_to(type)) {
+		if (FnType_from(type)->kind != NumType) {
+			return -1;
+		}
+		arity += 1;
+	}
+	return type->kind == NumType ? arity : -1;
 }
 
-void compile(const Node *expr)
+static Kernel *Kernel_new(const Node *let, const Type *type)
 {
-	compile_dispatch(expr, LinkNext);
-	if (forceable(expr)) {
-		compile_force_call();
+	int arity = numeric_arity(type);
+	if (arity < 1 || arity > MAX_KERNEL_ARITY) {
+		return NULL;
 	}
-	if (expr->type != LetNode) {
-		printf("	mov %s, %%rdi\n", REG_VAL);
-		printf("	call Object_println\n");
+	Kernel *kernel = malloc(sizeof(*kernel));
+	kernel->id = generate_id();
+	kernel->name = IdNode_symbol(LetNode_name(let));
+	kernel->arity = arity;
+	const Node *value = LetNode_value(let);
+	for (int i = 0; i < arity; i++) {
+		if (value->type != FnNode) {
+			free(kernel);
+			return NULL;
+		}
+		kernel->params[i] = FnNode_param(value);
+		for (int j = 0; j < i; j++) {
+			if (IdNode_symbol(kernel->params[j]) == IdNode_symbol(kernel->params[i])) {
+				free(kernel);
+				return NULL;
+			}
+		}
+		value = FnNode_body(value);
 	}
-	compile_gc_call();
+	kernel->body = value;
+	return kernel;
 }
 
-void compile_begin(void)
+// NOTE: only the strict mode has the types of everything at hand
+static void find_kernels(const int *definitions)
 {
-	printf(".global main\n");
-	printf(".data\n");
-	printf("gc: .quad 0\n");
-	printf("env: .quad 0\n");
-	printf("true:  .double 1.0\n");
-	printf("false: .double 0.0\n");
-	printf(".text\n");
-	compile_force_sub();
-	printf("main:\n");
-	printf("	push %%rbp\n");
-	printf("	mov %%rsp, %%rbp\n");
-	printf("	call GC_new\n");
-	printf("	mov %%rax, gc(%%rip)\n");
-	printf("	mov %%rax, %%rdi\n");
-	printf("	mov $0, %%rsi\n");
-	printf("	call GC_alloc_env\n");
-	printf("	mov %%rax, env(%%rip)\n");
-	printf("	mov env(%%rip), %s\n", REG_ENV);
+	if (!typed || lazy) {
+		return;
+	}
+	for (int i = 0; i < program.count; i++) {
+		Symbol name = IdNode_symbol(LetNode_name(program.lets[i]));
+		if (definitions[name] != 1) {
+			continue;
+		}
+		Kernel *kernel = Kernel_new(program.lets[i], program.types[i]);
+		if (!kernel) {
+			continue;
+		}
+		// the kernel may call itself
+		program.kernels[name] = kernel;
+		if (!kernel_compatible(kernel, kernel->body)) {
+			program.kernels[name] = NULL;
+			free(kernel);
+		}
+	}
 }
 
-void compile_end(void)
+static void find_known(const int *definitions)
 {
-	printf("	mov gc(%%rip), %%rdi\n");
-	printf("	mov $0, %%rsi\n");
-	printf("	mov $0, %%rdx\n");
-	printf("	call GC_collect\n");
-	printf("	mov gc(%%rip), %%rdi\n");
-	printf("	call GC_drop\n");
-	printf("	mov $0, %%rax\n");
-	printf("	pop %%rbp\n");
-	printf("	ret\n");
-	// TODO: log something maybe?
-	printf("failure:\n");
-	printf("	mov gc(%%rip), %%rdi\n");
-	printf("	mov $0, %%rsi\n");
-	printf("	mov $0, %%rdx\n");
-	printf("	call GC_collect\n");
-	printf("	mov gc(%%rip), %%rdi\n");
-	printf("	call GC_drop\n");
-	printf("	mov %%rbp, %%rsp\n");
-	printf("	mov $1, %%rax\n");
-	printf("	pop %%rbp\n");
-	printf("	ret\n");
+	for (int i = 0; i < program.count; i++) {
+		Symbol name = IdNode_symbol(LetNode_name(program.lets[i]));
+		const Node *value = LetNode_value(program.lets[i]);
+		if (definitions[name] != 1 || value->type != FnNode) {
+			continue;
+		}
+		Known *known = calloc(1, sizeof(*known));
+		known->id = generate_id();
+		program.known[name] = known;
+	}
+}
+
+static void analyze_program(void)
+{
+	program.size = Symbol_count();
+	program.kernels = calloc(program.size, sizeof(*program.kernels));
+	program.known = calloc(program.size, sizeof(*program.known));
+	int *definitions = calloc(program.size, sizeof(*definitions));
+	for (int i = 0; i < program.count; i++) {
+		definitions[IdNode_symbol(LetNode_name(program.lets[i]))] += 1;
+	}
+	find_known(definitions);
+	find_kernels(definitions);
+	free(definitions);
+}
+
+// the known function `expr` refers to, if any
+static const Known *known(const Node *expr)
+{
+	if (expr->type != IdNode || IdNode_symbol(expr) >= program.size) {
+		return NULL;
+	}
+	const Known *known = program.known[IdNode_symbol(expr)];
+	if (!known || !known->defined || bound_locally(IdNode_symbol(expr))) {
+		return NULL;
+	}
+	return known;
+}
+
+// whether `expr` refers to a parameter of the enclosing functions
+// (`scope`), `bound` are the ones it binds itself
+static int captures(const Node *expr, const Scope *bound)
+{
+	if (!scope) {
+		return 0;
+	}
+	switch (expr->type) {
+		case NumberNode:
+			return 0;
+		case IdNode:
+			for (const Scope *s = bound; s; s = s->prev) {
+				if (s->name == IdNode_symbol(expr)) {
+					return 0;
+				}
+			}
+			for (const Scope *s = scope; s; s = s->prev) {
+				if (s->name == IdNode_symbol(expr)) {
+					return 1;
+				}
+			}
+			return 0;
+		case FnNode:
+			return captures(FnNode_body(expr), &(Scope){IdNode_symbol(FnNode_param(expr)), bound});
+		case IfNode:
+			return (
+				captures(IfNode_cond(expr), bound) ||
+				captures(IfNode_true(expr), bound) ||
+				captures(IfNode_false(expr), bound)
+			);
+		case LetNode:
+			return captures(LetNode_value(expr), &(Scope){IdNode_symbol(LetNode_name(expr)), bound});
+		default:
+			return captures(PairNode_left(expr), bound) || captures(PairNode_right(expr), bound);
+	}
+}
+
+// whether a lambda in `expr` captures the parameters in `scope`
+static int encloses(const Node *expr)
+{
+	switch (expr->type) {
+		case NumberNode:
+		case IdNode:
+			return 0;
+		case FnNode:
+			return captures(FnNode_body(expr), &(Scope){IdNode_symbol(FnNode_param(expr)), NULL});
+		case IfNode:
+			return encloses(IfNode_cond(expr)) || encloses(IfNode_true(expr)) || encloses(IfNode_false(expr));
+		case LetNode:
+			return encloses(LetNode_value(expr));
+		default:
+			return encloses(PairNode_left(expr)) || encloses(PairNode_right(expr));
+	}
+}
+
+// whether the value of `expr` is computed unboxed anyway
+static int unboxed(const Node *expr)
+{
+	switch (expr->type) {
+		case ExptNode:
+		case ProdNode:
+		case SumNode:
+		case CmpNode:
+			return 1;
+		case ApplNode:
+			return kernel_call(expr) != NULL;
+		default:
+			return 0;
+	}
+}
+
+/* the intermediate representation */
+
+// The IR of a line is built, analyzed and lowered before the next one is
+// (see ir.h). The floats are allocated like a stack as it is built: the
+// next one goes to xmm<floats>, the ones below are live.
+static Ir      ir;
+static IrBlock *block = NULL; // where the instructions go
+static int     floats = 0;
+
+// The lambdas a known function starts with are entered one by one as it is
+// built. A call of the function with all of its arguments in a tail position
+// of the innermost body starts that body over in the same frames, unless
+// something there captures them (see lower_loop).
+typedef struct {
+	const Known *callee; // NULL outside of its lambdas
+	const Node  *next;   // the lambda of the next parameter
+	int         arity;   // of the lambdas entered so far
+	IrBody      *body;   // the innermost one, once it is entered
+} Self;
+
+static Self self = {0};
+
+static IrInstr *build(IrOp op)
+{
+	return Ir_append(&ir, block, op);
+}
+
+static Temp build_boxed(IrInstr *instr)
+{
+	return Ir_def(&ir, instr, TempBoxed);
+}
+
+static Temp build_float_def(IrInstr *instr, int reg)
+{
+	Temp temp = Ir_def(&ir, instr, TempFloat);
+	ir.temps[temp].reg = reg;
+	return temp;
+}
+
+static Temp build_dispatch(const Node *expr, Linkage l);
+
+static Temp build_return(Temp value)
+{
+	build(IrReturn)->a = value;
+	return -1;
+}
+
+// the value of `expr` used as a NumObject or a FnObject (any closure)
+static Temp build_operand(const Node *expr, ObjectType type)
+{
+	Temp value = build_dispatch(expr, LinkNext);
+	if (lazy) {
+		build(IrForce)->a = value;
+	}
+	IrInstr *check = build(IrAssert);
+	check->a = value;
+	check->type = type;
+	return value;
+}
+
+static Temp build_num(double num)
+{
+	IrInstr *instr = build(IrNum);
+	instr->num = num;
+	return build_boxed(instr);
+}
+
+static Temp build_id(const Node *expr)
+{
+	Symbol name = IdNode_symbol(expr);
+	int depth = 0;
+	for (const Scope *s = scope; s; s = s->prev, depth++) {
+		if (s->name == name) {
+			IrInstr *instr = build(IrParam);
+			instr->name = name;
+			instr->depth = depth;
+			return build_boxed(instr);
+		}
+	}
+	IrInstr *instr = build(IrGlobal);
+	instr->name = name;
+	instr->slot = global_slot(name);
+	return build_boxed(instr);
+}
+
+// the registers computing `expr` unboxed takes
+static int float_need(const Node *expr)
+{
+	const Kernel *kernel;
+	const Node *args[MAX_KERNEL_ARITY];
+	int need = 1;
+	switch (expr->type) {
+		case ExptNode:
+		case ProdNode:
+		case SumNode:
+		case CmpNode:
+			need = float_need(PairNode_right(expr)) + 1;
+			return need > float_need(PairNode_left(expr)) ? need : float_need(PairNode_left(expr));
+		case ApplNode:
+			kernel = kernel_call(expr);
+			if (!kernel) {
+				return 1;
+			}
+			call_args(expr, kernel->arity, args);
+			for (int i = 0; i < kernel->arity; i++) {
+				if (float_need(args[i]) + i > need) {
+					need = float_need(args[i]) + i;
+				}
+			}
+			return need;
+		default:
+			return 1;
+	}
+}
+
+static Temp build_float_tree(const Node *expr);
+
+// NOTE: once the registers run out, the live ones are spilled
+// and the float is computed from xmm0
+static Temp build_float(const Node *expr)
+{
+	int live = floats;
+	if (!live || live + float_need(expr) <= XMM_REGS) {
+		return build_float_tree(expr);
+	}
+	build(IrSpill)->count = live;
+	floats = 0;
+	Temp value = build_float_tree(expr);
+	IrInstr *restore = build(IrRestore);
+	restore->a = value;
+	restore->count = live;
+	floats = live + 1;
+	return build_float_def(restore, live);
+}
+
+// the arguments of a kernel are in consecutive registers
+static Temp build_native(const Kernel *kernel, const Node *const *args)
+{
+	Temp *temps = Arena_alloc(&ir.arena, kernel->arity * sizeof(*temps));
+	for (int i = 0; i < kernel->arity; i++) {
+		temps[i] = build_float(args[i]);
+	}
+	IrInstr *instr = build(IrNative);
+	instr->id = kernel->id;
+	instr->count = kernel->arity;
+	instr->args = temps;
+	floats -= kernel->arity - 1;
+	return build_float_def(instr, ir.temps[temps[0]].reg);
+}
+
+static Temp build_float_tree(const Node *expr)
+{
+	IrInstr *instr;
+	const Kernel *kernel;
+	const Node *args[MAX_KERNEL_ARITY];
+	switch (expr->type) {
+		case NumberNode:
+			instr = build(IrConst);
+			instr->num = NumNode_value(expr);
+			floats += 1;
+			return build_float_def(instr, floats - 1);
+		case ExptNode:
+		case ProdNode:
+		case SumNode:
+		case CmpNode:; // NOTE: the operands first, in order
+			Temp left = build_float(PairNode_left(expr));
+			Temp right = build_float(PairNode_right(expr));
+			instr = build(IrArith);
+			instr->a = left;
+			instr->b = right;
+			instr->arith = PairNode_op(expr);
+			floats -= 1;
+			return build_float_def(instr, ir.temps[left].reg);
+		case ApplNode:
+			kernel = kernel_call(expr);
+			if (kernel) {
+				call_args(expr, kernel->arity, args);
+				return build_native(kernel, args);
+			}
+			break;
+		default:
+			break;
+	}
+	Temp value = build_operand(expr, NumObject);
+	instr = build(IrUnbox);
+	instr->a = value;
+	floats += 1;
+	return build_float_def(instr, floats - 1);
+}
+
+static Temp build_box(Temp value)
+{
+	IrInstr *instr = build(IrBox);
+	instr->a = value;
+	floats -= 1;
+	return build_boxed(instr);
+}
+
+static Temp build_arith(const Node *expr)
+{
+	return build_box(build_float(expr));
+}
+
+// adds the entries of `scope` that `expr` refers to, but the names in
+// `bound`, to the `count` in `vars`, returns how many there are then
+static int free_params(const Node *expr, const Scope *bound, const Scope **vars, int count)
+{
+	switch (expr->type) {
+		case NumberNode:
+			return count;
+		case IdNode:
+			for (const Scope *s = bound; s; s = s->prev) {
+				if (s->name == IdNode_symbol(expr)) {
+					return count;
+				}
+			}
+			for (const Scope *s = scope; s; s = s->prev) {
+				if (s->name != IdNode_symbol(expr)) {
+					continue;
+				}
+				for (int i = 0; i < count; i++) {
+					if (vars[i] == s) {
+						return count;
+					}
+				}
+				vars[count] = s;
+				return count + 1;
+			}
+			return count;
+		case FnNode:
+			return free_params(FnNode_body(expr), &(Scope){IdNode_symbol(FnNode_param(expr)), bound}, vars, count);
+		case IfNode:
+			count = free_params(IfNode_cond(expr), bound, vars, count);
+			count = free_params(IfNode_true(expr), bound, vars, count);
+			return free_params(IfNode_false(expr), bound, vars, count);
+		case LetNode:
+			return free_params(LetNode_value(expr), &(Scope){IdNode_symbol(LetNode_name(expr)), bound}, vars, count);
+		default:
+			count = free_params(PairNode_left(expr), bound, vars, count);
+			return free_params(PairNode_right(expr), bound, vars, count);
+	}
+}
+
+// A closure or a thunk only keeps the parameters it refers to: they are
+// copied into a chain of frames of its own, unless they are all of the
+// environment and it is shared. Returns the scope the body of `instr` is
+// built in, what `expr` refers to is loaded before it is appended.
+static const Scope *build_captured(const Node *expr, const Scope *bound, IrOp op, IrInstr **instr)
+{
+	int length = 0;
+	for (const Scope *s = scope; s; s = s->prev) {
+		length += 1;
+	}
+	const Scope **vars = Arena_alloc(&ir.arena, (length + 1) * sizeof(*vars));
+	int count = free_params(expr, bound, vars, 0);
+	if (!count || count == length) {
+		*instr = build(op);
+		return scope;
+	}
+	Scope *copied = Arena_alloc(&ir.arena, count * sizeof(*copied));
+	Temp *temps = Arena_alloc(&ir.arena, count * sizeof(*temps));
+	int depth = 0;
+	int i = 0;
+	for (const Scope *s = scope; s; s = s->prev, depth++) {
+		for (int j = 0; j < count; j++) {
+			if (vars[j] != s) {
+				continue;
+			}
+			IrInstr *param = build(IrParam);
+			param->name = s->name;
+			param->depth = depth;
+			temps[i] = build_boxed(param);
+			copied[i] = (Scope){s->name, i + 1 < count ? &copied[i + 1] : NULL};
+			i += 1;
+		}
+	}
+	*instr = build(op);
+	(*instr)->count = count;
+	(*instr)->args = temps;
+	return copied;
+}
+
+static IrBody *build_fn_body(const Node *expr, const Kernel *kernel, int id);
+
+// NOTE: when `kernel` is given, the innermost body calls its native entry,
+// `id` is the label of a known function or 0. The wrapper of a kernel refers
+// to all of its parameters, the lambdas a known function starts with share
+// the frames its loop overwrites (see lower_loop).
+static Temp build_fn(const Node *expr, const Kernel *kernel, int id)
+{
+	IrInstr *instr;
+	const Scope *outer = scope;
+	Scope param = {IdNode_symbol(FnNode_param(expr)), NULL};
+	if (kernel || (self.callee && expr == self.next)) {
+		instr = build(IrClosure);
+	} else {
+		scope = build_captured(FnNode_body(expr), &param, IrClosure, &instr);
+	}
+	instr->id = id ? id : generate_id();
+	instr->name = param.name;
+	instr->closed = kernel ? !outer : !captures(FnNode_body(expr), &param);
+	instr->body = build_fn_body(expr, kernel, instr->id);
+	scope = outer;
+	return build_boxed(instr);
+}
+
+static IrBody *build_fn_body(const Node *expr, const Kernel *kernel, int id)
+{
+	IrBody *body = Ir_body(&ir, BodyFn, id);
+	IrBlock *outer = block;
+	int live = floats;
+	block = &body->code;
+	floats = 0;
+	Scope param = {IdNode_symbol(FnNode_param(expr)), scope};
+	scope = &param;
+	Self outer_self = self;
+	if (self.callee && expr == self.next) {
+		self.next = FnNode_body(expr);
+		self.arity += 1;
+		self.body = self.next->type != FnNode ? body : NULL;
+		// NOTE: the arguments would be thunks that capture them
+		if (self.body && (lazy || encloses(self.next))) {
+			self = (Self){0};
+		}
+	} else {
+		self = (Self){0};
+	}
+	if (!kernel) {
+		build_dispatch(FnNode_body(expr), LinkReturn);
+	} else if (FnNode_body(expr)->type == FnNode) {
+		build_return(build_fn(FnNode_body(expr), kernel, 0));
+	} else {
+		build_return(build_box(build_native(kernel, kernel->params)));
+	}
+	self = outer_self;
+	scope = param.prev;
+	block = outer;
+	floats = live;
+	return body;
+}
+
+static Temp build_thunk(const Node *expr)
+{
+	IrInstr *instr;
+	const Scope *outer = scope;
+	scope = build_captured(expr, NULL, IrThunk, &instr);
+	instr->id = generate_id();
+	instr->body = Ir_body(&ir, BodyThunk, instr->id);
+	IrBlock *outer_block = block;
+	int live = floats;
+	block = &instr->body->code;
+	floats = 0;
+	build_dispatch(expr, LinkReturn);
+	block = outer_block;
+	floats = live;
+	scope = outer;
+	return build_boxed(instr);
+}
+
+// the call of the known function being built `call` is, when it can
+// start the innermost body over
+static int self_call(const Node *call, Linkage l)
+{
+	if (!self.body || l != LinkReturn) {
+		return 0;
+	}
+	int args = 0;
+	const Node *head = call;
+	for (; head->type == ApplNode; head = PairNode_left(head)) {
+		args += 1;
+	}
+	return args == self.arity && known(head) == self.callee;
+}
+
+// NOTE: the arguments are computed before any of the frames is overwritten
+static Temp build_loop(const Node *call)
+{
+	const Node **args = Arena_alloc(&ir.arena, self.arity * sizeof(*args));
+	Temp *temps = Arena_alloc(&ir.arena, self.arity * sizeof(*temps));
+	call_args(call, self.arity, args);
+	for (int i = 0; i < self.arity; i++) {
+		temps[i] = build_dispatch(args[i], LinkNext);
+	}
+	IrInstr *instr = build(IrLoop);
+	instr->count = self.arity;
+	instr->args = temps;
+	self.body->loops = self.arity;
+	return -1;
+}
+
+// NOTE: a known function is a static closure, its environment is empty
+static Temp build_application(const Node *expr, Linkage l)
+{
+	if (self_call(expr, l)) {
+		return build_loop(expr);
+	}
+	const Known *callee = known(PairNode_left(expr));
+	Temp fn = callee ? -1 : build_operand(PairNode_left(expr), FnObject);
+	Temp arg = lazy ? build_thunk(PairNode_right(expr)) : build_dispatch(PairNode_right(expr), LinkNext);
+	IrInstr *instr = build(IrCall);
+	instr->a = fn;
+	instr->b = arg;
+	instr->id = callee ? callee->id : 0;
+	instr->tail = l == LinkReturn;
+	return instr->tail ? -1 : build_boxed(instr);
+}
+
+// the value of an arithmetic condition is tested without boxing it first
+static Temp build_if(const Node *expr, Linkage l)
+{
+	const Node *cond = IfNode_cond(expr);
+	IrInstr *instr;
+	if (unboxed(cond)) {
+		Temp value = build_float(cond);
+		floats -= 1;
+		instr = build(IrIf);
+		instr->a = value;
+	} else {
+		Temp value = build_operand(cond, NumObject);
+		instr = build(IrIf);
+		instr->a = value;
+	}
+	instr->tail = l == LinkReturn;
+	IrBlock *outer = block;
+	block = &instr->then;
+	instr->then.result = build_dispatch(IfNode_true(expr), l);
+	block = &instr->other;
+	instr->other.result = build_dispatch(IfNode_false(expr), l);
+	block = outer;
+	return instr->tail ? -1 : build_boxed(instr);
+}
+
+static Temp build_logic(const Node *expr, Linkage l)
+{
+	Temp left = build_operand(PairNode_left(expr), NumObject);
+	IrInstr *instr = build(expr->type == AndNode ? IrAnd : IrOr);
+	instr->a = left;
+	instr->tail = l == LinkReturn;
+	IrBlock *outer = block;
+	block = &instr->then;
+	instr->then.result = build_dispatch(PairNode_right(expr), l);
+	block = outer;
+	return instr->tail ? -1 : build_boxed(instr);
+}
+
+static void build_let(const Node *expr)
+{
+	Symbol name = IdNode_symbol(LetNode_name(expr));
+	const Kernel *kernel = name < program.size ? program.kernels[name] : NULL;
+	Known *known = name < program.size ? program.known[name] : NULL;
+	Temp value;
+	if (known) {
+		// NOTE: it may call itself
+		known->defined = 1;
+		self = (Self){kernel ? NULL : known, LetNode_value(expr), 0, NULL};
+		value = build_fn(LetNode_value(expr), kernel, known->id);
+		self = (Self){0};
+	} else {
+		value = build_dispatch(LetNode_value(expr), LinkNext);
+	}
+	IrInstr *instr = build(IrSet);
+	instr->a = value;
+	instr->name = name;
+	instr->slot = global_slot(name);
+}
+
+static Temp build_dispatch(const Node *expr, Linkage l)
+{
+	Temp value = -1;
+	switch (expr->type) {
+		case NumberNode:
+			value = build_num(NumNode_value(expr));
+			break;
+		case FnNode:
+			value = build_fn(expr, NULL, 0);
+			break;
+		case IdNode:
+			value = build_id(expr);
+			break;
+		case ExptNode:
+		case ProdNode:
+		case SumNode:
+		case CmpNode:
+			value = build_arith(expr);
+			break;
+		case AndNode:
+		case OrNode:
+			return build_logic(expr, l);
+		case IfNode:
+			return build_if(expr, l);
+		case ApplNode:
+			if (kernel_call(expr)) {
+				value = build_arith(expr);
+				break;
+			}
+			return build_application(expr, l);
+		case LetNode:
+			build_let(expr);
+			return -1;
+	}
+	// NOTE: AndNode, OrNode, IfNode and ApplNode
+	// must handle linkage themselves
+	return l == LinkReturn ? build_return(value) : value;
+}
+
+// the value of a line is left forced in REG_VAL
+static IrBody *build_line(const Node *expr)
+{
+	IrBody *body = Ir_body(&ir, BodyLine, 0);
+	block = &body->code;
+	floats = 0;
+	Temp value = build_dispatch(expr, LinkNext);
+	if (lazy && value >= 0) {
+		build(IrForce)->a = value;
+	}
+	body->code.result = value;
+	block = NULL;
+	return body;
+}
+
+static void analyze(IrBody *body)
+{
+	Ir_analyze(&ir, body);
+	if (debug) {
+		Ir_print(&ir, body, stderr);
+	}
+}
+
+/* lowering */
+
+// The boxed temporaries are used in the reverse order of their definition,
+// the last one stays in REG_VAL until something else needs the register
+// and the ones before are pushed. The floats are in the registers they
+// were given, the ones live across a call are spilled around it.
+static Temp val = -1;
+
+// REG_VAL is about to be overwritten
+static void lower_save(const IrInstr *instr)
+{
+	if (val >= 0 && ir.temps[val].last > instr->seq) {
+		compile_stack_push(PTR_OBJ, REG_VAL);
+	}
+	val = -1;
+}
+
+static void lower_take(Temp temp, const char *reg)
+{
+	if (temp != val) {
+		compile_stack_pop(reg);
+	} else if (strcmp(reg, REG_VAL)) {
+		emit("	mov %s, %s\n", REG_VAL, reg);
+	}
+}
+
+static void lower_block(const IrBlock *block);
+
+// The frame of a function that neither calls anything nor has closures and
+// thunks capturing it lives on the stack, above the saved link, and goes
+// away when it returns or makes a tail call. It
+// isn't in the list of the GC, which only marks through it from REG_ENV or
+// the slots REG_ENV is saved in.
+static void lower_frame(const IrBody *body)
+{
+	int id = generate_id();
+	int slots = frame_slots(body);
+	int handle = -ObjValOff(Frame);
+	emit("	sub $%d, %%rsp\n", 8 * slots);
+	for (int i = 0; i < slots; i++) {
+		slots_push(PTR_ADDR);
+	}
+	emit("	movl $%d, %d(%%rsp)\n", FrameObject, handle + (int)offsetof(Object, type));
+	emit("	movl $%d, %d(%%rsp)\n", GC_FRESH, handle + (int)offsetof(Object, mark));
+	emit("	movl $0, %d(%%rsp)\n", handle + (int)offsetof(Object, region));
+	emit("	mov %s, %d(%%rsp)\n", REG_ENV, handle + ObjFldOff(Frame, prev));
+	emit("	mov %s, %d(%%rsp)\n", REG_VAL, handle + ObjFldOff(Frame, value));
+	emit("	lea %d(%%rsp), %s\n", handle, REG_ENV);
+	emit("	lea frame_gc%d(%%rip), %s\n", id, REG_LINK);
+	compile_gc_call();
+	compile_continuation("frame_gc%d", id);
+}
+
+static void lower_body(const IrBody *body)
+{
+	const IrBody *outer = current;
+	Temp outer_val = val;
+	current = body;
+	val = -1;
+	if (body->kind != BodyLine && body->link) {
+		compile_stack_push(PTR_ADDR, REG_LINK);
+	}
+	if (frame_slots(body)) {
+		lower_frame(body);
+	}
+	if (body->loops > 1) {
+		emit("	push $0\n");
+		slots_push(PTR_ADDR);
+	}
+	if (body->loops) {
+		emit("fn%d_loop:\n", body->id);
+	}
+	lower_block(&body->code);
+	current = outer;
+	val = outer_val;
+}
+
+// the code at fn<id>, entered with the argument in REG_VAL
+static void lower_fn_code(const IrBody *body)
+{
+	emit("fn%d:\n", body->id);
+	Segment outer = slots_enter();
+	if (!body->stacked) {
+		compile_alloc(Frame, FrameObject);
+		emit("	mov %s, %d(%%rax)\n", REG_ENV, ObjFldOff(Frame, prev));
+		emit("	mov %s, %d(%%rax)\n", REG_VAL, ObjFldOff(Frame, value));
+		emit("	mov %%rax, %s\n", REG_ENV);
+		compile_gc_call();
+	}
+	lower_body(body);
+	slots_leave(outer);
+}
+
+// leaves the chain of frames `instr` copies its parameters into in REG_TMP,
+// returns where its environment is
+static const char *lower_copies(const IrInstr *instr)
+{
+	if (!instr->count) {
+		return REG_ENV;
+	}
+	int last = instr->count - 1;
+	lower_take(instr->args[last], REG_VAL);
+	for (int i = last; i >= 0; i--) {
+		if (i < last) {
+			compile_stack_pop(REG_VAL);
+		}
+		compile_alloc(Frame, FrameObject);
+		if (i == last) {
+			emit("	movq $0, %d(%%rax)\n", ObjFldOff(Frame, prev));
+		} else {
+			emit("	mov %s, %d(%%rax)\n", REG_TMP, ObjFldOff(Frame, prev));
+		}
+		emit("	mov %s, %d(%%rax)\n", REG_VAL, ObjFldOff(Frame, value));
+		emit("	mov %%rax, %s\n", REG_TMP);
+	}
+	return REG_TMP;
+}
+
+// NOTE: in process the closure points to the name of its parameter, which
+// the interpreter prints it with
+static void lower_closure(const IrInstr *instr, const char *env)
+{
+	int id = instr->id;
+	unsigned long arg = in_process ? (unsigned long)Symbol_name(instr->name) : 0;
+	emit("	jmp fn_end%d\n", id);
+	lower_fn_code(instr->body);
+	emit("fn_end%d:\n", id);
+	if (instr->closed) {
+		emit(".data\n");
+		emit("	.balign 8\n");
+		emit("	.quad %lu\n", arg);
+		emit("	.quad 0\n");
+		emit("	.quad fn%d\n", id);
+		emit("c%d:\n", id);
+		compile_static_handle(CompfnObject);
+		emit(".text\n");
+		emit("	lea c%d(%%rip), %s\n", id, REG_VAL);
+		return;
+	}
+	if (arg) {
+		emit(".data\n");
+		emit("arg%d: .quad %lu\n", id, arg);
+		emit(".text\n");
+	}
+	compile_alloc(CompFn, CompfnObject);
+	if (arg) {
+		emit("	mov arg%d(%%rip), %%rdx\n", id);
+		emit("	mov %%rdx, %d(%%rax)\n", ObjFldOff(CompFn, arg));
+	} else {
+		emit("	movq $0, %d(%%rax)\n", ObjFldOff(CompFn, arg));
+	}
+	emit("	mov %s, %d(%%rax)\n", env, ObjFldOff(CompFn, env));
+	emit("	lea fn%d(%%rip), %%rdx\n", id);
+	emit("	mov %%rdx, %d(%%rax)\n", ObjFldOff(CompFn, text));
+	emit("	mov %%rax, %s\n", REG_VAL);
+}
+
+static void lower_thunk(const IrInstr *instr, const char *env)
+{
+	int id = instr->id;
+	emit("	jmp thunk_end%d\n", id);
+	emit("thunk%d:\n", id);
+	Segment outer = slots_enter();
+	compile_gc_call();
+	lower_body(instr->body);
+	slots_leave(outer);
+	emit("thunk_end%d:\n", id);
+	compile_alloc(CompThunk, CompthunkObject);
+	if (current->kind == BodyLine && !instr->count) {
+		emit("	movq $0, %d(%%rax)\n", ObjFldOff(CompThunk, env));
+	} else {
+		emit("	mov %s, %d(%%rax)\n", env, ObjFldOff(CompThunk, env));
+	}
+	emit("	lea thunk%d(%%rip), %%rdx\n", id);
+	emit("	mov %%rdx, %d(%%rax)\n", ObjFldOff(CompThunk, text));
+	emit("	movq $0, %d(%%rax)\n", ObjFldOff(CompThunk, value));
+	emit("	mov %%rax, %s\n", REG_VAL);
+}
+
+// NOTE: a variable forced before holds a thunk with its value already
+static void lower_force(const IrInstr *instr)
+{
+	int id = generate_id();
+	lower_take(instr->a, REG_VAL);
+	emit("	cmpl $%d, (%s)\n", CompthunkObject, REG_VAL);
+	emit("	jne force_end%d\n", id);
+	if (instr->evaluated) {
+		emit("	mov %d(%s), %s\n", ObjFldOff(CompThunk, value), REG_VAL, REG_VAL);
+	} else {
+		compile_xmm_spill(instr->floats);
+		if (instr->env) {
+			compile_stack_push(PTR_OBJ, REG_ENV);
+		}
+		emit("	lea force_done%d(%%rip), %s\n", id, REG_LINK);
+		emit("	jmp force\n");
+		compile_continuation("force_done%d", id);
+		if (instr->env) {
+			compile_stack_pop(REG_ENV);
+		}
+		compile_xmm_restore(instr->floats);
+	}
+	emit("force_end%d:\n", id);
+}
+
+static void lower_param(const IrInstr *instr)
+{
+	emit("	mov %s, %s\n", REG_ENV, REG_VAL);
+	for (int i = 0; i < instr->depth; i++) {
+		emit("	mov %d(%s), %s\n", ObjFldOff(Frame, prev), REG_VAL, REG_VAL);
+	}
+	emit("	mov %d(%s), %s\n", ObjFldOff(Frame, value), REG_VAL, REG_VAL);
+}
+
+static void lower_global(const IrInstr *instr)
+{
+	emit("	mov globals+%d(%%rip), %s\n", 8 * instr->slot, REG_VAL);
+	if (!instr->bound && !in_process) {
+		emit("	cmpq $0, %s\n", REG_VAL);
+		emit("	je failure\n");
+	} else if (!instr->bound) {
+		if (unbound.count == unbound.capacity) {
+			unbound.capacity = unbound.capacity ? unbound.capacity * 2 : 64;
+			unbound.ids = realloc(unbound.ids, unbound.capacity * sizeof(*unbound.ids));
+			unbound.slots = realloc(unbound.slots, unbound.capacity * sizeof(*unbound.slots));
+		}
+		int id = generate_id();
+		unbound.ids[unbound.count] = id;
+		unbound.slots[unbound.count] = instr->slot;
+		unbound.count += 1;
+		emit("	cmpq $0, %s\n", REG_VAL);
+		emit("	je unbound%d\n", id);
+	}
+}
+
+static void lower_const(const IrInstr *instr)
+{
+	int id = generate_id();
+	emit(".data\n");
+	emit("v%d: .double %.17e\n", id, instr->num);
+	emit(".text\n");
+	emit("	movsd v%d(%%rip), %%xmm%d\n", id, ir.temps[instr->dst].reg);
+}
+
+// NOTE: the floats below the arguments are live
+static void lower_native(const IrInstr *instr)
+{
+	int reg = ir.temps[instr->args[0]].reg;
+	compile_xmm_spill(reg);
+	for (int i = 0; reg && i < instr->count; i++) {
+		emit("	movsd %%xmm%d, %%xmm%d\n", reg + i, i);
+	}
+	emit("	call nf%d\n", instr->id);
+	if (reg != 0) {
+		emit("	movsd %%xmm0, %%xmm%d\n", reg);
+	}
+	compile_xmm_restore(reg);
+}
+
+static void lower_box(const IrInstr *instr)
+{
+	compile_alloc(Num, NumObject);
+	emit("	movsd %%xmm%d, %d(%%rax)\n", ir.temps[instr->a].reg, ObjFldOff(Num, num));
+	emit("	mov %%rax, %s\n", REG_VAL);
+}
+
+static void lower_restore(const IrInstr *instr)
+{
+	emit("	movsd %%xmm%d, %%xmm%d\n", ir.temps[instr->a].reg, instr->count);
+	compile_xmm_restore(instr->count);
+}
+
+static void lower_call(const IrInstr *instr)
+{
+	int id = generate_id();
+	lower_take(instr->b, REG_VAL);
+	if (instr->a >= 0) {
+		lower_take(instr->a, REG_TMP);
+	}
+	if (!instr->tail) {
+		compile_xmm_spill(instr->floats);
+		if (instr->env) {
+			compile_stack_push(PTR_OBJ, REG_ENV);
+		}
+	}
+	if (instr->a < 0) {
+		emit("	mov $0, %s\n", REG_ENV);
+	} else {
+		emit("	mov %d(%s), %s\n", ObjFldOff(CompFn, env), REG_TMP, REG_ENV);
+	}
+	if (instr->tail) {
+		compile_link_pop();
+	} else {
+		emit("	lea after_call%d(%%rip), %s\n", id, REG_LINK);
+	}
+	if (instr->a < 0) {
+		emit("	jmp fn%d\n", instr->id);
+	} else {
+		emit("	jmp *%d(%s)\n", ObjFldOff(CompFn, text), REG_TMP);
+	}
+	if (!instr->tail) {
+		compile_continuation("after_call%d", id);
+		if (instr->env) {
+			compile_stack_pop(REG_ENV);
+		}
+		compile_xmm_restore(instr->floats);
+	}
+}
+
+// Every iteration overwrites the values of the frames the body runs in:
+// its own one is allocated on the entry, but the ones of the outer
+// parameters were created by the caller and may still be captured by
+// the closures it has of the outer lambdas. So the first time around they
+// are replaced by new ones, the flag pushed after the link tells when that
+// has been done. As nothing is entered, the GC is let in here.
+static void lower_loop(const IrInstr *instr)
+{
+	int id = generate_id();
+	int last = instr->count - 1;
+	if (last > 0) {
+		int flag = 8 * (slots.depth - slots.base - current->link - frame_slots(current) - 1);
+		emit("	cmpq $0, %d(%%rsp)\n", flag);
+		emit("	jne loop_owned%d\n", id);
+		for (int i = 0; i < last; i++) {
+			compile_alloc(Frame, FrameObject);
+			if (i == 0) {
+				emit("	movq $0, %d(%%rax)\n", ObjFldOff(Frame, prev));
+			} else {
+				emit("	mov %d(%s), %%rdx\n", ObjFldOff(Frame, prev), REG_ENV);
+				emit("	mov %%rdx, %d(%%rax)\n", ObjFldOff(Frame, prev));
+			}
+			emit("	mov %%rax, %d(%s)\n", ObjFldOff(Frame, prev), REG_ENV);
+		}
+		emit("	movq $1, %d(%%rsp)\n", flag);
+		emit("loop_owned%d:\n", id);
+	}
+	lower_take(instr->args[last], REG_VAL);
+	emit("	mov %s, %d(%s)\n", REG_VAL, ObjFldOff(Frame, value), REG_ENV);
+	for (int i = last - 1; i >= 0; i--) {
+		compile_stack_pop(REG_TMP);
+		emit("	mov %d(%s), %%rax\n", ObjFldOff(Frame, prev), REG_ENV);
+		for (int j = i + 1; j < last; j++) {
+			emit("	mov %d(%%rax), %%rax\n", ObjFldOff(Frame, prev));
+		}
+		emit("	mov %s, %d(%%rax)\n", REG_TMP, ObjFldOff(Frame, value));
+	}
+	if (current->link) {
+		emit("	lea loop_gc%d(%%rip), %s\n", id, REG_LINK);
+	}
+	compile_gc_call();
+	if (current->link) {
+		compile_continuation("loop_gc%d", id);
+	}
+	emit("	jmp fn%d_loop\n", current->id);
+}
+
+// compares the condition in `temp` with 0, see compile_test
+static void lower_test(Temp temp)
+{
+	if (ir.temps[temp].kind == TempFloat) {
+		compile_test_xmm(ir.temps[temp].reg);
+	} else {
+		char operand[32];
+		lower_take(temp, REG_VAL);
+		snprintf(operand, sizeof(operand), "%d(%s)", ObjFldOff(Num, num), REG_VAL);
+		compile_test(operand);
+	}
+}
+
+static void lower_if(const IrInstr *instr)
+{
+	int id = generate_id();
+	lower_test(instr->a);
+	lower_save(instr);
+	compile_test_jump(0, "false_branch%d", id);
+	emit("true_branch%d:\n", id);
+	lower_block(&instr->then);
+	if (!instr->tail) {
+		emit("	jmp if_end%d\n", id);
+	}
+	emit("false_branch%d:\n", id);
+	val = -1;
+	lower_block(&instr->other);
+	emit("if_end%d:\n", id);
+}
+
+// NOTE: the left operand is the value when it decides
+static void lower_logic(const IrInstr *instr)
+{
+	int id = generate_id();
+	const char *label = instr->op == IrAnd ? "and_false%d" : "or_true%d";
+	lower_test(instr->a);
+	lower_save(instr);
+	compile_test_jump(instr->op == IrOr, label, id);
+	lower_block(&instr->then);
+	emit(label, id);
+	emit(":\n");
+	if (instr->tail) {
+		compile_ret();
+	}
+}
+
+static void lower_instr(const IrInstr *instr)
+{
+	if (instr->dead) {
+		return;
+	}
+	if (out == stdout) {
+		char *text;
+		size_t size;
+		FILE *comment = open_memstream(&text, &size);
+		Ir_print_instr(&ir, instr, comment);
+		fclose(comment);
+		emit("//%s\n", text);
+		free(text);
+	}
+	const char *env;
+	switch (instr->op) {
+		case IrNum:
+			lower_save(instr);
+			compile_num(instr->num);
+			break;
+		case IrParam:
+			lower_save(instr);
+			lower_param(instr);
+			break;
+		case IrGlobal:
+			lower_save(instr);
+			lower_global(instr);
+			break;
+		case IrClosure:
+			env = lower_copies(instr);
+			lower_save(instr);
+			lower_closure(instr, env);
+			break;
+		case IrThunk:
+			env = lower_copies(instr);
+			lower_save(instr);
+			lower_thunk(instr, env);
+			break;
+		case IrForce:
+			lower_force(instr);
+			break;
+		case IrAssert:
+			lower_take(instr->a, REG_VAL);
+			if (instr->type == NumObject) {
+				compile_type_assertion(NumObject);
+			} else {
+				compile_callee_assertion();
+			}
+			break;
+		case IrConst:
+			lower_const(instr);
+			break;
+		case IrUnbox:
+			lower_take(instr->a, REG_VAL);
+			emit("	movq %d(%s), %%xmm%d\n", ObjFldOff(Num, num), REG_VAL, ir.temps[instr->dst].reg);
+			break;
+		case IrArith:
+			compile_float_op(instr->arith, ir.temps[instr->a].reg, ir.temps[instr->b].reg);
+			break;
+		case IrNative:
+			lower_native(instr);
+			break;
+		case IrBox:
+			lower_save(instr);
+			lower_box(instr);
+			break;
+		case IrSpill:
+			lower_save(instr);
+			compile_xmm_spill(instr->count);
+			break;
+		case IrRestore:
+			lower_restore(instr);
+			break;
+		case IrCall:
+			lower_call(instr);
+			val = -1;
+			break;
+		case IrIf:
+			lower_if(instr);
+			break;
+		case IrAnd:
+		case IrOr:
+			lower_logic(instr);
+			break;
+		case IrSet:
+			lower_take(instr->a, REG_VAL);
+			emit("	mov %s, globals+%d(%%rip)\n", REG_VAL, 8 * instr->slot);
+			break;
+		case IrReturn:
+			lower_take(instr->a, REG_VAL);
+			compile_ret();
+			break;
+		case IrLoop:
+			lower_loop(instr);
+			val = -1;
+			break;
+	}
+	if (instr->dst >= 0 && ir.temps[instr->dst].kind == TempBoxed) {
+		val = instr->dst;
+	}
+}
+
+static void lower_block(const IrBlock *block)
+{
+	for (const IrInstr *instr = block->first; instr; instr = instr->next) {
+		lower_instr(instr);
+	}
+	if (block->result >= 0) {
+		lower_take(block->result, REG_VAL);
+	}
+}
+
+// NOTE: the kernel a line defines is compiled along with it
+static void compile_c(const Node *expr)
+{
+	if (expr->type == LetNode) {
+		Symbol name = IdNode_symbol(LetNode_name(expr));
+		if (name < program.size && program.kernels[name]) {
+			cgen_kernel(program.kernels[name]);
+		}
+	}
+	IrBody *body = build_line(expr);
+	analyze(body);
+	cgen_line(&ir, body);
+	Ir_reset(&ir);
+}
+
+// NOTE: likewise
+static void compile_line(const Node *expr)
+{
+	if (expr->type == LetNode) {
+		Symbol name = IdNode_symbol(LetNode_name(expr));
+		if (name < program.size && program.kernels[name]) {
+			compile_kernel(program.kernels[name]);
+		}
+	}
+	IrBody *body = build_line(expr);
+	analyze(body);
+	lower_body(body);
+	Ir_reset(&ir);
+}
+
+void compile(const Node *expr)
+{
+	if (c_code) {
+		return compile_c(expr);
+	}
+	compile_line(expr);
+	if (expr->type != LetNode) {
+		emit("	mov %s, %%rdi\n", REG_VAL);
+		compile_c_call("Object_println");
+	}
+	compile_gc_call();
+	peep_flush(out);
+}
+
+void compile_declare(const Node *expr, const Type *type)
+{
+	if (expr->type != LetNode) {
+		return;
+	}
+	if (program.count == program.capacity) {
+		program.capacity = program.capacity ? program.capacity * 2 : 64;
+		program.lets = realloc(program.lets, program.capacity * sizeof(*program.lets));
+		program.types = realloc(program.types, program.capacity * sizeof(*program.types));
+	}
+	program.lets[program.count] = expr;
+	program.types[program.count] = type;
+	program.count += 1;
+}
+
+void compile_begin(FILE *output)
+{
+	out = output;
+	ir = Ir_make();
+	analyze_program();
+	if (c_code) {
+		return cgen_begin(out, program.kernels);
+	}
+	peep_begin();
+	emit(".global main\n");
+	emit(".data\n");
+	emit("gc: .quad 0\n");
+	emit("true:  .double 1.0\n");
+	emit("false: .double 0.0\n");
+	emit(".section stackmaps, \"aw\"\n");
+	emit("stack_maps:\n");
+	emit(".text\n");
+	compile_force_sub();
+	compile_refill_sub();
+	emit("main:\n");
+	emit("	push %%rbp\n");
+	emit("	mov %%rsp, %%rbp\n");
+	slots.outermost = 1;
+	compile_stack_push(PTR_ADDR, REG_HEAP);
+	compile_stack_push(PTR_ADDR, REG_HEAP); // keeps the stack aligned
+	// NOTE: the first allocation refills
+	emit("	mov $0, %s\n", REG_HEAP);
+	emit("	call GC_new\n");
+	emit("	mov %%rax, gc(%%rip)\n");
+	emit("	mov %%rax, %%rdi\n");
+	emit("	lea globals(%%rip), %%rsi\n");
+	emit("	mov $globals_count, %%rdx\n");
+	emit("	call GC_set_roots\n");
+	emit("	mov gc(%%rip), %%rdi\n");
+	emit("	lea stack_maps(%%rip), %%rsi\n");
+	emit("	mov $stack_maps_count, %%rdx\n");
+	emit("	call GC_set_stack_maps\n");
+	emit("	mov $0, %s\n", REG_ENV);
+	peep_flush(out);
+}
+
+void compile_end(void)
+{
+	if (c_code) {
+		cgen_end(globals.count);
+		Ir_destroy(ir);
+		return;
+	}
+	emit("	mov gc(%%rip), %%rdi\n");
+	emit("	mov $0, %%rsi\n");
+	emit("	mov $0, %%rdx\n");
+	emit("	call GC_collect\n");
+	emit("	mov gc(%%rip), %%rdi\n");
+	emit("	call GC_drop\n");
+	emit("	mov -8(%%rbp), %s\n", REG_HEAP);
+	emit("	mov $0, %%rax\n");
+	emit("	mov %%rbp, %%rsp\n");
+	emit("	pop %%rbp\n");
+	emit("	ret\n");
+	emit(".data\n");
+	emit("globals: .zero %d\n", 8 * (globals.count ? globals.count : 1));
+	emit(".set globals_count, %d\n", globals.count);
+	emit(".set stack_maps_count, %d\n", slots.maps);
+	emit(".text\n");
+	// TODO: log something maybe?
+	emit("fail_type:\n");
+	emit("failure:\n");
+	emit("	lea -16(%%rbp), %%rsp\n");
+	emit("	mov gc(%%rip), %%rdi\n");
+	emit("	mov $0, %%rsi\n");
+	emit("	mov $0, %%rdx\n");
+	emit("	call GC_collect\n");
+	emit("	mov gc(%%rip), %%rdi\n");
+	emit("	call GC_drop\n");
+	emit("	mov -8(%%rbp), %s\n", REG_HEAP);
+	emit("	mov %%rbp, %%rsp\n");
+	emit("	mov $1, %%rax\n");
+	emit("	pop %%rbp\n");
+	emit("	ret\n");
+	peep_flush(out);
+	if (debug) {
+		peep_print_stats();
+	}
+	peep_end();
+	Ir_destroy(ir);
+}
+
+// NOTE: a later line may redefine any name, so unlike the whole programs
+// nothing is known about the globals and the JIT calls them through their
+// slots. Compiled code is entered from C through a frame that saves the
+// callee-saved registers, the pointer to the result and the frame it was
+// entered from, failure unwinds to it.
+static void compile_jit_entry(void)
+{
+	emit("	push %%rbp\n");
+	emit("	mov %%rsp, %%rbp\n");
+	emit("	push %%rbx\n");
+	emit("	push %%r12\n");
+	emit("	push %%r13\n");
+	emit("	push %%r14\n");
+	emit("	push %%r15\n");
+	emit("	push %%rdi\n");
+	emit("	push frame(%%rip)\n");
+	emit("	mov %%rbp, frame(%%rip)\n");
+	emit("	mov heap(%%rip), %s\n", REG_HEAP);
+}
+
+static void compile_jit_exit(void)
+{
+	emit("	mov -48(%%rbp), %%rax\n");
+	emit("	mov %s, (%%rax)\n", REG_VAL);
+	emit("	mov $0, %%rax\n");
+	emit("	jmp jit_ret\n");
+}
+
+// Compiled code calls an interpreted closure through the bridge, the
+// stack it leaves behind is walked from where the callee would start.
+static void compile_bridge_sub(void)
+{
+	emit("bridge:\n");
+	emit("	mov %%rsp, %%rcx\n");
+	emit("	mov %s, %%r8\n", REG_LINK);
+	emit("	push %s\n", REG_LINK);
+	emit("	mov %s, heap(%%rip)\n", REG_HEAP);
+	emit("	mov jit(%%rip), %%rdi\n");
+	emit("	mov %s, %%rsi\n", REG_TMP);
+	emit("	mov %s, %%rdx\n", REG_VAL);
+	compile_c_call("Jit_bridge");
+	emit("	mov heap(%%rip), %s\n", REG_HEAP);
+	emit("	pop %s\n", REG_LINK);
+	emit("	test %%rax, %%rax\n");
+	emit("	je fail_reported\n");
+	emit("	mov %%rax, %s\n", REG_VAL);
+	emit("	jmp *%s\n", REG_LINK);
+}
+
+static void compile_unbound_stubs(void)
+{
+	for (int i = 0; i < unbound.count; i++) {
+		emit("unbound%d:\n", unbound.ids[i]);
+		emit("	mov $%d, %%eax\n", FailUnbound + unbound.slots[i]);
+		emit("	jmp failure\n");
+	}
+	unbound.count = 0;
+}
+
+void compile_jit_begin(FILE *output)
+{
+	out = output;
+	in_process = 1;
+	ir = Ir_make();
+	peep_begin();
+	emit(".data\n");
+	emit("gc: .quad 0\n");
+	emit("jit: .quad 0\n");
+	emit("heap: .quad 0\n");
+	emit("frame: .quad 0\n");
+	emit("true:  .double 1.0\n");
+	emit("false: .double 0.0\n");
+	emit(".text\n");
+	compile_force_sub();
+	compile_refill_sub();
+	compile_bridge_sub();
+	emit("fail_reported:\n");
+	emit("	mov $%d, %%eax\n", FailReported);
+	emit("	jmp failure\n");
+	emit("fail_type:\n");
+	emit("	mov $%d, %%eax\n", FailType);
+	emit("failure:\n");
+	emit("	mov frame(%%rip), %%rbp\n");
+	emit("jit_ret:\n");
+	emit("	mov %s, heap(%%rip)\n", REG_HEAP);
+	emit("	mov -56(%%rbp), %%rcx\n");
+	emit("	mov %%rcx, frame(%%rip)\n");
+	emit("	lea -40(%%rbp), %%rsp\n");
+	emit("	pop %%r15\n");
+	emit("	pop %%r14\n");
+	emit("	pop %%r13\n");
+	emit("	pop %%r12\n");
+	emit("	pop %%rbx\n");
+	emit("	pop %%rbp\n");
+	emit("	ret\n");
+	slots.outermost = 1;
+	// int jit_call(Object **result, Object *fn, Object *arg)
+	emit("jit_call:\n");
+	compile_jit_entry();
+	emit("	mov %%rdx, %s\n", REG_VAL);
+	emit("	mov %%rsi, %s\n", REG_TMP);
+	emit("	mov %d(%s), %s\n", ObjFldOff(CompFn, env), REG_TMP, REG_ENV);
+	emit("	lea jit_call_ret(%%rip), %s\n", REG_LINK);
+	emit("	jmp *%d(%s)\n", ObjFldOff(CompFn, text), REG_TMP);
+	compile_continuation("jit_call_ret", 0);
+	compile_jit_exit();
+	peep_flush(out);
+}
+
+int compile_jit_line(const Node *expr)
+{
+	int id = generate_id();
+	emit(".text\n");
+	emit("line%d:\n", id);
+	compile_jit_entry();
+	emit("	mov $0, %s\n", REG_ENV);
+	compile_line(expr);
+	if (expr->type == LetNode) {
+		emit("	mov $0, %s\n", REG_VAL);
+	}
+	compile_jit_exit();
+	compile_unbound_stubs();
+	peep_flush(out);
+	return id;
+}
+
+int compile_jit_fn(const Node *expr)
+{
+	int id = generate_id();
+	emit(".text\n");
+	IrBody *body = build_fn_body(expr, NULL, id);
+	analyze(body);
+	lower_fn_code(body);
+	Ir_reset(&ir);
+	compile_unbound_stubs();
+	peep_flush(out);
+	return id;
+}
+
+int compile_jit_globals(void)
+{
+	return globals.count;
+}
+
+int compile_jit_slot(Symbol name)
+{
+	return name < globals.size ? globals.slots[name] : -1;
 }
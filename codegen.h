@@ -1,10 +1,54 @@
 #ifndef CODEGEN_INCLUDED
 #define CODEGEN_INCLUDED
 
+#include <stdio.h>
+
 #include "node.h"
+#include "types.h"
 
+// NOTE: every top-level expression is declared before any is compiled,
+// `type` is NULL when the program isn't typed
+void compile_declare(const Node *expr, const Type *type);
 void compile(const Node *expr);
-void compile_begin(void);
+void compile_begin(FILE *output);
 void compile_end(void);
 
+// The JIT compiles a line at a time into `out`: each line is a function
+// `int line<id>(Object **result)` that returns what failed, if anything.
+// The globals are the slots at the `globals` label, the JIT defines it.
+// A function is compiled on its own at fn<id>, as if it was defined at the
+// top level, and called from C with `int jit_call(Object **result, Object *fn, Object *arg)`.
+typedef enum {
+	FailNone,
+	FailReported, // by the interpreter, which compiled code called
+	FailType,
+	FailUnbound,  // plus the slot of the global, see compile_jit_slot
+} Failure;
+
+void compile_jit_begin(FILE *out);
+int  compile_jit_line(const Node *expr);
+int  compile_jit_fn(const Node *expr);
+int  compile_jit_globals(void);
+int  compile_jit_slot(Symbol name); // -1 for the names without a slot
+
+// Functions typed num -> ... -> num that are bound only once also get a
+// native entry point: it is entered with an ordinary call, takes its
+// arguments in xmm0.. and returns the result in xmm0. Its body may only do
+// arithmetic, conditionals and full applications of such functions, the
+// closure bound to the name wraps the native entry for all the other uses.
+// The C backend (see cgen.h) lowers them too.
+#define MAX_KERNEL_ARITY 8
+
+typedef struct {
+	int        id;
+	Symbol     name;
+	int        arity;
+	const Node *params[MAX_KERNEL_ARITY]; // the IdNodes, outermost first
+	const Node *body;
+} Kernel;
+
+int  kernel_param(const Kernel *kernel, Symbol name); // -1 for the other names
+// the last `arity` arguments `call` applies, in order
+void call_args(const Node *call, int arity, const Node **args);
+
 #endif // CODEGEN_INCLUDED
@@ -2,8 +2,10 @@
 #include "iter.c"
 #include "lex.c"
 #include "scanner.c"
+#include "symbol.c"
 #include "node.c"
 #include "parse.c"
+#include "optimize.c"
 #include "types.c"
 #include "infer.c"
 #include "opts.c"
@@ -1,12 +1,15 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "scanner.h"
 #include "parse.h"
+#include "optimize.h"
 #include "node.h"
 #include "infer.h"
 #include "types.h"
 #include "arena.h"
 #include "codegen.h"
+#include "asm.h"
 #include "opts.h"
 
 
@@ -14,6 +17,24 @@
 
 // TODO: proper error handling
 
+// NOTE: the whole program is read before anything is compiled,
+// so that the optimizer and the code generator can see all of the definitions
+typedef struct {
+	Node **exprs;
+	int  count;
+	int  capacity;
+} Program;
+
+static void Program_add(Program *self, Node *expr)
+{
+	if (self->count == self->capacity) {
+		self->capacity = self->capacity ? self->capacity * 2 : 64;
+		self->exprs = realloc(self->exprs, self->capacity * sizeof(*self->exprs));
+	}
+	self->exprs[self->count] = expr;
+	self->count += 1;
+}
+
 int main(int argc, char **argv)
 {
 	if (!parse_args(argc, argv)) {
@@ -21,25 +42,52 @@ int main(int argc, char **argv)
 	}
 	Scanner scanner = Scanner_make(stdin);
 	Arena tmp = Arena_make(TMP_ARENA_PAGE_SIZE);
-	TypeEnv *tenv = TYPEENV_EMPTY;
-	compile_begin();
+	TypeEnv tenv = TypeEnv_make();
+	Program program = {0};
 	while (!Scanner_eof(scanner)) {
-		Arena_reset(&tmp);
 		Node *ast = parse(&scanner, &tmp);
-		if (!ast) {
-			continue;
+		if (ast) {
+			optimize_declare(ast);
+			Program_add(&program, ast);
 		}
+	}
+	for (int i = 0; i < program.count; i++) {
+		Type *type = NULL;
 		if (typed) {
-			Type *type = infer(ast, &tenv, &tmp);
+			type = infer(program.exprs[i], &tenv, &tmp);
 			if (!type) {
+				program.count = i;
 				break;
 			}
 		}
-		compile(ast);
+		program.exprs[i] = optimize(program.exprs[i], &tmp);
+		compile_declare(program.exprs[i], type);
+	}
+	// NOTE: with -e the assembly is encoded in-process into an object file
+	char *text = NULL;
+	size_t size = 0;
+	int object = elf && !c_code;
+	FILE *output = object ? open_memstream(&text, &size) : stdout;
+	compile_begin(output);
+	for (int i = 0; i < program.count; i++) {
+		compile(program.exprs[i]);
 	}
 	compile_end();
+	if (object) {
+		fclose(output);
+		Asm *assembler = Asm_new(NULL, NULL);
+		Asm_assemble(assembler, text);
+		Asm_write_object(assembler, stdout);
+		Asm_drop(assembler);
+		free(text);
+	}
+	if (debug) {
+		optimize_print_stats();
+		Arena_print_stats(&tmp, "scratch arena");
+	}
 	Scanner_destroy(scanner);
 	TypeEnv_drop(tenv);
 	Arena_destroy(tmp);
+	free(program.exprs);
 	return 0;
 }
@@ -1,9 +1,11 @@
 #include "context.h"
 
 #include <stddef.h>
+#include <stdlib.h>
 
 #include "gc.h"
 #include "types.h"
+#include "env.h"
 
 
 Context Context_make(void)
@@ -19,4 +21,34 @@ void Context_destroy(Context self)
 {
 	GC_collect(self.gc, NULL, NULL);
 	GC_drop(self.gc);
+	for (int i = 0; i < self.frames_capacity && self.frames[i]; i++) {
+		Env_drop(EnvObj_env(self.frames[i]));
+	}
+	free(self.frames);
+}
+
+// NOTE: the frame is marked like a new object of the GC
+Object *Context_push_frame(Context *self, Object *prev)
+{
+	if (self->frames_count == self->frames_capacity) {
+		int capacity = self->frames_capacity ? self->frames_capacity * 2 : 64;
+		self->frames = realloc(self->frames, capacity * sizeof(*self->frames));
+		for (int i = self->frames_capacity; i < capacity; i++) {
+			self->frames[i] = NULL;
+		}
+		self->frames_capacity = capacity;
+	}
+	Object *frame = self->frames[self->frames_count];
+	if (frame) {
+		Env_clear(EnvObj_env(frame), prev);
+	} else {
+		frame = ValToObj(Env_new_frame(prev));
+		frame->type = EnvObject;
+		frame->next = NULL;
+		frame->region = 0;
+		self->frames[self->frames_count] = frame;
+	}
+	frame->mark = self->gc->curr;
+	self->frames_count += 1;
+	return frame;
 }
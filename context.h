@@ -5,10 +5,18 @@
 #include "gc.h"
 #include "types.h"
 
+// The environments of the applications that can't outlive them (see
+// FnNode_escapes) are taken from a stack of frames and given back when the
+// application returns. The GC never frees them, it only marks through the
+// ones it reaches from the roots.
 typedef struct {
-	GC      *gc;
-	Object  *root;
-	Object  *stack;
+	GC         *gc;
+	Object     *root;
+	Object     *stack;
+	struct Jit *jit; // runs the hot functions compiled, NULL when there is none
+	Object     **frames; // the ones below `frames_count` are in use
+	int        frames_count;
+	int        frames_capacity;
 } Context;
 
 #define Context_stack(ctx) (StackObj_stack((ctx)->stack))
@@ -17,5 +25,9 @@ typedef struct {
 
 Context Context_make(void);
 void    Context_destroy(Context self);
+Object  *Context_push_frame(Context *self, Object *prev);
+
+// gives back the frames taken since there were `count` of them
+#define Context_release_frames(ctx, count) ((ctx)->frames_count = (count))
 
 #endif // CONTEXT_INCLUDED
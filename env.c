@@ -14,6 +14,7 @@ struct Binding {
 };
 
 #define INITIAL_TABLE_SIZE 512
+#define FRAME_TABLE_SIZE   2
 
 static Binding *Binding_new(const char *key, Object *obj)
 {
@@ -39,17 +40,27 @@ static unsigned long dbj2_hash(const char *str)
 	return hash;
 }
 
-Env *Env_new(Object *prev)
+static Env *Env_new_sized(Object *prev, int size)
 {
 	Env *self = malloc(sizeof(*self));
-	self->entries = calloc(INITIAL_TABLE_SIZE, sizeof(Binding));
-	self->size = INITIAL_TABLE_SIZE;
+	self->entries = calloc(size, sizeof(Binding));
+	self->size = size;
 	self->taken = 0;
 	self->prev = prev;
 	return self;
 }
 
-void Env_drop(Env *self)
+Env *Env_new(Object *prev)
+{
+	return Env_new_sized(prev, INITIAL_TABLE_SIZE);
+}
+
+Env *Env_new_frame(Object *prev)
+{
+	return Env_new_sized(prev, FRAME_TABLE_SIZE);
+}
+
+void Env_clear(Env *self, Object *prev)
 {
 	for (int i = 0; i < self->size; i++) {
 		Binding *head = self->entries[i];
@@ -58,7 +69,15 @@ void Env_drop(Env *self)
 			Binding_drop(head);
 			head = next;
 		}
+		self->entries[i] = NULL;
 	}
+	self->taken = 0;
+	self->prev = prev;
+}
+
+void Env_drop(Env *self)
+{
+	Env_clear(self, NULL);
 	free(self->entries);
 	free(self);
 }
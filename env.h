@@ -20,6 +20,10 @@ struct Env {
 
 // NOTE: Env_add overwrites the existing value!
 Env     *Env_new(Object *prev);
+// NOTE: a frame starts with a table for a few bindings, and it keeps it
+// when it is cleared for reuse
+Env     *Env_new_frame(Object *prev);
+void    Env_clear(Env *self, Object *prev);
 void    Env_drop(Env *self);
 void    Env_add(Env *self, const char *key, Object *obj);
 Object  *Env_remove(Env *self, const char *key);
@@ -1,5 +1,7 @@
 #include "eval.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <string.h>
 
@@ -11,9 +13,32 @@
 #include "stack.h"
 #include "context.h"
 #include "error.h"
+#include "jit.h"
 
 
+// A closure, or a thunk of the lazy mode, only keeps the parameters it
+// refers to of the environment it is created in: eval_analyze gives it an
+// entry with those, which are copied into an environment of its own, unless
+// it refers to all of them and shares the environment. The entry of a
+// closure also tells whether the environments of its applications can be
+// shared by what they create, or can come from the stack of frames.
+typedef struct {
+	int escapes;
+	int count; // -1 when it shares the environment
+	int first; // in `symbols`
+} Captured;
+
+static struct {
+	Captured *entries;
+	int      count;
+	int      capacity;
+	Symbol   *symbols;
+	int      symbols_count;
+	int      symbols_capacity;
+} captured = {0};
+
 static Object *eval_dispatch(const Node *expr, Context *ctx, Object *env);
+static Object *eval_loop(const Node *expr, Context *ctx, Object *env, int frames);
 static Object *actual_value(const Node *expr, Context *ctx, Object *env);
 
 static inline Object *eval_expect(const Node *expr, Context *ctx, Object *env, ObjectType type)
@@ -39,80 +64,119 @@ static Object *eval_lookup(const Node *expr, Object *env)
 	return value;
 }
 
-static Object *eval_pair(const Node *expr, Context *ctx, Object *env)
+static int eval_operation(int op, double left, double right, double *value)
 {
-	int op = PairNode_op(expr);
-	Context_stack_push(ctx, env);
-	Object *leftv = eval_expect(PairNode_left(expr), ctx, env, NumObject);
-	Context_stack_pop(ctx);
-	if (!leftv) {
-		return NULL;
-	}
-	Context_stack_push(ctx, leftv);
-	Object *rightv = eval_expect(PairNode_right(expr), ctx, env, NumObject);
-	Context_stack_pop(ctx);
-	if (!rightv) {
-		return NULL;
-	}
 	switch (op) {
-		case '^':
-			return GC_alloc_number(ctx->gc, pow(NumObj_num(leftv), NumObj_num(rightv)));
-		case '*':
-			return GC_alloc_number(ctx->gc, NumObj_num(leftv) * NumObj_num(rightv));
-		case '/':
-			return GC_alloc_number(ctx->gc, NumObj_num(leftv) / NumObj_num(rightv));
-		case '%':
-			return GC_alloc_number(ctx->gc, fmod(NumObj_num(leftv), NumObj_num(rightv)));
-		case '+':
-			return GC_alloc_number(ctx->gc, NumObj_num(leftv) + NumObj_num(rightv));
-		case '-':
-			return GC_alloc_number(ctx->gc, NumObj_num(leftv) - NumObj_num(rightv));
-		case '>':
-			return GC_alloc_number(ctx->gc, NumObj_num(leftv) > NumObj_num(rightv));
-		case '<':
-			return GC_alloc_number(ctx->gc, NumObj_num(leftv) < NumObj_num(rightv));
-		case '=':
-			return GC_alloc_number(ctx->gc, NumObj_num(leftv) == NumObj_num(rightv));
+		case '^': *value = pow(left, right);  return 1;
+		case '*': *value = left * right;      return 1;
+		case '/': *value = left / right;      return 1;
+		case '%': *value = fmod(left, right); return 1;
+		case '+': *value = left + right;      return 1;
+		case '-': *value = left - right;      return 1;
+		case '>': *value = left > right;      return 1;
+		case '<': *value = left < right;      return 1;
+		case '=': *value = left == right;     return 1;
 		default:
 			errorf("evaluation error: unknown binary operation: '%c'", op);
-			return NULL;
+			return 0;
 	}
 }
 
-static Object *eval_or(const Node *expr, Context *ctx, Object *env)
+// With -t, what the inference proved of the values of the nodes is taken
+// for granted: the operands proven to be numbers and the functions that
+// are applied aren't checked, and the arithmetic on numbers is computed
+// without boxing the intermediate results. The thunks of the lazy mode are
+// still forced. The untyped runs only pay for testing `proven`.
+static int eval_number(const Node *expr, Context *ctx, Object *env, double *value);
+
+static int eval_arithmetic(const Node *expr, Context *ctx, Object *env, double *value)
 {
+	double left, right;
 	Context_stack_push(ctx, env);
-	Object *leftv = eval_expect(PairNode_left(expr), ctx, env, NumObject);
+	int ok = eval_number(PairNode_left(expr), ctx, env, &left);
 	Context_stack_pop(ctx);
-	if (!leftv) {
-		return NULL;
-	}
-	if (NumObj_num(leftv)) {
-		return leftv;
+	if (!ok || !eval_number(PairNode_right(expr), ctx, env, &right)) {
+		return 0;
 	}
-	Object *rightv = eval_expect(PairNode_right(expr), ctx, env, NumObject);
-	if (!rightv) {
-		return NULL;
+	return eval_operation(PairNode_op(expr), left, right, value);
+}
+
+// NOTE: the value of a node proven to be a number, returns 0 when it fails,
+// the operands of the arithmetic on it are numbers too
+static int eval_number(const Node *expr, Context *ctx, Object *env, double *value)
+{
+	switch (expr->type) {
+		case ExptNode:
+		case ProdNode:
+		case SumNode:
+		case CmpNode:
+			return eval_arithmetic(expr, ctx, env, value);
+		default: {
+			Object *obj = actual_value(expr, ctx, env);
+			if (!obj) {
+				return 0;
+			}
+			*value = NumObj_num(obj);
+			return 1;
+		}
 	}
-	return rightv;
 }
 
-static Object *eval_and(const Node *expr, Context *ctx, Object *env)
+static Object *eval_pair(const Node *expr, Context *ctx, Object *env)
 {
+	double value;
+	if (expr->proven & PROVEN_NUM) {
+		return eval_arithmetic(expr, ctx, env, &value) ? GC_alloc_number(ctx->gc, value) : NULL;
+	}
 	Context_stack_push(ctx, env);
 	Object *leftv = eval_expect(PairNode_left(expr), ctx, env, NumObject);
 	Context_stack_pop(ctx);
 	if (!leftv) {
 		return NULL;
 	}
-	if (!NumObj_num(leftv)) {
-		return leftv;
-	}
+	Context_stack_push(ctx, leftv);
 	Object *rightv = eval_expect(PairNode_right(expr), ctx, env, NumObject);
+	Context_stack_pop(ctx);
 	if (!rightv) {
 		return NULL;
 	}
-	return rightv;
+	if (!eval_operation(PairNode_op(expr), NumObj_num(leftv), NumObj_num(rightv), &value)) {
+		return NULL;
+	}
+	return GC_alloc_number(ctx->gc, value);
+}
+
+// NOTE: `or` stops at a true left operand, `and` at a false one, a proven
+// one is only boxed when it is the result
+static Object *eval_junction(const Node *expr, Context *ctx, Object *env, int stop)
+{
+	const Node *left = PairNode_left(expr);
+	const Node *right = PairNode_right(expr);
+	Context_stack_push(ctx, env);
+	if (left->proven & PROVEN_NUM) {
+		double value;
+		int ok = eval_number(left, ctx, env, &value);
+		Context_stack_pop(ctx);
+		if (!ok) {
+			return NULL;
+		}
+		if ((value != 0) == stop) {
+			return GC_alloc_number(ctx->gc, value);
+		}
+	} else {
+		Object *leftv = eval_expect(left, ctx, env, NumObject);
+		Context_stack_pop(ctx);
+		if (!leftv) {
+			return NULL;
+		}
+		if ((NumObj_num(leftv) != 0) == stop) {
+			return leftv;
+		}
+	}
+	if (right->proven & PROVEN_NUM) {
+		return actual_value(right, ctx, env);
+	}
+	return eval_expect(right, ctx, env, NumObject);
 }
 
 static Object *eval_let(const Node *expr, Context *ctx, Object *env)
@@ -122,35 +186,75 @@ static Object *eval_let(const Node *expr, Context *ctx, Object *env)
 		return NULL;
 	}
 	Env_add(EnvObj_env(env), LetNode_name_value(expr), value);
+	if (ctx->jit && env == ctx->root) {
+		Jit_set_global(ctx->jit, IdNode_symbol(LetNode_name(expr)), value);
+	}
 	return NULL;
 }
 
-static Node *eval_if(Context *ctx, Object **env, const Node *expr)
+static const Node *eval_if(Context *ctx, Object **env, const Node *expr)
 {
+	const Node *cond = IfNode_cond(expr);
+	int truth;
 	Context_stack_push(ctx, *env);
-	Object *condv = eval_expect(IfNode_cond(expr), ctx, *env, NumObject);
-	Context_stack_pop(ctx);
-	if (!condv) {
-		return NULL;
+	if (cond->proven & PROVEN_NUM) {
+		double value;
+		int ok = eval_number(cond, ctx, *env, &value);
+		Context_stack_pop(ctx);
+		if (!ok) {
+			return NULL;
+		}
+		truth = value != 0;
+	} else {
+		Object *condv = eval_expect(cond, ctx, *env, NumObject);
+		Context_stack_pop(ctx);
+		if (!condv) {
+			return NULL;
+		}
+		truth = NumObj_num(condv) != 0;
 	}
-	if (NumObj_num(condv)) {
+	if (truth) {
 		return IfNode_true(expr);
 	} else {
 		return IfNode_false(expr);
 	}
 }
 
-static const Node *eval_application(Context *ctx, Object **env, const Node *expr)
+// the environment a closure or a thunk with the entry `index` keeps
+static Object *eval_captured(Context *ctx, Object *env, int index)
+{
+	if (index < 0 || captured.entries[index].count < 0) {
+		return env;
+	}
+	const Captured *entry = &captured.entries[index];
+	if (!entry->count) {
+		return ctx->root;
+	}
+	Object *copy = GC_alloc_env_frame(ctx->gc, ctx->root);
+	for (int i = 0; i < entry->count; i++) {
+		const char *name = Symbol_name(captured.symbols[entry->first + i]);
+		Env_add(EnvObj_env(copy), name, Env_get(EnvObj_env(env), name));
+	}
+	return copy;
+}
+
+// NOTE: the result of a call that runs compiled code is in `value`, the
+// frames above `frames` are the environment of the application it replaces
+static const Node *eval_application(Context *ctx, Object **env, const Node *expr, Object **value, int frames)
 {
 	Context_stack_push(ctx, *env);
-	Object *fnv = eval_expect(PairNode_left(expr), ctx, *env, FnObject);
+	Object *fnv = actual_value(PairNode_left(expr), ctx, *env);
 	Context_stack_pop(ctx);
 	if (!fnv) {
 		return NULL;
 	}
+	if (!(PairNode_left(expr)->proven & PROVEN_FN) && fnv->type != FnObject && !(ctx->jit && fnv->type == CompfnObject)) {
+		error("evaluation error: type mismatch");
+		return NULL;
+	}
 	Object *argv = NULL;
 	if (lazy) {
-		argv = GC_alloc_thunk(ctx->gc, *env, PairNode_right(expr));
+		argv = GC_alloc_thunk(ctx->gc, eval_captured(ctx, *env, ApplNode_captured(expr)), PairNode_right(expr));
 	} else {
 		Context_stack_push(ctx, fnv);
 		argv = eval_dispatch(PairNode_right(expr), ctx, *env);
@@ -159,20 +263,73 @@ static const Node *eval_application(Context *ctx, Object **env, const Node *expr
 			return NULL;
 		}
 	}
-	*env = GC_alloc_env(ctx->gc, FnObj_env(fnv));
+	if (ctx->jit && Jit_hot(ctx->jit, fnv)) {
+		*value = Jit_apply(ctx->jit, fnv, argv);
+		return NULL;
+	}
+	Context_release_frames(ctx, frames);
+	if (FnObj_escapes(fnv)) {
+		*env = GC_alloc_env(ctx->gc, FnObj_env(fnv));
+	} else {
+		*env = Context_push_frame(ctx, FnObj_env(fnv));
+	}
 	Env_add(EnvObj_env(*env), FnObj_arg(fnv), argv);
 	return FnObj_body(fnv);
 }
 
+// NOTE: a lambda applied where it is written, as the local bindings of the
+// optimizer are, is entered without making a closure of it
+static const Node *eval_bind(Context *ctx, Object **env, const Node *expr, int frames)
+{
+	const Node *fn = PairNode_left(expr);
+	Object *argv = NULL;
+	if (lazy) {
+		argv = GC_alloc_thunk(ctx->gc, eval_captured(ctx, *env, ApplNode_captured(expr)), PairNode_right(expr));
+	} else {
+		Context_stack_push(ctx, *env);
+		argv = eval_dispatch(PairNode_right(expr), ctx, *env);
+		Context_stack_pop(ctx);
+		if (!argv) {
+			return NULL;
+		}
+	}
+	Object *outer = eval_captured(ctx, *env, FnNode_captured(fn));
+	Context_release_frames(ctx, frames);
+	if (FnNode_captured(fn) < 0 || captured.entries[FnNode_captured(fn)].escapes) {
+		*env = GC_alloc_env(ctx->gc, outer);
+	} else {
+		*env = Context_push_frame(ctx, outer);
+	}
+	Env_add(EnvObj_env(*env), FnNode_param_value(fn), argv);
+	return FnNode_body(fn);
+}
+
 static Object *eval_dispatch(const Node *expr, Context *ctx, Object *env)
 {
+	int frames = ctx->frames_count;
+	Object *value = eval_loop(expr, ctx, env, frames);
+	Context_release_frames(ctx, frames);
+	return value;
+}
+
+static Object *eval_loop(const Node *expr, Context *ctx, Object *env, int frames)
+{
+	Object *value = NULL;
 	for (;;) {
 		GC_collect(ctx->gc, env, ctx->stack);
 		switch (expr->type) {
 			case NumberNode:
 				return GC_alloc_number(ctx->gc, NumNode_value(expr));
 			case FnNode:
-				return GC_alloc_fn(ctx->gc, env, FnNode_body(expr), FnNode_param_value(expr));
+				env = eval_captured(ctx, env, FnNode_captured(expr));
+				value = GC_alloc_fn(ctx->gc, env, FnNode_body(expr), FnNode_param_value(expr));
+				if (FnNode_captured(expr) >= 0) {
+					FnObj_escapes(value) = captured.entries[FnNode_captured(expr)].escapes;
+				}
+				if (ctx->jit) {
+					FnObj_text(value) = Jit_text(ctx->jit, expr, env);
+				}
+				return value;
 			case IdNode:
 				return eval_lookup(expr, env);
 			case ExptNode:
@@ -181,14 +338,21 @@ static Object *eval_dispatch(const Node *expr, Context *ctx, Object *env)
 			case CmpNode:
 				return eval_pair(expr, ctx, env);
 			case AndNode:
-				return eval_and(expr, ctx, env);
+				return eval_junction(expr, ctx, env, 0);
 			case OrNode:
-				return eval_or(expr, ctx, env);
+				return eval_junction(expr, ctx, env, 1);
 			case IfNode:
 				expr = eval_if(ctx, &env, expr);
 				break;
 			case ApplNode:
-				expr = eval_application(ctx, &env, expr);
+				if (PairNode_left(expr)->type == FnNode) {
+					expr = eval_bind(ctx, &env, expr, frames);
+					break;
+				}
+				expr = eval_application(ctx, &env, expr, &value, frames);
+				if (value) {
+					return value;
+				}
 				break;
 			case LetNode:
 				return eval_let(expr, ctx, env);
@@ -224,3 +388,189 @@ Object *eval(const Node *expr, Context *ctx)
 		return eval_dispatch(expr, ctx, ctx->root);
 	}
 }
+
+// NOTE: compiled code calls the interpreted closures through here
+Object *eval_apply(Object *fnv, Object *argv, Context *ctx)
+{
+	if (Jit_hot(ctx->jit, fnv)) {
+		return Jit_apply(ctx->jit, fnv, argv);
+	}
+	int frames = ctx->frames_count;
+	Object *env = NULL;
+	if (FnObj_escapes(fnv)) {
+		env = GC_alloc_env(ctx->gc, FnObj_env(fnv));
+	} else {
+		env = Context_push_frame(ctx, FnObj_env(fnv));
+	}
+	Env_add(EnvObj_env(env), FnObj_arg(fnv), argv);
+	Object *value = eval_dispatch(FnObj_body(fnv), ctx, env);
+	Context_release_frames(ctx, frames);
+	return value;
+}
+
+typedef struct Chain Chain;
+
+// the names an environment binds, the innermost first
+struct Chain {
+	Symbol      name;
+	const Chain *prev;
+};
+
+static int Chain_find(const Chain *chain, Symbol name)
+{
+	for (; chain; chain = chain->prev) {
+		if (chain->name == name) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int Chain_length(const Chain *chain)
+{
+	int length = 0;
+	for (; chain; chain = chain->prev) {
+		length += 1;
+	}
+	return length;
+}
+
+// adds the names of `chain` that `expr` refers to, but the ones in `bound`,
+// to the symbols of `entry`
+static void eval_free(const Node *expr, const Chain *bound, const Chain *chain, Captured *entry)
+{
+	switch (expr->type) {
+		case NumberNode:
+			return;
+		case IdNode:
+			if (Chain_find(bound, IdNode_symbol(expr)) || !Chain_find(chain, IdNode_symbol(expr))) {
+				return;
+			}
+			for (int i = 0; i < entry->count; i++) {
+				if (captured.symbols[entry->first + i] == IdNode_symbol(expr)) {
+					return;
+				}
+			}
+			if (captured.symbols_count == captured.symbols_capacity) {
+				captured.symbols_capacity = captured.symbols_capacity ? captured.symbols_capacity * 2 : 256;
+				captured.symbols = realloc(captured.symbols, captured.symbols_capacity * sizeof(*captured.symbols));
+			}
+			captured.symbols[captured.symbols_count++] = IdNode_symbol(expr);
+			entry->count += 1;
+			return;
+		case FnNode:
+			return eval_free(FnNode_body(expr), &(Chain){IdNode_symbol(FnNode_param(expr)), bound}, chain, entry);
+		case IfNode:
+			eval_free(IfNode_cond(expr), bound, chain, entry);
+			eval_free(IfNode_true(expr), bound, chain, entry);
+			return eval_free(IfNode_false(expr), bound, chain, entry);
+		case LetNode:
+			return eval_free(LetNode_value(expr), bound, chain, entry);
+		default:
+			eval_free(PairNode_left(expr), bound, chain, entry);
+			return eval_free(PairNode_right(expr), bound, chain, entry);
+	}
+}
+
+// the entry of what `expr` refers to of `chain`, `param` aside
+static int eval_entry(const Node *expr, const Chain *param, const Chain *chain)
+{
+	if (captured.count == captured.capacity) {
+		captured.capacity = captured.capacity ? captured.capacity * 2 : 256;
+		captured.entries = realloc(captured.entries, captured.capacity * sizeof(*captured.entries));
+	}
+	Captured *entry = &captured.entries[captured.count];
+	*entry = (Captured){1, 0, captured.symbols_count};
+	eval_free(expr, param, chain, entry);
+	if (entry->count && entry->count == Chain_length(chain)) {
+		captured.symbols_count = entry->first;
+		entry->count = -1;
+	}
+	captured.count += 1;
+	return captured.count - 1;
+}
+
+static int eval_captures(Node *expr, const Chain *chain);
+
+// NOTE: returns whether it shares `chain`, `param` is bound by the body
+// of a closure, which is analyzed with what it keeps
+static int eval_keeps(Node *expr, int index, const Chain *param, const Chain *chain)
+{
+	const Captured entry = captured.entries[index];
+	if (entry.count >= 0) {
+		chain = NULL;
+		Chain *copied = malloc(entry.count * sizeof(*copied));
+		for (int i = 0; i < entry.count; i++) {
+			copied[i] = (Chain){captured.symbols[entry.first + i], chain};
+			chain = &copied[i];
+		}
+		int escapes = eval_captures(expr, param ? &(Chain){param->name, chain} : chain);
+		free(copied);
+		captured.entries[index].escapes = escapes;
+		return 0;
+	}
+	captured.entries[index].escapes = eval_captures(expr, param ? &(Chain){param->name, chain} : chain);
+	return 1;
+}
+
+static void eval_print_captured(const Node *fn, int index)
+{
+	const Captured *entry = &captured.entries[index];
+	fprintf(stderr, "fn %s: ", FnNode_param_value(fn));
+	if (entry->count < 0) {
+		fprintf(stderr, "shares the environment");
+	} else if (!entry->count) {
+		fprintf(stderr, "captures nothing");
+	} else {
+		fprintf(stderr, "copies");
+		for (int i = 0; i < entry->count; i++) {
+			fprintf(stderr, " %s", Symbol_name(captured.symbols[entry->first + i]));
+		}
+	}
+	fprintf(stderr, ", %s\n", entry->escapes ? "frame escapes" : "frame on the stack");
+}
+
+// NOTE: whether evaluating `expr` in an environment that binds `chain` can
+// leave it behind in a closure or a thunk that shares it
+static int eval_captures(Node *expr, const Chain *chain)
+{
+	Chain param;
+	int shares;
+	switch (expr->type) {
+		case NumberNode:
+		case IdNode:
+			return 0;
+		case FnNode:
+			param = (Chain){IdNode_symbol(FnNode_param(expr)), NULL};
+			FnNode_captured(expr) = eval_entry(FnNode_body(expr), &param, chain);
+			shares = eval_keeps(FnNode_body(expr), FnNode_captured(expr), &param, chain);
+			if (debug) {
+				eval_print_captured(expr, FnNode_captured(expr));
+			}
+			return shares;
+		case ApplNode:
+			if (!lazy) {
+				return eval_captures(PairNode_left(expr), chain) | eval_captures(PairNode_right(expr), chain);
+			}
+			ApplNode_captured(expr) = eval_entry(PairNode_right(expr), NULL, chain);
+			shares = eval_keeps(PairNode_right(expr), ApplNode_captured(expr), NULL, chain);
+			return eval_captures(PairNode_left(expr), chain) | shares;
+		case ExptNode:
+		case ProdNode:
+		case SumNode:
+		case CmpNode:
+		case AndNode:
+		case OrNode:
+			return eval_captures(PairNode_left(expr), chain) | eval_captures(PairNode_right(expr), chain);
+		case IfNode:
+			return eval_captures(IfNode_cond(expr), chain) | eval_captures(IfNode_true(expr), chain) | eval_captures(IfNode_false(expr), chain);
+		case LetNode:
+			return eval_captures(LetNode_value(expr), chain);
+	}
+	return 1;
+}
+
+void eval_analyze(Node *expr)
+{
+	eval_captures(expr, NULL);
+}
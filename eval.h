@@ -6,5 +6,7 @@
 #include "context.h"
 
 Object *eval(const Node *expr, Context *ctx);
+Object *eval_apply(Object *fnv, Object *argv, Context *ctx);
+void   eval_analyze(Node *expr);
 
 #endif // EVAL_INCLUDED
@@ -1,12 +1,15 @@
 #include "gc.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "node.h"
 #include "object.h"
 #include "values.h"
 #include "env.h"
 #include "stack.h"
+#include "error.h"
 
 
 GC *GC_new(void)
@@ -17,27 +20,62 @@ GC *GC_new(void)
 	self->curr = 0;
 	self->count = 0;
 	self->thres = GC_INITIAL_THRESHOLD;
+	self->roots = NULL;
+	self->roots_count = 0;
+	self->regions = NULL;
+	self->free_regions = NULL;
+	self->current = NULL;
+	self->regions_count = 0;
+	self->regions_thres = GC_REGION_THRESHOLD;
+	self->maps = NULL;
+	self->maps_count = 0;
+	self->suspended = NULL;
+	self->peak = 0;
 	return self;
 }
 
+static void GC_free_regions(Region *region)
+{
+	while (region) {
+		Region *next = region->next;
+		free(region);
+		region = next;
+	}
+}
+
 void GC_drop(GC *self)
 {
+	GC_free_regions(self->regions);
+	GC_free_regions(self->free_regions);
 	free(self);
 }
 
+void GC_print_stats(const GC *self)
+{
+	fprintf(stderr, "gc: at most %u objects left by a collection\n", self->peak);
+}
+
+#define GC_region_of(obj) ((Region *)((uintptr_t)(obj) & ~(uintptr_t)(GC_REGION_SIZE - 1)))
+
 static void GC_mark(GC *self, Object *obj)
 {
-	if (obj->mark == self->curr) {
+	if (obj->mark == self->curr || obj->mark == GC_PERMANENT) {
 		return;
 	}
 	obj->mark = self->curr;
+	if (obj->region) {
+		GC_region_of(obj)->live += 1;
+	}
 	switch (obj->type) {
 		case NumObject:
 			return;
 		case FnObject:
 			return GC_mark(self, FnObj_env(obj));
 		case CompfnObject:
-			return GC_mark(self, CompFnObj_env(obj));
+			if (CompFnObj_env(obj)) {
+				GC_mark(self, CompFnObj_env(obj));
+			}
+			return;
 		case ThunkObject:
 			if (ThunkObj_value(obj)) {
 				return GC_mark(self, ThunkObj_value(obj));
@@ -47,9 +85,10 @@ static void GC_mark(GC *self, Object *obj)
 		case CompthunkObject:
 			if (CompThunkObj_value(obj)) {
 				return GC_mark(self, CompThunkObj_value(obj));
-			} else {
+			} else if (CompThunkObj_env(obj)) {
 				return GC_mark(self, CompThunkObj_env(obj));
 			}
+			return;
 		case EnvObject:
 			if (EnvObj_prev(obj)) {
 				GC_mark(self, EnvObj_prev(obj));
@@ -57,6 +96,11 @@ static void GC_mark(GC *self, Object *obj)
 			return Env_for_each(EnvObj_env(obj), (void (*)(void *, Object*))GC_mark, self);
 		case StackObject:
 			return Stack_for_each(StackObj_stack(obj), (void (*)(void *, Object*))GC_mark, self);
+		case FrameObject:
+			if (FrameObj_prev(obj)) {
+				GC_mark(self, FrameObj_prev(obj));
+			}
+			return GC_mark(self, FrameObj_value(obj));
 	}
 }
 
@@ -97,6 +141,8 @@ static void GC_free_object(Object *obj)
 			return Env_drop(EnvObj_env(obj));
 		case StackObject:
 			return Stack_drop(StackObj_stack(obj));
+		case FrameObject:
+			return free(ObjToVal(obj, Frame));
 	}
 }
 
@@ -115,6 +161,44 @@ static void GC_sweep(GC *self)
 	}
 }
 
+// NOTE: the current region stays, the cursor still points into it
+static void GC_sweep_regions(GC *self)
+{
+	Region **link = &self->regions;
+	self->regions_count = 0;
+	while (*link) {
+		Region *region = *link;
+		if (!region->live && region != self->current) {
+			*link = region->next;
+			region->next = self->free_regions;
+			self->free_regions = region;
+		} else {
+			region->live = 0;
+			self->regions_count += 1;
+			link = &region->next;
+		}
+	}
+	if (self->regions_count >= self->regions_thres / 2) {
+		self->regions_thres <<= 1;
+	}
+	GC_collect_pending = self->regions_count >= self->regions_thres;
+}
+
+static void GC_mark_stack(GC *self, Object **slot, const void *link);
+
+// the roots of compiled code, but the stack being run
+static void GC_mark_comp(GC *self)
+{
+	for (size_t i = 0; i < self->roots_count; i++) {
+		if (self->roots[i]) {
+			GC_mark(self, self->roots[i]);
+		}
+	}
+	for (Suspended *section = self->suspended; section; section = section->prev) {
+		GC_mark_stack(self, section->rsp, section->link);
+	}
+}
+
 void GC_collect(GC *self, Object *root, Object *stack)
 {
 	if (self->count < self->thres && (root || stack)) {
@@ -128,15 +212,52 @@ void GC_collect(GC *self, Object *root, Object *stack)
 	if (stack) {
 		GC_mark(self, stack);
 	}
+	GC_mark_comp(self);
 	GC_sweep(self);
+	GC_sweep_regions(self);
+	if (self->count > self->peak) {
+		self->peak = self->count;
+	}
 	if (self->count >= self->thres) {
 		self->thres <<= 1;
 	}
 }
 
-void GC_collect_comp(GC *self, Object *root, void *rsp, void *rbp)
+static int GC_compare_maps(const void *a, const void *b)
+{
+	const char *left = ((const StackMap *)a)->link;
+	const char *right = ((const StackMap *)b)->link;
+	return (left > right) - (left < right);
+}
+
+static void GC_mark_stack(GC *self, Object **slot, const void *link)
 {
-	if (self->count < self->thres && root) {
+	while (link) {
+		StackMap key = {.link = link};
+		const StackMap *map = bsearch(&key, self->maps, self->maps_count, sizeof(key), GC_compare_maps);
+		if (!map) {
+			errorf("gc: no stack map for %p", link);
+			exit(1);
+		}
+		for (unsigned i = 0; i < map->size; i++) {
+			if (map->types[i] == PTR_OBJ && slot[i]) {
+				GC_mark(self, slot[i]);
+			}
+		}
+		if (map->outermost) {
+			return;
+		}
+		link = slot[map->size - 1];
+		slot += map->size;
+	}
+}
+
+// NOTE: the environment of compiled code is NULL at the top level,
+// the globals live in the static slots registered with GC_set_roots,
+// `link` is the continuation of the code at `rsp`, NULL in main
+void GC_collect_comp(GC *self, Object *root, void *rsp, const void *link)
+{
+	if (self->count < self->thres && self->regions_count < self->regions_thres) {
 		self->thres >>= (self->count < self->thres/2);
 		return;
 	}
@@ -144,20 +265,72 @@ void GC_collect_comp(GC *self, Object *root, void *rsp, void *rbp)
 	if (root) {
 		GC_mark(self, root);
 	}
-	for (size_t *v = rsp; v < (size_t *)rbp; v += 2) {
-		if (v[0] == PTR_OBJ) {
-			GC_mark(self, (Object *)v[1]);
-		}
-	}
+	GC_mark_comp(self);
+	GC_mark_stack(self, rsp, link);
 	GC_sweep(self);
+	GC_sweep_regions(self);
+	if (self->count > self->peak) {
+		self->peak = self->count;
+	}
 	if (self->count >= self->thres) {
 		self->thres <<= 1;
 	}
 }
 
+void GC_set_roots(GC *self, Object **roots, size_t count)
+{
+	self->roots = roots;
+	self->roots_count = count;
+}
+
+void GC_set_stack_maps(GC *self, StackMap *maps, size_t count)
+{
+	qsort(maps, count, sizeof(*maps), GC_compare_maps);
+	self->maps = maps;
+	self->maps_count = count;
+}
+
+void GC_suspend(GC *self, Suspended *section, void *rsp, const void *link)
+{
+	section->rsp = rsp;
+	section->link = link;
+	section->prev = self->suspended;
+	self->suspended = section;
+}
+
+void GC_resume(GC *self, Suspended *section)
+{
+	self->suspended = section->prev;
+}
+
+__thread char *GC_region_limit = NULL;
+__thread int  GC_collect_pending = 0;
+
+// NOTE: returns the cursor past the `size` bytes taken from a fresh region,
+// the objects are small enough for any region to fit them
+char *GC_region_refill(GC *self, size_t size)
+{
+	Region *region = self->free_regions;
+	if (region) {
+		self->free_regions = region->next;
+	} else if (posix_memalign((void **)&region, GC_REGION_SIZE, GC_REGION_SIZE)) {
+		error("out of memory");
+		exit(1);
+	}
+	region->next = self->regions;
+	region->live = 0;
+	self->regions = region;
+	self->current = region;
+	self->regions_count += 1;
+	GC_collect_pending = self->regions_count >= self->regions_thres;
+	GC_region_limit = (char *)region + GC_REGION_SIZE;
+	return (char *)(region + 1) + size;
+}
+
 #define GC_init_object(self, val, otype) ({\
 	Object *obj = ValToObj(val);\
 	obj->mark = self->curr;\
+	obj->region = 0;\
 	obj->type = otype;\
 	GC_append_object(self, obj);\
 	obj;\
@@ -168,23 +341,22 @@ Object *GC_alloc_env(GC *self, Object *prev)
 	return GC_init_object(self, Env_new(prev), EnvObject);
 }
 
+Object *GC_alloc_env_frame(GC *self, Object *prev)
+{
+	return GC_init_object(self, Env_new_frame(prev), EnvObject);
+}
+
 Object *GC_alloc_fn(GC *self, Object *env, const Node *body, const char *arg)
 {
 	Fn *fn = malloc(sizeof(*fn));
+	fn->escapes = 1;
 	fn->env = env;
 	fn->body = body;
 	fn->arg = arg;
+	fn->text = NULL;
 	return GC_init_object(self, fn, FnObject);
 }
 
-Object *GC_alloc_compfn(GC *self, Object *env, void *text)
-{
-	CompFn *cfn = malloc(sizeof(*cfn));
-	cfn->env = env;
-	cfn->text = text;
-	return GC_init_object(self, cfn, CompfnObject);
-}
-
 Object *GC_alloc_number(GC *self, double num)
 {
 	Num *n = malloc(sizeof(*n));
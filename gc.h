@@ -6,12 +6,68 @@
 
 #define GC_INITIAL_THRESHOLD 128
 
+// the mark of the objects that are never collected nor scanned
+// (the statically allocated ones of compiled code)
+#define GC_PERMANENT -1
+
+// Compiled code allocates its objects by bumping a cursor through a region
+// and only calls GC_region_refill when it runs past GC_region_limit. The
+// regions aren't swept object by object: marking counts the live objects
+// of each region and the ones left without any are reused as a whole.
+#define GC_REGION_SIZE      (64 * 1024) // a power of two, regions are aligned to it
+#define GC_REGION_THRESHOLD 16
+
+// the mark of the objects allocated from a region, never the current one
+#define GC_FRESH 2
+
+typedef struct Region Region;
+
+struct Region {
+	Region   *next;
+	unsigned live; // the objects found by the last mark
+};
+
+extern __thread char *GC_region_limit;
+extern __thread int  GC_collect_pending; // enough regions are in use
+
+// The stack of compiled code is untyped. Every continuation (an address
+// REG_LINK may hold) has a map of the slots between the stack pointer and
+// the saved continuation of the code it belongs to, which is the deepest of
+// them, except for main, where the walk ends.
+typedef struct {
+	const void *link;
+	unsigned   size;
+	unsigned   outermost;
+	const char *types; // a PtrType per slot, from the top
+} StackMap;
+
+// The compiled stack is left for C when compiled code calls back into the
+// interpreter, the GC walks those parts of it along with the current one.
+typedef struct Suspended Suspended;
+
+struct Suspended {
+	void       *rsp;
+	const void *link;
+	Suspended  *prev;
+};
+
 typedef struct {
 	Object   *first;
 	Object   *last;
 	int      curr;
 	unsigned count;
 	unsigned thres;
+	Object   **roots; // the global slots of compiled code, NULL when empty
+	size_t   roots_count;
+	Region   *regions;      // in use, including the current one
+	Region   *free_regions;
+	Region   *current;      // the one the cursor points into
+	unsigned regions_count;
+	unsigned regions_thres;
+	StackMap *maps;         // sorted by link
+	size_t   maps_count;
+	Suspended *suspended;   // the innermost first
+	unsigned peak;          // the most objects left by a collection, for -d
 } GC;
 
 typedef enum {
@@ -21,11 +77,17 @@ typedef enum {
 
 GC     *GC_new(void);
 void   GC_drop(GC *self);
+void   GC_print_stats(const GC *self);
 void   GC_collect(GC *self, Object *root, Object *stack);
-void   GC_collect_comp(GC *self, Object *root, void *rsp, void *rbp);
+void   GC_collect_comp(GC *self, Object *root, void *rsp, const void *link);
+void   GC_set_roots(GC *self, Object **roots, size_t count);
+void   GC_set_stack_maps(GC *self, StackMap *maps, size_t count);
+void   GC_suspend(GC *self, Suspended *section, void *rsp, const void *link);
+void   GC_resume(GC *self, Suspended *section);
+char   *GC_region_refill(GC *self, size_t size);
 Object *GC_alloc_env(GC *self, Object *prev);
+Object *GC_alloc_env_frame(GC *self, Object *prev); // see Env_new_frame
 Object *GC_alloc_fn(GC *self, Object *env, const Node *body, const char *arg);
-Object *GC_alloc_compfn(GC *self, Object *env, void *text);
 Object *GC_alloc_number(GC *self, double num);
 Object *GC_alloc_thunk(GC *self, Object *env, const Node *body);
 Object *GC_alloc_stack(GC *self);
@@ -1,294 +1,345 @@
 #include "infer.h"
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include "node.h"
 #include "types.h"
 #include "context.h"
-#include "error.h"
 #include "arena.h"
 
 
 // TODO: better error messages
 
-typedef struct Subst Subst;
+// NOTE: the errors of a line go to stderr, or where infer_report points
+// them on the thread that infers it
+static __thread FILE *report = NULL;
 
-struct Subst {
-	int   var;
-	Type  *type;
-	Subst *prev;
-};
+#define infer_error(message) \
+	(fprintf(report ? report : stderr, message "\n"))
 
-// TODO: remove that garbage and make a normal struct for that
-#define SUBST_EMPTY (Subst *)1
+#define infer_errorf(fmt, args...) \
+	(fprintf(report ? report : stderr, fmt "\n", args))
 
-static Subst *Subst_extend(int var, Type *type, Subst *prev, Arena *a)
-{
-	Subst *new = Arena_alloc(a, sizeof(*new));
-	new->var = var;
-	new->type = type;
-	new->prev = prev;
-	return new;
-}
+// Type variables are unified by binding them in place, so instead of looking
+// things up in a substitution every walk goes through `prune`, which follows
+// the chain of bound variables and compresses it (union-find style).
+// Generalization is level based: a variable is created at the current let-depth
+// and is only generalized if it didn't escape into the enclosing environment.
 
-static Type *Subst_lookup(const Subst *subs, int var)
+static Type *prune(Type *type)
 {
-	while (subs != SUBST_EMPTY) {
-		if (subs->var == var) {
-			return subs->type;
-		}
-		subs = subs->prev;
+	Type *root = type;
+	while (root->kind == VarType && VarType_bound(root)) {
+		root = VarType_bound(root);
 	}
-	return NULL;
+	while (type->kind == VarType && VarType_bound(type)) {
+		Type *next = VarType_bound(type);
+		VarType_bound(type) = root;
+		type = next;
+	}
+	return root;
 }
 
-static int occurs(Type *var, Type *type, const Subst *subs)
+// NOTE: also lowers the levels of the variables in `type`,
+// since they are about to become reachable from `var`
+static int occurs(Type *var, Type *type)
 {
+	type = prune(type);
 	if (type->kind == VarType) {
-		if (VarType_value(type) == VarType_value(var)) {
+		if (type == var) {
 			return 1;
 		}
-		Type *val = Subst_lookup(subs, VarType_value(type));
-		return val && occurs(var, val, subs);
+		if (VarType_level(type) > VarType_level(var)) {
+			VarType_level(type) = VarType_level(var);
+		}
+		return 0;
 	}
 	if (type->kind == FnType) {
 		return (
-			occurs(var, FnType_from(type), subs) ||
-			occurs(var, FnType_to(type), subs)
+			occurs(var, FnType_from(type)) ||
+			occurs(var, FnType_to(type))
 		);
 	}
 	return 0;
 }
 
-static Subst *unify(Type *t1, Type *t2, Subst *subs, Arena *a);
+static int unify(Type *t1, Type *t2);
 
-static Subst *unify_var(Type *t1, Type *t2, Subst *subs, Arena *a)
+static int unify_var(Type *var, Type *type)
 {
-	Type *v1 = Subst_lookup(subs, VarType_value(t1));
-	if (v1) {
-		return unify(v1, t2, subs, a);
+	if (occurs(var, type)) {
+		infer_error("inference error: recursive type");
+		return 0;
 	}
-	while (t2->kind == VarType) {
-		if (VarType_value(t1) == VarType_value(t2)) {
-			return subs;
-		}
-		Type *v2 = Subst_lookup(subs, VarType_value(t2));
-		if (!v2) {
-			return Subst_extend(VarType_value(t1), t2, subs, a);
-		}
-		t2 = v2;
-	}
-	if (occurs(t1, t2, subs)) {
-		error("inference error: recursive type");
-		return NULL;
-	}
-	return Subst_extend(VarType_value(t1), t2, subs, a);
+	VarType_bound(var) = type;
+	return 1;
 }
 
-static Subst *unify_fn(Type *f1, Type *f2, Subst *subs, Arena *a)
+static int unify_fn(Type *f1, Type *f2)
 {
-	subs = unify(FnType_from(f1), FnType_from(f2), subs, a);
-	if (!subs) {
-		return NULL;
+	if (!unify(FnType_from(f1), FnType_from(f2))) {
+		return 0;
 	}
-	return unify(FnType_to(f1), FnType_to(f2), subs, a);
+	return unify(FnType_to(f1), FnType_to(f2));
 }
 
-static Subst *unify(Type *t1, Type *t2, Subst *subs, Arena *a)
+static int unify(Type *t1, Type *t2)
 {
+	t1 = prune(t1);
+	t2 = prune(t2);
+	if (t1 == t2) {
+		return 1;
+	}
 	if (t1->kind == VarType) {
-		return unify_var(t1, t2, subs, a);
+		return unify_var(t1, t2);
 	} else if (t2->kind == VarType) {
-		return unify_var(t2, t1, subs, a);
+		return unify_var(t2, t1);
 	} else if (t1->kind == t2->kind) {
 		if (t1->kind == FnType) {
-			return unify_fn(t1, t2, subs, a);
+			return unify_fn(t1, t2);
 		} else {
-			return subs;
+			return 1;
 		}
 	}
-	error("inference error: ununifiable types");
-	return NULL;
+	infer_error("inference error: ununifiable types");
+	return 0;
 }
 
-static Type *substitute(Type *mono, const Subst *subs, int recursive, Arena *a)
+static int max_generic_id(const Type *type)
 {
-	switch (mono->kind) {
+	switch (type->kind) {
 		case VarType:
-			Type *val = Subst_lookup(subs, VarType_value(mono));
-			if (!val) {
-				return mono;
-			}
-			if (recursive) {
-				return substitute(val, subs, recursive, a);
-			}
-			return val;
-		case NumType:
-			return NumType_get();
+			return VarType_value(type);
 		case FnType:
-			Type *new_from = substitute(FnType_from(mono), subs, recursive, a);
-			Type *new_to = substitute(FnType_to(mono), subs, recursive, a);
-			return FnType_new(a, new_from, new_to);
+			int from = max_generic_id(FnType_from(type));
+			int to = max_generic_id(FnType_to(type));
+			return from > to ? from : to;
+		case NumType:
+			return -1;
 		case GenType:
-			error("inference error: unexpected polytype");
+			infer_error("inference error: unexpected polytype");
 	}
-	return NULL;
+	return -1;
 }
 
-static Subst *refresh(Type *mono, Subst *subs, Arena *a)
+static Type *instantiate_mono(Type *mono, Type **fresh, int level, Arena *a)
 {
 	switch (mono->kind) {
 		case VarType:
-			if (Subst_lookup(subs, VarType_value(mono))) {
-				return subs;
+			if (!fresh[VarType_value(mono)]) {
+				fresh[VarType_value(mono)] = VarType_new(a, level);
 			}
-			return Subst_extend(VarType_value(mono), VarType_new(a), subs, a);
-		case FnType:
-			return refresh(FnType_to(mono), refresh(FnType_from(mono), subs, a), a);
+			return fresh[VarType_value(mono)];
 		case NumType:
-			return subs;
+			return mono;
+		case FnType:
+			Type *from = instantiate_mono(FnType_from(mono), fresh, level, a);
+			Type *to = instantiate_mono(FnType_to(mono), fresh, level, a);
+			return FnType_new(a, from, to);
 		case GenType:
-			error("inference error: unexpected polytype");
+			infer_error("inference error: unexpected polytype");
 	}
 	return NULL;
 }
 
-static Type *instantiate(Type *type, Arena *a)
+// NOTE: variables of a polytype are numbered from zero (see `generalize`)
+static Type *instantiate(Type *type, int level, Arena *a)
 {
 	if (type->kind != GenType) {
 		return type;
 	}
-	Subst *subs = refresh(GenType_inner(type), SUBST_EMPTY, a);
-	Type *mono = substitute(GenType_inner(type), subs, 0, a);
-	return mono;
+	int count = max_generic_id(GenType_inner(type)) + 1;
+	Type **fresh = Arena_alloc(a, count * sizeof(*fresh));
+	memset(fresh, 0, count * sizeof(*fresh));
+	return instantiate_mono(GenType_inner(type), fresh, level, a);
 }
 
-static Type *generalize(Type *mono, Arena *a)
+static Type *generalize_mono(Type *mono, int level, Arena *a)
+{
+	mono = prune(mono);
+	switch (mono->kind) {
+		case VarType:
+			if (VarType_level(mono) <= level || VarType_level(mono) == GENERIC_LEVEL) {
+				return mono;
+			}
+			// the variable is bound to its generic replacement,
+			// so the following occurrences get the same one
+			VarType_bound(mono) = VarType_new(a, GENERIC_LEVEL);
+			return VarType_bound(mono);
+		case NumType:
+			return mono;
+		case FnType:
+			Type *from = generalize_mono(FnType_from(mono), level, a);
+			Type *to = generalize_mono(FnType_to(mono), level, a);
+			return FnType_new(a, from, to);
+		case GenType:
+			infer_error("inference error: unexpected polytype");
+	}
+	return NULL;
+}
+
+static Type *generalize(Type *mono, int level, Arena *a)
 {
 	VarType_reset();
-	Subst *subs = refresh(mono, SUBST_EMPTY, a);
-	Type *gen = GenType_new(a, substitute(mono, subs, 0, a));
-	return gen;
+	return GenType_new(a, generalize_mono(mono, level, a));
 }
 
-static Subst *M(const Node *expr, TypeEnv *env, Subst *subs, Type *target, Arena *a);
+static int M(const Node *expr, const TypeEnv *env, const TypeScope *scope, Type *target, int level, Arena *a);
 
-static Subst *M_id(const Node *id, TypeEnv *env, Subst *subs, Type *target, Arena *a)
+static int M_id(const Node *id, const TypeEnv *env, const TypeScope *scope, Type *target, int level, Arena *a)
 {
-	Type *id_type = TypeEnv_lookup(env, IdNode_value(id));
+	Type *id_type = TypeEnv_lookup(env, scope, IdNode_symbol(id));
 	if (!id_type) {
-		errorf("unbound variable: %s", IdNode_value(id));
-		return NULL;
+		infer_errorf("unbound variable: %s", IdNode_value(id));
+		return 0;
 	}
-	id_type = instantiate(id_type, a);
-	subs = unify(target, id_type, subs, a);
-	return subs;
+	id_type = instantiate(id_type, level, a);
+	return unify(target, id_type);
 }
 
-static Subst *M_if(const Node *ifelse, TypeEnv *env, Subst *subs, Type *target, Arena *a)
+static int M_if(const Node *ifelse, const TypeEnv *env, const TypeScope *scope, Type *target, int level, Arena *a)
 {
-	subs = M(IfNode_cond(ifelse), env, subs, NumType_get(), a);
-	if (!subs) {
-		return NULL;
+	if (!M(IfNode_cond(ifelse), env, scope, NumType_get(), level, a)) {
+		return 0;
 	}
-	subs = M(IfNode_true(ifelse), env, subs, target, a);
-	if (!subs) {
-		return NULL;
+	if (!M(IfNode_true(ifelse), env, scope, target, level, a)) {
+		return 0;
 	}
-	return M(IfNode_false(ifelse), env, subs, target, a);
+	return M(IfNode_false(ifelse), env, scope, target, level, a);
 }
 
-static Subst *M_fn(const Node *fn, TypeEnv *env, Subst *subs, Type *target, Arena *a)
+static int M_fn(const Node *fn, const TypeEnv *env, const TypeScope *scope, Type *target, int level, Arena *a)
 {
-	Type *arg_type = VarType_new(a);
-	Type *body_type = VarType_new(a);
+	Type *arg_type = VarType_new(a, level);
+	Type *body_type = VarType_new(a, level);
 	Type *fn_type = FnType_new(a, arg_type, body_type);
-	subs = unify(target, fn_type, subs, a);
-	if (!subs) {
-		return NULL;
+	if (!unify(target, fn_type)) {
+		return 0;
 	}
-	TypeEnv extended = {FnNode_param_value(fn), arg_type, env};
-	subs = M(FnNode_body(fn), &extended, subs, body_type, a);
-	return subs;
+	TypeScope extended = {IdNode_symbol(FnNode_param(fn)), arg_type, scope};
+	return M(FnNode_body(fn), env, &extended, body_type, level, a);
 }
 
-static Subst *M_pair(const Node *pair, TypeEnv *env, Subst *subs, Type *target, Arena *a)
+static int M_pair(const Node *pair, const TypeEnv *env, const TypeScope *scope, Type *target, int level, Arena *a)
 {
-	subs = unify(target, NumType_get(), subs, a);
-	if (!subs) {
-		return NULL;
+	if (!unify(target, NumType_get())) {
+		return 0;
 	}
-	subs = M(PairNode_left(pair), env, subs, target, a);
-	if (!subs) {
-		return NULL;
+	if (!M(PairNode_left(pair), env, scope, target, level, a)) {
+		return 0;
 	}
-	return M(PairNode_right(pair), env, subs, target, a);
+	return M(PairNode_right(pair), env, scope, target, level, a);
 }
 
-static Subst *M_application(const Node *appl, TypeEnv *env, Subst *subs, Type *target, Arena *a)
+static int M_application(const Node *appl, const TypeEnv *env, const TypeScope *scope, Type *target, int level, Arena *a)
 {
-	Type *operand_type = VarType_new(a);
+	Type *operand_type = VarType_new(a, level);
 	Type *operator_type = FnType_new(a, operand_type, target);
-	subs = M(PairNode_left(appl), env, subs, operator_type, a);
-	if (!subs) {
-		return NULL;
+	if (!M(PairNode_left(appl), env, scope, operator_type, level, a)) {
+		return 0;
 	}
-	subs = M(PairNode_right(appl), env, subs, operand_type, a);
-	return subs;
+	return M(PairNode_right(appl), env, scope, operand_type, level, a);
 }
 
-static Subst *M_let(const Node *let, TypeEnv *env, Subst *subs, Type *target, Arena *a)
+static int M_let(const Node *let, const TypeEnv *env, const TypeScope *scope, Type *target, int level, Arena *a)
 {
-	TypeEnv extended = {LetNode_name_value(let), target, env};
-	subs = M(LetNode_value(let), &extended, subs, target, a);
-	return subs;
+	TypeScope extended = {IdNode_symbol(LetNode_name(let)), target, scope};
+	return M(LetNode_value(let), env, &extended, target, level, a);
+}
+
+// NOTE: the type of every node M sees is kept until the line checks, then
+// the nodes are annotated with what is proven of their values, the lines
+// of a batch are inferred in parallel
+typedef struct {
+	const Node *node;
+	Type       *type;
+} Annotation;
+
+static __thread struct {
+	Annotation *entries;
+	int        count;
+	int        capacity;
+} annotations = {0};
+
+static void annotate(Node *root)
+{
+	for (int i = 0; i < annotations.count; i++) {
+		Node *node = root + (annotations.entries[i].node - root);
+		Type *type = prune(annotations.entries[i].type);
+		node->proven = type->kind == NumType ? PROVEN_NUM : type->kind == FnType ? PROVEN_FN : 0;
+	}
 }
 
-static Subst *M(const Node *expr, TypeEnv *env, Subst *subs, Type *target, Arena *a)
+static int M(const Node *expr, const TypeEnv *env, const TypeScope *scope, Type *target, int level, Arena *a)
 {
+	if (annotations.count == annotations.capacity) {
+		annotations.capacity = annotations.capacity ? annotations.capacity * 2 : 256;
+		annotations.entries = realloc(annotations.entries, annotations.capacity * sizeof(*annotations.entries));
+	}
+	annotations.entries[annotations.count++] = (Annotation){expr, target};
 	switch (expr->type) {
 		case NumberNode:
-			return unify(target, NumType_get(), subs, a);
+			return unify(target, NumType_get());
 		case IdNode:
-			return M_id(expr, env, subs, target, a);
+			return M_id(expr, env, scope, target, level, a);
 		case IfNode:
-			return M_if(expr, env, subs, target, a);
+			return M_if(expr, env, scope, target, level, a);
 		case FnNode:
-			return M_fn(expr, env, subs, target, a);
+			return M_fn(expr, env, scope, target, level, a);
 		case SumNode:
 		case ProdNode:
 		case ExptNode:
 		case CmpNode:
 		case AndNode:
 		case OrNode:
-			return M_pair(expr, env, subs, target, a);
+			return M_pair(expr, env, scope, target, level, a);
 		case ApplNode:
-			return M_application(expr, env, subs, target, a);
+			return M_application(expr, env, scope, target, level, a);
 		case LetNode:
-			return M_let(expr, env, subs, target, a);
+			return M_let(expr, env, scope, target, level, a);
 	}
-	return NULL;
+	return 0;
 }
 
-Type *infer(const Node *expr, TypeEnv **tenv, Arena *a)
+Type *infer(Node *expr, TypeEnv *tenv, Arena *a)
 {
-	Type *target = VarType_new(a);
-	Subst *subs = M(expr, *tenv, SUBST_EMPTY, target, a);
-	if (!subs) {
+	ArenaMark mark = Arena_mark(a);
+	// NOTE: the top-level environment is closed, so everything
+	// that is created at a deeper level can be generalized
+	Type *target = VarType_new(a, 1);
+	int ok = M(expr, tenv, TYPESCOPE_EMPTY, target, 1, a);
+	if (ok) {
+		annotate(expr);
+	}
+	free(annotations.entries);
+	annotations.entries = NULL;
+	annotations.count = annotations.capacity = 0;
+	if (!ok) {
+		Arena_rollback(a, mark);
 		return NULL;
 	}
-	Type *mono = substitute(target, subs, 1, a);
-	Type *poly = generalize(mono, a);
+	Type *poly = generalize(target, 0, a);
+	// drop the intermediate types, keeping only the result
+	Type *result = Type_copy(NULL, poly);
+	Arena_rollback(a, mark);
+	poly = Type_copy(a, result);
+	Type_drop(result);
 	if (expr->type == LetNode) {
-		const char *name = LetNode_name_value(expr);
-		Type *old = TypeEnv_lookup(*tenv, name);
+		Symbol name = IdNode_symbol(LetNode_name(expr));
+		Type *old = TypeEnv_lookup(tenv, TYPESCOPE_EMPTY, name);
 		if (!old) {
-			TypeEnv_push(tenv, name, poly);
+			TypeEnv_define(tenv, name, poly);
 		} else if (!Type_eq(old, poly)) {
-			error("inference error: symbol type cannot change");
+			infer_error("inference error: symbol type cannot change");
 			return NULL;
 		}
 	}
 	return poly;
 }
+
+void infer_report(FILE *out)
+{
+	report = out;
+}
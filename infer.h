@@ -1,11 +1,16 @@
 #ifndef INFER_INCLUDED
 #define INFER_INCLUDED
 
+#include <stdio.h>
+
 #include "node.h"
 #include "types.h"
 #include "context.h"
 #include "arena.h"
 
-Type *infer(const Node *expr, TypeEnv **tenv, Arena *a);
+// NOTE: annotates the nodes of `expr` with what it proves, when it checks
+Type *infer(Node *expr, TypeEnv *tenv, Arena *a);
+// NOTE: where the errors go on the calling thread, stderr when NULL
+void infer_report(FILE *out);
 
 #endif // INFER_INCLUDED
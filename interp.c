@@ -4,15 +4,95 @@
 #include "opts.h"
 #include "scanner.h"
 #include "parse.h"
+#include "optimize.h"
 #include "node.h"
 #include "infer.h"
 #include "types.h"
 #include "eval.h"
 #include "arena.h"
+#include "batch.h"
+#include "jit.h"
+#include "gc.h"
 
 
 #define TMP_ARENA_PAGE_SIZE 4096
 
+static void run(const Node *ast, const Type *type, Context *ctx, Jit *compiler)
+{
+	if (debug) {
+		Node_println(ast, stdout);
+	}
+	Object *result = compiler ? Jit_run(compiler, ast) : eval(ast, ctx);
+	if (!result) {
+		return;
+	}
+	Object_print(result);
+	if (type) {
+		printf(" :: ");
+		Type_print(type);
+	}
+	printf("\n");
+}
+
+static void run_line(Node *ast, Context *ctx, Jit *compiler, TypeEnv *tenv, Arena *tmp, Arena *longtmp)
+{
+	Type *type = NULL;
+	if (typed) {
+		type = infer(ast, tenv, tmp);
+		if (!type) {
+			return;
+		}
+	}
+	ast = optimize(ast, longtmp);
+	eval_analyze(ast);
+	run(ast, type, ctx, compiler);
+}
+
+// NOTE: with -p the whole input is parsed before anything is evaluated, so
+// that the optimizer knows which of the globals are never bound again, the
+// lines are run as they come otherwise
+static void run_file(Scanner *scanner, Context *ctx, Jit *compiler, TypeEnv *tenv, Arena *tmp, Arena *longtmp)
+{
+	Batch batch = Batch_make();
+	while (!Scanner_eof(*scanner)) {
+		Node *ast = parse(scanner, longtmp);
+		if (ast) {
+			optimize_declare(ast);
+			Batch_add(&batch, ast);
+		}
+	}
+	for (int i = 0; i < batch.count; i++) {
+		Arena_reset(tmp);
+		run_line(batch.exprs[i], ctx, compiler, tenv, tmp, longtmp);
+	}
+	Batch_destroy(batch);
+}
+
+// NOTE: likewise, and all of it is type checked before anything is evaluated
+static void run_batch(Scanner *scanner, Context *ctx, Jit *compiler, TypeEnv *tenv, Arena *longtmp)
+{
+	Batch batch = Batch_make();
+	while (!Scanner_eof(*scanner)) {
+		Node *ast = parse(scanner, longtmp);
+		if (ast) {
+			optimize_declare(ast);
+			Batch_add(&batch, ast);
+		}
+	}
+	Batch_infer(&batch, tenv, sysconf(_SC_NPROCESSORS_ONLN));
+	for (int i = 0; i < batch.count; i++) {
+		if (batch.types[i]) {
+			Node *ast = optimize(batch.exprs[i], longtmp);
+			eval_analyze(ast);
+			run(ast, batch.types[i], ctx, compiler);
+		}
+	}
+	if (debug) {
+		Batch_print_stats(&batch);
+	}
+	Batch_destroy(batch);
+}
+
 int main(int argc, char **argv)
 {
 	if (!parse_args(argc, argv)) {
@@ -21,41 +101,38 @@ int main(int argc, char **argv)
 	int tty = isatty(0);
 	Scanner scanner = Scanner_make(stdin);
 	Context ctx = Context_make();
+	// NOTE: the compiled code only runs along in the strict mode
+	ctx.jit = jit || !lazy ? Jit_new(&ctx) : NULL;
+	Jit *compiler = jit ? ctx.jit : NULL;
 	// TODO: maybe make those parts of the context?
-	TypeEnv *tenv = TYPEENV_EMPTY;
+	TypeEnv tenv = TypeEnv_make();
 	Arena tmp = Arena_make(TMP_ARENA_PAGE_SIZE);
 	Arena longtmp = Arena_make(TMP_ARENA_PAGE_SIZE);
+	if (typed && batch && !tty) {
+		run_batch(&scanner, &ctx, compiler, &tenv, &longtmp);
+	} else if (batch && !tty) {
+		run_file(&scanner, &ctx, compiler, &tenv, &tmp, &longtmp);
+	}
 	while (!Scanner_eof(scanner)) {
 		Arena_reset(&tmp);
 		if (tty) {
 			fprintf(stderr, "> ");
 		}
 		Node *ast = parse(&scanner, &longtmp);
-		if (!ast) {
-			continue;
-		}
-		Type *type = NULL;
-		if (typed) {
-			type = infer(ast, &tenv, &tmp);
-			if (!type) {
-				continue;
-			}
-		}
-		if (debug) {
-			Node_println(ast);
+		if (ast) {
+			run_line(ast, &ctx, compiler, &tenv, &tmp, &longtmp);
 		}
-		Object *result = eval(ast, &ctx);
-		if (!result) {
-			continue;
-		}
-		Object_print(result);
-		if (type) {
-			printf(" :: ");
-			Type_print(type);
-		}
-		printf("\n");
+	}
+	if (debug) {
+		optimize_print_stats();
+		GC_print_stats(ctx.gc);
+		Arena_print_stats(&longtmp, "ast arena");
+		Arena_print_stats(&tmp, "scratch arena");
 	}
 	Scanner_destroy(scanner);
+	if (ctx.jit) {
+		Jit_drop(ctx.jit);
+	}
 	Context_destroy(ctx);
 	TypeEnv_drop(tenv);
 	Arena_destroy(tmp);
@@ -0,0 +1,616 @@
+#include "ir.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "opts.h"
+
+
+#define IR_ARENA_PAGE_SIZE 4096
+
+Ir Ir_make(void)
+{
+	Ir self = {0};
+	self.arena = Arena_make(IR_ARENA_PAGE_SIZE);
+	return self;
+}
+
+void Ir_reset(Ir *self)
+{
+	Arena_reset(&self->arena);
+	self->count = 0;
+	self->asserts = 0;
+	self->forces = 0;
+	self->checks = 0;
+	self->envs = 0;
+	self->links = 0;
+	self->frames = 0;
+}
+
+void Ir_destroy(Ir self)
+{
+	Arena_destroy(self.arena);
+	free(self.temps);
+}
+
+IrBody *Ir_body(Ir *self, BodyKind kind, int id)
+{
+	IrBody *body = Arena_alloc(&self->arena, sizeof(*body));
+	memset(body, 0, sizeof(*body));
+	body->kind = kind;
+	body->id = id;
+	body->code.result = -1;
+	return body;
+}
+
+IrInstr *Ir_append(Ir *self, IrBlock *block, IrOp op)
+{
+	IrInstr *instr = Arena_alloc(&self->arena, sizeof(*instr));
+	memset(instr, 0, sizeof(*instr));
+	instr->op = op;
+	instr->dst = -1;
+	instr->a = -1;
+	instr->b = -1;
+	instr->then.result = -1;
+	instr->other.result = -1;
+	if (block->last) {
+		block->last->next = instr;
+	} else {
+		block->first = instr;
+	}
+	block->last = instr;
+	return instr;
+}
+
+Temp Ir_def(Ir *self, IrInstr *instr, TempKind kind)
+{
+	if (self->count == self->capacity) {
+		self->capacity = self->capacity ? self->capacity * 2 : 256;
+		self->temps = realloc(self->temps, self->capacity * sizeof(*self->temps));
+	}
+	self->temps[self->count] = (IrTemp){kind, 0, 0, instr, -1};
+	instr->dst = self->count;
+	self->count += 1;
+	return instr->dst;
+}
+
+/* known types */
+
+// What is known about the variables: the parameters and the globals are
+// never assigned while the code runs, so once one has been forced or its
+// type asserted, that holds for all of the code that follows.
+typedef struct {
+	int global;
+	int key;   // the depth of a parameter, the slot of a global
+	int known;
+} Fact;
+
+typedef struct {
+	Fact *items;
+	int  count;
+	int  capacity;
+} Facts;
+
+static int Facts_find(const Facts *self, int global, int key)
+{
+	for (int i = 0; i < self->count; i++) {
+		if (self->items[i].global == global && self->items[i].key == key) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int Facts_add(Facts *self, int global, int key)
+{
+	if (self->count == self->capacity) {
+		self->capacity = self->capacity ? self->capacity * 2 : 16;
+		self->items = realloc(self->items, self->capacity * sizeof(*self->items));
+	}
+	self->items[self->count] = (Fact){global, key, 0};
+	self->count += 1;
+	return self->count - 1;
+}
+
+static Facts Facts_copy(const Facts *self)
+{
+	Facts copy = {NULL, self->count, self->count};
+	if (self->count) {
+		copy.items = malloc(self->count * sizeof(*copy.items));
+		memcpy(copy.items, self->items, self->count * sizeof(*copy.items));
+	}
+	return copy;
+}
+
+// what holds after either of `a` and `b`
+static void Facts_meet(Facts *self, Facts a, Facts b)
+{
+	self->count = 0;
+	for (int i = 0; i < a.count; i++) {
+		int j = Facts_find(&b, a.items[i].global, a.items[i].key);
+		if (j >= 0) {
+			int k = Facts_add(self, a.items[i].global, a.items[i].key);
+			self->items[k].known = a.items[i].known & b.items[j].known;
+		}
+	}
+	free(a.items);
+	free(b.items);
+}
+
+// the variable `temp` was loaded from, -1 for the other temporaries
+static int Facts_variable(const Facts *self, const IrTemp *temp)
+{
+	switch (temp->def->op) {
+		case IrParam:
+			return Facts_find(self, 0, temp->def->depth);
+		case IrGlobal:
+			return Facts_find(self, 1, temp->def->slot);
+		default:
+			return -1;
+	}
+}
+
+static void Ir_infer_body(Ir *self, IrBody *body);
+
+static void Ir_infer(Ir *self, IrBlock *block, Facts *facts)
+{
+	for (IrInstr *instr = block->first; instr; instr = instr->next) {
+		IrTemp *a = instr->a >= 0 ? &self->temps[instr->a] : NULL;
+		int known = 0;
+		int var;
+		Facts then, other;
+		switch (instr->op) {
+			case IrNum:
+			case IrBox:
+				known = KNOWN_NUM | KNOWN_FORCED;
+				break;
+			case IrParam:
+			case IrGlobal:
+				var = Facts_find(facts, instr->op == IrGlobal, instr->op == IrGlobal ? instr->slot : instr->depth);
+				if (instr->op == IrGlobal && var >= 0) {
+					instr->bound = 1;
+					self->checks += 1;
+				}
+				if (var < 0) {
+					var = Facts_add(facts, instr->op == IrGlobal, instr->op == IrGlobal ? instr->slot : instr->depth);
+				}
+				// NOTE: what is asserted of a variable is about its value
+				known = lazy ? 0 : KNOWN_FORCED | facts->items[var].known;
+				break;
+			case IrClosure:
+				known = KNOWN_FN | KNOWN_FORCED;
+				Ir_infer_body(self, instr->body);
+				break;
+			case IrThunk:
+				Ir_infer_body(self, instr->body);
+				break;
+			case IrForce:
+				var = Facts_variable(facts, a);
+				if (a->known & KNOWN_FORCED) {
+					instr->dead = 1;
+					self->forces += 1;
+					break;
+				}
+				if (var >= 0 && facts->items[var].known & KNOWN_FORCED) {
+					instr->evaluated = 1;
+					self->forces += 1;
+				}
+				a->known |= KNOWN_FORCED | (var >= 0 ? facts->items[var].known : 0);
+				if (var >= 0) {
+					facts->items[var].known |= KNOWN_FORCED;
+				}
+				break;
+			case IrAssert:
+				var = Facts_variable(facts, a);
+				known = instr->type == NumObject ? KNOWN_NUM : KNOWN_FN;
+				if (typed || a->known & known) {
+					instr->dead = 1;
+					self->asserts += 1;
+				}
+				a->known |= known;
+				if (var >= 0) {
+					facts->items[var].known |= known;
+				}
+				known = 0;
+				break;
+			case IrCall:
+				known = lazy ? 0 : KNOWN_FORCED;
+				break;
+			case IrIf:
+				then = Facts_copy(facts);
+				other = Facts_copy(facts);
+				Ir_infer(self, &instr->then, &then);
+				Ir_infer(self, &instr->other, &other);
+				Facts_meet(facts, then, other);
+				if (!instr->tail) {
+					known = self->temps[instr->then.result].known & self->temps[instr->other.result].known;
+				}
+				break;
+			case IrAnd:
+			case IrOr:
+				then = Facts_copy(facts);
+				Ir_infer(self, &instr->then, &then);
+				free(then.items);
+				if (!instr->tail) {
+					known = a->known & self->temps[instr->then.result].known;
+				}
+				break;
+			default:
+				break;
+		}
+		if (instr->dst >= 0) {
+			self->temps[instr->dst].known = known;
+		}
+	}
+}
+
+static void Ir_infer_body(Ir *self, IrBody *body)
+{
+	Facts facts = {0};
+	Ir_infer(self, &body->code, &facts);
+	free(facts.items);
+}
+
+/* liveness */
+
+static void Ir_use(Ir *self, Temp temp, int seq)
+{
+	if (temp >= 0) {
+		self->temps[temp].last = seq;
+	}
+}
+
+// numbers the instructions in the order they are lowered, the result of
+// a block is used where it ends
+static void Ir_number(Ir *self, IrBlock *block, int *seq)
+{
+	for (IrInstr *instr = block->first; instr; instr = instr->next) {
+		instr->seq = *seq;
+		*seq += 1;
+		if (instr->dead) {
+			continue;
+		}
+		Ir_use(self, instr->a, instr->seq);
+		Ir_use(self, instr->b, instr->seq);
+		for (int i = 0; instr->args && i < instr->count; i++) {
+			Ir_use(self, instr->args[i], instr->seq);
+		}
+		if (instr->op == IrIf) {
+			Ir_number(self, &instr->then, seq);
+			Ir_number(self, &instr->other, seq);
+		} else if (instr->op == IrAnd || instr->op == IrOr) {
+			Ir_number(self, &instr->then, seq);
+		}
+	}
+	Ir_use(self, block->result, *seq);
+	*seq += 1;
+}
+
+static int Ir_consumes(const Ir *self, const IrInstr *instr, Temp temp)
+{
+	return temp >= 0 && self->temps[temp].kind == TempFloat && self->temps[temp].last == instr->seq;
+}
+
+// the floats are allocated like a stack, `live` of them are in the registers
+static void Ir_floats(Ir *self, IrBlock *block, int live)
+{
+	for (IrInstr *instr = block->first; instr; instr = instr->next) {
+		if (instr->dead) {
+			continue;
+		}
+		live -= Ir_consumes(self, instr, instr->a) + Ir_consumes(self, instr, instr->b);
+		for (int i = 0; instr->op == IrNative && i < instr->count; i++) {
+			live -= Ir_consumes(self, instr, instr->args[i]);
+		}
+		switch (instr->op) {
+			case IrSpill:
+				live -= instr->count;
+				break;
+			case IrRestore:
+				live += instr->count;
+				break;
+			case IrIf:
+				Ir_floats(self, &instr->other, live);
+				// fallthrough
+			case IrAnd:
+			case IrOr:
+				Ir_floats(self, &instr->then, live);
+				break;
+			default:
+				break;
+		}
+		instr->floats = live;
+		if (instr->dst >= 0 && self->temps[instr->dst].kind == TempFloat) {
+			live += 1;
+		}
+	}
+}
+
+// whether the environment is live before `instr`, given that it is `live`
+// after the block. It is empty in a line, the uses there don't need it.
+static int Ir_env(const IrBody *body, IrInstr *instr, int live)
+{
+	if (!instr) {
+		return live;
+	}
+	live = Ir_env(body, instr->next, live);
+	instr->env = live;
+	if (instr->dead) {
+		return live;
+	}
+	switch (instr->op) {
+		case IrParam:
+			return live || body->kind != BodyLine;
+		case IrThunk:
+			return live || (!instr->count && body->kind != BodyLine);
+		case IrLoop:
+			return 1;
+		case IrClosure:
+			return live || (!instr->closed && !instr->count && body->kind != BodyLine);
+		case IrIf:
+			return Ir_env(body, instr->then.first, live) | Ir_env(body, instr->other.first, live);
+		case IrAnd:
+		case IrOr:
+			return Ir_env(body, instr->then.first, live) | live;
+		default:
+			return live;
+	}
+}
+
+// whether `instr` enters other code, with REG_LINK pointing back
+static int Ir_calls(const IrInstr *instr)
+{
+	if (instr->dead) {
+		return 0;
+	}
+	switch (instr->op) {
+		case IrCall:
+			return !instr->tail;
+		case IrForce:
+			return !instr->evaluated;
+		default:
+			return 0;
+	}
+}
+
+static void Ir_live_body(Ir *self, IrBody *body);
+
+static void Ir_saves(Ir *self, IrBody *body, const IrBlock *block)
+{
+	for (IrInstr *instr = block->first; instr; instr = instr->next) {
+		if (Ir_calls(instr)) {
+			body->link = 1;
+			self->envs += !instr->env;
+		}
+		if (instr->dead) {
+			continue;
+		}
+		switch (instr->op) {
+			case IrClosure:
+			case IrThunk:
+				body->escapes |= (instr->op == IrThunk || !instr->closed) && !instr->count;
+				Ir_live_body(self, instr->body);
+				break;
+			case IrLoop:
+				// NOTE: the GC walks the flag of the outer frames (see lower_loop)
+				// from the saved link
+				body->link |= instr->count > 1;
+				break;
+			case IrIf:
+				Ir_saves(self, body, &instr->other);
+				// fallthrough
+			case IrAnd:
+			case IrOr:
+				Ir_saves(self, body, &instr->then);
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+static void Ir_live_body(Ir *self, IrBody *body)
+{
+	int seq = 0;
+	Ir_number(self, &body->code, &seq);
+	Ir_floats(self, &body->code, 0);
+	Ir_env(body, body->code.first, 0);
+	Ir_saves(self, body, &body->code);
+	// NOTE: a frame that stays on the stack across the calls would make every
+	// level of a deep recursion that much deeper, so only the functions that
+	// call nothing keep it there. The GC is let in once it is, with the saved
+	// link below it.
+	if (body->kind == BodyFn && !body->escapes && !body->link) {
+		body->stacked = 1;
+		body->link = 1;
+		self->frames += 1;
+	}
+	self->links += body->kind != BodyLine && !body->link;
+}
+
+void Ir_analyze(Ir *self, IrBody *body)
+{
+	Ir_infer_body(self, body);
+	Ir_live_body(self, body);
+}
+
+/* printing */
+
+static void Ir_print_temp(const Ir *self, Temp temp, FILE *out)
+{
+	fprintf(out, " %c%d", self->temps[temp].kind == TempFloat ? 'f' : 't', temp);
+}
+
+static void Ir_print_dst(const Ir *self, const IrInstr *instr, FILE *out)
+{
+	if (instr->dst >= 0) {
+		Ir_print_temp(self, instr->dst, out);
+		fprintf(out, " =");
+	}
+	if (instr->tail) {
+		fprintf(out, " tail");
+	}
+}
+
+void Ir_print_instr(const Ir *self, const IrInstr *instr, FILE *out)
+{
+	static const char *names[] = {
+		[IrNum] = "num", [IrParam] = "param", [IrGlobal] = "global",
+		[IrClosure] = "closure", [IrThunk] = "thunk", [IrForce] = "force",
+		[IrAssert] = "assert", [IrConst] = "const", [IrUnbox] = "unbox",
+		[IrArith] = "arith", [IrNative] = "native", [IrBox] = "box",
+		[IrSpill] = "spill", [IrRestore] = "restore", [IrCall] = "call",
+		[IrIf] = "if", [IrAnd] = "and", [IrOr] = "or",
+		[IrSet] = "set", [IrReturn] = "return", [IrLoop] = "loop",
+	};
+	Ir_print_dst(self, instr, out);
+	if (instr->op == IrArith) {
+		Ir_print_temp(self, instr->a, out);
+		fprintf(out, " %c", instr->arith);
+		Ir_print_temp(self, instr->b, out);
+		return;
+	}
+	fprintf(out, " %s", names[instr->op]);
+	switch (instr->op) {
+		case IrNum:
+		case IrConst:
+			fprintf(out, " %g", instr->num);
+			return;
+		case IrParam:
+			fprintf(out, " %s^%d", Symbol_name(instr->name), instr->depth);
+			return;
+		case IrGlobal:
+		case IrSet:
+			fprintf(out, " %s", Symbol_name(instr->name));
+			break;
+		case IrClosure:
+		case IrThunk:
+			fprintf(out, instr->op == IrClosure ? " fn%d" : " thunk%d", instr->id);
+			fprintf(out, "%s", instr->closed ? " static" : instr->count ? " copies" : "");
+			for (int i = 0; i < instr->count; i++) {
+				Ir_print_temp(self, instr->args[i], out);
+			}
+			return;
+		case IrAssert:
+			Ir_print_temp(self, instr->a, out);
+			fprintf(out, " %s", instr->type == NumObject ? "num" : "fn");
+			return;
+		case IrNative:
+			fprintf(out, " nf%d", instr->id);
+			// fallthrough
+		case IrLoop:
+			for (int i = 0; i < instr->count; i++) {
+				Ir_print_temp(self, instr->args[i], out);
+			}
+			return;
+		case IrSpill:
+			fprintf(out, " %d", instr->count);
+			return;
+		case IrRestore:
+			Ir_print_temp(self, instr->a, out);
+			fprintf(out, " %d", instr->count);
+			return;
+		case IrCall:
+			if (instr->a < 0) {
+				fprintf(out, " fn%d", instr->id);
+			}
+			break;
+		default:
+			break;
+	}
+	if (instr->a >= 0) {
+		Ir_print_temp(self, instr->a, out);
+	}
+	if (instr->b >= 0) {
+		Ir_print_temp(self, instr->b, out);
+	}
+}
+
+static void Ir_print_notes(const Ir *self, const IrInstr *instr, FILE *out)
+{
+	fprintf(out, "\t;");
+	if (instr->dead) {
+		fprintf(out, " removed");
+	}
+	if (instr->evaluated) {
+		fprintf(out, " evaluated");
+	}
+	if (instr->bound) {
+		fprintf(out, " bound");
+	}
+	if (Ir_calls(instr)) {
+		fprintf(out, instr->env ? " saves env" : " env dead");
+		if (instr->floats) {
+			fprintf(out, ", spills %d", instr->floats);
+		}
+	}
+	if (instr->dst < 0) {
+		return;
+	}
+	const IrTemp *temp = &self->temps[instr->dst];
+	if (temp->kind == TempFloat) {
+		fprintf(out, " xmm%d", temp->reg);
+		return;
+	}
+	fprintf(out, "%s%s%s",
+		temp->known & KNOWN_NUM ? " num" : "",
+		temp->known & KNOWN_FN ? " fn" : "",
+		temp->known & KNOWN_FORCED ? " forced" : ""
+	);
+}
+
+static void Ir_print_block(const Ir *self, const IrBlock *block, int depth, FILE *out);
+
+static void Ir_print_body(const Ir *self, const IrBody *body, int depth, FILE *out)
+{
+	static const char *names[] = {[BodyLine] = "line", [BodyFn] = "fn", [BodyThunk] = "thunk"};
+	fprintf(out, "%*s%s", 2 * depth, "", names[body->kind]);
+	if (body->kind != BodyLine) {
+		fprintf(out, "%d%s", body->id, body->link ? "" : " (leaf)");
+	}
+	if (body->kind == BodyFn) {
+		fprintf(out, body->escapes ? " (frame escapes)" : body->stacked ? " (frame on the stack)" : " (frame kept across calls)");
+	}
+	fprintf(out, ":\n");
+	Ir_print_block(self, &body->code, depth + 1, out);
+}
+
+static void Ir_print_block(const Ir *self, const IrBlock *block, int depth, FILE *out)
+{
+	for (const IrInstr *instr = block->first; instr; instr = instr->next) {
+		fprintf(out, "%*s", 2 * depth - 1, "");
+		Ir_print_instr(self, instr, out);
+		Ir_print_notes(self, instr, out);
+		fprintf(out, "\n");
+		switch (instr->op) {
+			case IrClosure:
+			case IrThunk:
+				Ir_print_body(self, instr->body, depth + 1, out);
+				break;
+			case IrIf:
+				fprintf(out, "%*sthen:\n", 2 * depth, "");
+				Ir_print_block(self, &instr->then, depth + 1, out);
+				fprintf(out, "%*selse:\n", 2 * depth, "");
+				Ir_print_block(self, &instr->other, depth + 1, out);
+				break;
+			case IrAnd:
+			case IrOr:
+				Ir_print_block(self, &instr->then, depth + 1, out);
+				break;
+			default:
+				break;
+		}
+	}
+	if (block->result >= 0) {
+		fprintf(out, "%*s=", 2 * depth - 1, "");
+		Ir_print_temp(self, block->result, out);
+		fprintf(out, "\n");
+	}
+}
+
+void Ir_print(const Ir *self, const IrBody *body, FILE *out)
+{
+	Ir_print_body(self, body, 0, out);
+	fprintf(out, "; removed %d assertions, %d forces, %d unbound checks, %d env saves, %d link saves, %d heap frames\n",
+		self->asserts, self->forces, self->checks, self->envs, self->links, self->frames);
+}
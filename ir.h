@@ -0,0 +1,144 @@
+#ifndef IR_INCLUDED
+#define IR_INCLUDED
+
+#include <stdio.h>
+
+#include "arena.h"
+#include "symbol.h"
+#include "object.h"
+
+// The code generator translates each top-level line, function body and thunk
+// into A-normal form before any assembly is emitted: every intermediate
+// value is a temporary defined by one instruction, the code that runs
+// conditionally or later is kept in nested blocks and bodies. What is known
+// about the temporaries and what is live where is found by the analyses,
+// the instructions they prove redundant are left out when it is lowered.
+typedef int Temp; // -1 for none
+
+typedef enum {
+	TempBoxed, // an object, in REG_VAL or on the stack
+	TempFloat, // an unboxed number, in an xmm register
+} TempKind;
+
+// what is known about the value of a temporary
+#define KNOWN_FORCED 1 // not a thunk
+#define KNOWN_NUM    2
+#define KNOWN_FN     4 // a closure, compiled or interpreted
+
+typedef struct IrInstr IrInstr;
+typedef struct IrBody IrBody;
+
+typedef struct {
+	TempKind kind;
+	int      reg;   // of a float
+	int      known;
+	IrInstr  *def;
+	int      last;  // the seq of its last use, -1 when unused
+} IrTemp;
+
+typedef enum {
+	IrNum,     // t = the literal `num`
+	IrParam,   // t = the parameter `name`, `depth` frames up
+	IrGlobal,  // t = the global `name` (in `slot`), fails when unbound
+	IrClosure, // t = a closure of `body`, at fn<id>, of the parameter `name`, see `args`
+	IrThunk,   // t = a thunk of `body`, at thunk<id>, likewise
+	IrForce,   // a = the value of a
+	IrAssert,  // fails unless a is a `type`
+	IrConst,   // f = the literal `num`
+	IrUnbox,   // f = the number in a
+	IrArith,   // f = a `arith` b
+	IrNative,  // f = the kernel nf<id> applied to `args`
+	IrBox,     // t = a new number holding a
+	IrSpill,   // saves the xmm registers below `count`, the floats start over
+	IrRestore, // t = a moved to xmm<count>, restores the ones below
+	IrCall,    // t = a applied to b, the known fn<id> when a is -1
+	IrIf,      // t = if a then `then` else `other`
+	IrAnd,     // t = a when it is false, `then` otherwise
+	IrOr,      // t = a when it is true, `then` otherwise
+	IrSet,     // the global `name` (in `slot`) = a
+	IrReturn,  // returns a
+	IrLoop,    // starts the body over with `args` for its `count` parameters
+} IrOp;
+
+// NOTE: the last instruction of a block in a tail position returns or makes
+// a tail call, the value of the other blocks is their `result`
+typedef struct {
+	IrInstr *first;
+	IrInstr *last;
+	Temp    result;
+} IrBlock;
+
+typedef enum {
+	BodyLine, // a top-level line, the environment is empty there
+	BodyFn,   // entered with the argument in REG_VAL
+	BodyThunk,
+} BodyKind;
+
+struct IrBody {
+	BodyKind kind;
+	int      id;
+	IrBlock  code;
+	int      link;  // whether it calls anything, so it has to save REG_LINK
+	int      loops; // the parameters an IrLoop in it replaces, 0 without one
+	int      escapes; // a closure or a thunk it creates captures its frame
+	int      stacked; // its frame is on the stack
+};
+
+struct IrInstr {
+	IrOp       op;
+	Temp       dst;
+	Temp       a;
+	Temp       b;
+	double     num;
+	Symbol     name;
+	int        depth;
+	int        slot;
+	int        id;
+	int        arith;
+	ObjectType type;   // NumObject or FnObject, which stands for any closure
+	int        count;
+	// `count` of them, of an IrNative or an IrLoop, and the parameters an
+	// IrClosure or an IrThunk copies into frames of its own, the innermost
+	// first, it shares the environment without any
+	Temp       *args;
+	int        tail;
+	int        closed; // a closure that doesn't capture the environment
+	IrBlock    then;
+	IrBlock    other;
+	IrBody     *body;
+	// the results of the analyses
+	int        seq;
+	int        dead;      // proven redundant
+	int        evaluated; // a force of a variable forced before, never calls
+	int        bound;     // a global loaded before, can't be unbound
+	int        env;       // the environment is live after it
+	int        floats;    // the floats live across it
+	IrInstr    *next;
+};
+
+typedef struct {
+	Arena  arena;
+	IrTemp *temps;
+	int    count;
+	int    capacity;
+	// what the analyses left out, for -d
+	int    asserts;
+	int    forces;
+	int    checks;
+	int    envs;
+	int    links;
+	int    frames; // of the functions, the ones on the stack
+} Ir;
+
+Ir      Ir_make(void);
+void    Ir_reset(Ir *self);
+void    Ir_destroy(Ir self);
+IrBody  *Ir_body(Ir *self, BodyKind kind, int id);
+IrInstr *Ir_append(Ir *self, IrBlock *block, IrOp op);
+Temp    Ir_def(Ir *self, IrInstr *instr, TempKind kind);
+// NOTE: analyzes the nested bodies too, `body` is the outermost
+void    Ir_analyze(Ir *self, IrBody *body);
+void    Ir_print(const Ir *self, const IrBody *body, FILE *out);
+void    Ir_print_instr(const Ir *self, const IrInstr *instr, FILE *out);
+
+#endif // IR_INCLUDED
@@ -1,6 +1,7 @@
 #include "iter.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 
 Iter Iter_make(FILE *file)
@@ -14,29 +15,71 @@ Iter Iter_make(FILE *file)
 	return iter;
 }
 
+struct Retired {
+	char    *buff;
+	Retired *next;
+};
+
+static void Iter_free_retired(Iter *iter)
+{
+	while (iter->retired) {
+		Retired *next = iter->retired->next;
+		free(iter->retired->buff);
+		free(iter->retired);
+		iter->retired = next;
+	}
+}
+
 void Iter_destroy(Iter iter)
 {
+	Iter_free_retired(&iter);
 	free(iter.buff);
 	fclose(iter.file);
 }
 
 void Iter_reset(Iter *iter)
 {
+	Iter_free_retired(iter);
 	iter->end = iter->buff;
 	iter->cursor = iter->buff;
 }
 
+// NOTE: the old buffer is kept until the next reset, since the tokens
+// that were already taken from the current line point into it
+static void Iter_grow(Iter *iter)
+{
+	char *buff = malloc(iter->size * 2);
+	memcpy(buff, iter->buff, iter->end - iter->buff);
+	iter->cursor = buff + (iter->cursor - iter->buff);
+	iter->end = buff + (iter->end - iter->buff);
+	Retired *old = malloc(sizeof(*old));
+	old->buff = iter->buff;
+	old->next = iter->retired;
+	iter->retired = old;
+	iter->buff = buff;
+	iter->size *= 2;
+}
+
 char *Iter_cursor(const Iter *iter)
 {
 	return iter->cursor;
 }
 
+long Iter_offset(const Iter *iter)
+{
+	return iter->cursor - iter->buff;
+}
+
+char *Iter_at(const Iter *iter, long offset)
+{
+	return iter->buff + offset;
+}
+
 static void Iter_getc(Iter *iter, int count)
 {
 	while (!Iter_eof(iter) && count > 0) {
 		if (iter->end - iter->buff == iter->size - 1) {
-			iter->size *= 2;
-			iter->buff = realloc(iter->buff, iter->size);
+			Iter_grow(iter);
 		}
 		int c = fgetc(iter->file);
 		iter->end[0] = c == EOF ? '\0' : c;
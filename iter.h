@@ -5,18 +5,23 @@
 
 #define INITIAL_BUFFER_SIZE 1024
 
+typedef struct Retired Retired;
+
 typedef struct {
-	FILE *file;
-	char *buff;
-	char *cursor;
-	char *end;
-	int  size;
+	FILE    *file;
+	char    *buff;
+	char    *cursor;
+	char    *end;
+	int     size;
+	Retired *retired; // outgrown buffers, tokens may still point into them
 } Iter;
 
 Iter Iter_make(FILE *file);
 void Iter_destroy(Iter iter);
 void Iter_reset(Iter *iter);
 char *Iter_cursor(const Iter *iter);
+long Iter_offset(const Iter *iter);
+char *Iter_at(const Iter *iter, long offset);
 char Iter_peek(Iter *iter);
 char Iter_next(Iter *iter);
 int  Iter_eof(const Iter *iter);
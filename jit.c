@@ -0,0 +1,383 @@
+#include "jit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/mman.h>
+
+#include "opts.h"
+#include "gc.h"
+#include "env.h"
+#include "values.h"
+#include "error.h"
+#include "eval.h"
+#include "codegen.h"
+#include "asm.h"
+
+// NOTE: the code and the data are never given back, the closures may still
+// point into any of it. A line that doesn't fit in what is left fails, a
+// function that gets hot then stays interpreted.
+#define JIT_TEXT_SIZE    (64 << 20)
+#define JIT_DATA_SIZE    (32 << 20)
+#define JIT_MAPS_SIZE    (16 << 20)
+#define JIT_GLOBALS_SIZE (8 << 20)
+#define JIT_TIERS_SIZE   1024 // buckets
+
+// the calls of an interpreted function before it is compiled
+#define TIER_THRESHOLD 1000
+
+// the slots in front of the globals, the interpreter's objects of the context
+#define JIT_HOST_ROOTS 2
+
+// The functions of the top level are compiled once they get hot, the
+// counts and the code are kept per FnNode, under its body.
+typedef struct Tier Tier;
+
+struct Tier {
+	const Node *fn;
+	int        calls;
+	const void *text; // NULL until compiled
+	int        full;  // it didn't fit when it got hot
+	Tier       *next;
+};
+
+typedef int (*Entry)(Object **result, Object *fn, Object *arg);
+
+// All of the sections live in a single mapping, so that code reaches the
+// data with 32-bit rip-relative displacements, the C functions are called
+// through slots holding their addresses, the thread-locals are addressed
+// relative to %fs like the linker would do for the executable.
+struct Jit {
+	Context    *ctx;
+	char       *memory;
+	size_t     size;
+	Asm        *assembler;
+	Object     **roots;
+	FILE       *out;    // the assembly of the unit being compiled
+	char       *text;
+	size_t     text_size;
+	Tier       *tiers[JIT_TIERS_SIZE];
+	const void *bridge;
+	Entry      call;
+};
+
+static const struct {
+	const char *name;
+	void       *addr;
+} functions[] = {
+	{"GC_collect_comp",  (void *)GC_collect_comp},
+	{"GC_region_refill", (void *)GC_region_refill},
+	{"Jit_bridge",       (void *)Jit_bridge},
+	{"Object_println",   (void *)Object_println},
+	{"pow",              (void *)pow},
+	{"fmod",             (void *)fmod},
+};
+
+#define FUNCTIONS (sizeof(functions) / sizeof(*functions))
+
+static void jit_fail(const char *what, const char *where)
+{
+	errorf("jit error: %s: '%s'", what, where);
+	exit(1);
+}
+
+static char *Jit_lookup(const Jit *self, const char *name)
+{
+	const Label *label = Asm_lookup(self->assembler, name);
+	if (!label || label->section == SectionAbs) {
+		return label ? (char *)label->value : NULL;
+	}
+	return self->assembler->areas[label->section].base + label->value;
+}
+
+// the slots of the C functions are labelled by their names
+static void Jit_functions(Jit *self)
+{
+	for (size_t i = 0; i < FUNCTIONS; i++) {
+		size_t at = self->assembler->areas[SectionData].size;
+		memcpy(Asm_reserve(self->assembler, SectionData, sizeof(void *)), &functions[i].addr, sizeof(void *));
+		Asm_define(self->assembler, functions[i].name, SectionData, at);
+	}
+}
+
+static long tls_offset(const char *name)
+{
+	char *var = NULL;
+	if (!strcmp(name, "GC_region_limit")) {
+		var = (char *)&GC_region_limit;
+	} else if (!strcmp(name, "GC_collect_pending")) {
+		var = (char *)&GC_collect_pending;
+	} else {
+		jit_fail("unknown thread-local", name);
+	}
+	char *tp;
+	__asm__("mov %%fs:0, %0" : "=r"(tp));
+	return var - tp;
+}
+
+static void Jit_resolve(Jit *self)
+{
+	Asm *assembler = self->assembler;
+	for (int i = 0; i < assembler->fixups_count; i++) {
+		Fixup *fixup = &assembler->fixups[i];
+		char *at = assembler->areas[fixup->section].base + fixup->at;
+		if (fixup->kind == FixupTpoff32) {
+			int32_t offset = tls_offset(fixup->name) + fixup->addend;
+			memcpy(at, &offset, sizeof(offset));
+			continue;
+		}
+		char *target = Jit_lookup(self, fixup->name);
+		if (!target) {
+			jit_fail("undefined label", fixup->name);
+		}
+		target += fixup->addend;
+		if (fixup->kind == FixupAbs64) {
+			memcpy(at, &target, sizeof(target));
+		} else if (fixup->kind == FixupAbs32) {
+			int32_t value = (intptr_t)target;
+			if ((intptr_t)target != value) {
+				jit_fail("value out of range", fixup->name);
+			}
+			memcpy(at, &value, sizeof(value));
+		} else {
+			char *end = assembler->areas[fixup->section].base + fixup->end;
+			int32_t rel = target - end;
+			if (target - end != rel) {
+				jit_fail("displacement out of range", fixup->name);
+			}
+			memcpy(at, &rel, sizeof(rel));
+		}
+	}
+	Asm_clear_fixups(assembler);
+}
+
+static void Jit_protect(Jit *self, int prot)
+{
+	Area *text = &self->assembler->areas[SectionText];
+	if (mprotect(text->base, text->capacity, prot)) {
+		error("jit error: mprotect failed");
+		exit(1);
+	}
+}
+
+// encodes everything emitted since the last call, the stream starts over
+// after it, returns 0 when it doesn't fit, none of it is kept then
+static int Jit_assemble(Jit *self)
+{
+	fflush(self->out);
+	// NOTE: after a rewind the end of what was written isn't terminated
+	self->text[self->text_size] = '\0';
+	if (debug && jit) {
+		fputs(self->text, stderr);
+	}
+	Asm *assembler = self->assembler;
+	size_t sizes[SECTIONS];
+	for (int i = 0; i < SECTIONS; i++) {
+		sizes[i] = assembler->areas[i].size;
+	}
+	Jit_protect(self, PROT_READ | PROT_WRITE);
+	Asm_assemble(assembler, self->text);
+	rewind(self->out);
+	int fits = !assembler->full;
+	if (fits) {
+		Jit_resolve(self);
+	} else {
+		for (int i = 0; i < SECTIONS; i++) {
+			assembler->areas[i].size = sizes[i];
+		}
+		Asm_clear_fixups(assembler);
+		assembler->full = 0;
+	}
+	Jit_protect(self, PROT_READ | PROT_EXEC);
+	size_t globals = compile_jit_globals();
+	if ((JIT_HOST_ROOTS + globals) * sizeof(Object *) > JIT_GLOBALS_SIZE) {
+		error("jit error: too many globals");
+		exit(1);
+	}
+	GC *gc = self->ctx->gc;
+	GC_set_roots(gc, self->roots, JIT_HOST_ROOTS + globals);
+	Area *maps = &assembler->areas[SectionMaps];
+	GC_set_stack_maps(gc, (StackMap *)maps->base, maps->size / sizeof(StackMap));
+	return fits;
+}
+
+Jit *Jit_new(Context *ctx)
+{
+	Jit *self = calloc(1, sizeof(*self));
+	self->ctx = ctx;
+	size_t sizes[SECTIONS] = {JIT_TEXT_SIZE, JIT_DATA_SIZE, JIT_MAPS_SIZE};
+	self->size = JIT_TEXT_SIZE + JIT_DATA_SIZE + JIT_MAPS_SIZE + JIT_GLOBALS_SIZE;
+	self->memory = mmap(NULL, self->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (self->memory == MAP_FAILED) {
+		error("jit error: mmap failed");
+		exit(1);
+	}
+	self->assembler = Asm_new(self->memory, sizes);
+	self->roots = (Object **)(self->memory + JIT_TEXT_SIZE + JIT_DATA_SIZE + JIT_MAPS_SIZE);
+	self->roots[0] = ctx->root;
+	self->roots[1] = ctx->stack;
+	Asm_define(self->assembler, "globals", SectionAbs, (size_t)(self->roots + JIT_HOST_ROOTS));
+	Jit_functions(self);
+	self->out = open_memstream(&self->text, &self->text_size);
+	compile_jit_begin(self->out);
+	if (!Jit_assemble(self)) {
+		error("jit error: out of code space");
+		exit(1);
+	}
+	memcpy(Jit_lookup(self, "gc"), &ctx->gc, sizeof(ctx->gc));
+	memcpy(Jit_lookup(self, "jit"), &self, sizeof(self));
+	self->bridge = Jit_lookup(self, "bridge");
+	self->call = (Entry)Jit_lookup(self, "jit_call");
+	return self;
+}
+
+void Jit_drop(Jit *self)
+{
+	GC_set_roots(self->ctx->gc, NULL, 0);
+	GC_set_stack_maps(self->ctx->gc, NULL, 0);
+	for (int i = 0; i < JIT_TIERS_SIZE; i++) {
+		Tier *tier = self->tiers[i];
+		while (tier) {
+			Tier *next = tier->next;
+			free(tier);
+			tier = next;
+		}
+	}
+	Asm_drop(self->assembler);
+	fclose(self->out);
+	free(self->text);
+	munmap(self->memory, self->size);
+	free(self);
+}
+
+// NOTE: says why the compiled code failed like the interpreter would,
+// unless the interpreter it called did already
+static void Jit_report(int failure)
+{
+	if (failure == FailType) {
+		error("evaluation error: type mismatch");
+	} else if (failure >= FailUnbound) {
+		for (Symbol sym = 0; sym < Symbol_count(); sym++) {
+			if (compile_jit_slot(sym) == failure - FailUnbound) {
+				errorf("evaluation error: unbound variable: %s", Symbol_name(sym));
+			}
+		}
+	}
+}
+
+Object *Jit_run(Jit *self, const Node *expr)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "line%d", compile_jit_line(expr));
+	if (!Jit_assemble(self)) {
+		error("jit error: out of code space");
+		return NULL;
+	}
+	int (*line)(Object **) = (int (*)(Object **))Jit_lookup(self, name);
+	Object *result = NULL;
+	int failure = line(&result);
+	if (failure) {
+		Jit_report(failure);
+		return NULL;
+	}
+	return result;
+}
+
+static Tier *Jit_tier(Jit *self, const Node *body)
+{
+	Tier *tier = self->tiers[(uintptr_t)body / sizeof(Node) % JIT_TIERS_SIZE];
+	while (tier && FnNode_body(tier->fn) != body) {
+		tier = tier->next;
+	}
+	return tier;
+}
+
+const void *Jit_text(Jit *self, const Node *fn, Object *env)
+{
+	if (env != self->ctx->root) {
+		return self->bridge;
+	}
+	Tier *tier = Jit_tier(self, FnNode_body(fn));
+	if (!tier) {
+		Tier **bucket = &self->tiers[(uintptr_t)FnNode_body(fn) / sizeof(Node) % JIT_TIERS_SIZE];
+		tier = calloc(1, sizeof(*tier));
+		tier->fn = fn;
+		tier->next = *bucket;
+		*bucket = tier;
+	}
+	return tier->text ? tier->text : self->bridge;
+}
+
+// NOTE: the globals the function is the first to refer to get their slots
+// now, with what the interpreter has bound, even when it doesn't fit
+static const void *Jit_compile(Jit *self, const Node *fn)
+{
+	int before = compile_jit_globals();
+	char name[32];
+	snprintf(name, sizeof(name), "fn%d", compile_jit_fn(fn));
+	int fits = Jit_assemble(self);
+	Object **globals = self->roots + JIT_HOST_ROOTS;
+	for (Symbol sym = 0; sym < Symbol_count(); sym++) {
+		if (compile_jit_slot(sym) >= before) {
+			globals[compile_jit_slot(sym)] = Env_get(EnvObj_env(self->ctx->root), Symbol_name(sym));
+		}
+	}
+	return fits ? Jit_lookup(self, name) : NULL;
+}
+
+int Jit_hot(Jit *self, Object *fn)
+{
+	if (fn->type == CompfnObject || FnObj_text(fn) != self->bridge) {
+		return 1;
+	}
+	Tier *tier = FnObj_env(fn) == self->ctx->root ? Jit_tier(self, FnObj_body(fn)) : NULL;
+	if (!tier || tier->full) {
+		return 0;
+	}
+	if (!tier->text) {
+		tier->calls += 1;
+		if (tier->calls < TIER_THRESHOLD) {
+			return 0;
+		}
+		tier->text = Jit_compile(self, tier->fn);
+		tier->full = !tier->text;
+		if (debug) {
+			fprintf(stderr, "jit: %s <fn %s> after %d calls\n", tier->full ? "out of code space for" : "compiled", FnObj_arg(fn), tier->calls);
+		}
+		if (tier->full) {
+			return 0;
+		}
+	}
+	FnObj_text(fn) = tier->text;
+	return 1;
+}
+
+Object *Jit_apply(Jit *self, Object *fn, Object *arg)
+{
+	Object *result = NULL;
+	int failure = self->call(&result, fn, arg);
+	if (failure) {
+		Jit_report(failure);
+		return NULL;
+	}
+	return result;
+}
+
+void Jit_set_global(Jit *self, Symbol name, Object *value)
+{
+	int slot = compile_jit_slot(name);
+	if (slot >= 0) {
+		self->roots[JIT_HOST_ROOTS + slot] = value;
+	}
+}
+
+Object *Jit_bridge(Jit *self, Object *fn, Object *arg, void *rsp, const void *link)
+{
+	Suspended section;
+	GC_suspend(self->ctx->gc, &section, rsp, link);
+	Object *result = eval_apply(fn, arg, self->ctx);
+	GC_resume(self->ctx->gc, &section);
+	return result;
+}
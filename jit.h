@@ -0,0 +1,30 @@
+#ifndef JIT_INCLUDED
+#define JIT_INCLUDED
+
+#include "node.h"
+#include "object.h"
+#include "context.h"
+
+// Compiles each top-level expression with the code generator and runs it
+// right away. The assembly is encoded into executable memory in-process,
+// the code allocates from the GC of the context it was made with.
+typedef struct Jit Jit;
+
+Jit    *Jit_new(Context *ctx);
+void   Jit_drop(Jit *self);
+// NULL for a definition or on failure, like eval
+Object *Jit_run(Jit *self, const Node *expr);
+
+// Otherwise the interpreter runs the program and only the functions of the
+// top level that get called often are compiled. An interpreted closure is
+// called by compiled code through its text, a bridge back into eval until
+// its FnNode gets compiled (see values.h). The globals of compiled code
+// mirror the top-level environment.
+const void *Jit_text(Jit *self, const Node *fn, Object *env); // of a new closure
+int        Jit_hot(Jit *self, Object *fn); // counts a call, whether to run it compiled
+Object     *Jit_apply(Jit *self, Object *fn, Object *arg);
+void       Jit_set_global(Jit *self, Symbol name, Object *value);
+// NOTE: called by compiled code, `rsp` and `link` are where its stack is left
+Object     *Jit_bridge(Jit *self, Object *fn, Object *arg, void *rsp, const void *link);
+
+#endif // JIT_INCLUDED
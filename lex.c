@@ -15,10 +15,13 @@
 // id <- alpha+
 static Token take_keyword_or_id(Iter *iterator)
 {
-	const char *start = Iter_cursor(iterator);
+	// NOTE: the buffer may be moved while the token is read, so its start
+	// is only turned into a pointer once the whole token is in
+	long offset = Iter_offset(iterator);
 	while (isalnum(Iter_peek(iterator))) {
 		Iter_next(iterator);
 	}
+	const char *start = Iter_at(iterator, offset);
 	long unsigned length = Iter_cursor(iterator) - start;
 	if (kweq(start, "if", length)) {
 		return (Token){IfToken, start, length};
@@ -47,7 +50,7 @@ static Token take_keyword_or_id(Iter *iterator)
 // number <- digit+ ('.' digit*)?
 static Token take_number(Iter *iterator)
 {
-	const char *start = Iter_cursor(iterator);
+	long offset = Iter_offset(iterator);
 	while (isdigit(Iter_peek(iterator))) {
 		Iter_next(iterator);
 	}
@@ -57,6 +60,7 @@ static Token take_number(Iter *iterator)
 	while (isdigit(Iter_peek(iterator))) {
 		Iter_next(iterator);
 	}
+	const char *start = Iter_at(iterator, offset);
 	return (Token){NumberToken, start, Iter_cursor(iterator) - start};
 }
 
@@ -1,131 +1,230 @@
 #include "node.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "arena.h"
+#include "symbol.h"
 
 
-static Node *Node_alloc(Arena *a, NodeType type)
+#define INITIAL_AST_CAPACITY 64
+#define INITIAL_CONST_CAPACITY 256
+
+static struct {
+	NumberValue *values;
+	int         count;
+	int         capacity;
+} consts = {0};
+
+static int Const_add(NumberValue value)
+{
+	if (consts.count == consts.capacity) {
+		consts.capacity = consts.capacity ? consts.capacity * 2 : INITIAL_CONST_CAPACITY;
+		consts.values = realloc(consts.values, consts.capacity * sizeof(*consts.values));
+	}
+	consts.values[consts.count] = value;
+	consts.count += 1;
+	return consts.count - 1;
+}
+
+NumberValue Const_value(int index)
+{
+	return consts.values[index];
+}
+
+Ast Ast_make(void)
+{
+	Ast self = {0};
+	self.nodes = malloc(INITIAL_AST_CAPACITY * sizeof(*self.nodes));
+	self.capacity = INITIAL_AST_CAPACITY;
+	return self;
+}
+
+void Ast_destroy(Ast self)
+{
+	free(self.nodes);
+}
+
+void Ast_reset(Ast *self)
+{
+	self->count = 0;
+}
+
+// NOTE: the nodes are copied as is, which works since the offsets are relative
+Node *Ast_finish(Ast *self, NodeId root, Arena *a)
+{
+	Node *nodes = Arena_alloc(a, (root + 1) * sizeof(*nodes));
+	memcpy(nodes, self->nodes, (root + 1) * sizeof(*nodes));
+	return &nodes[root];
+}
+
+static NodeId Node_alloc(Ast *ast, NodeType type)
+{
+	if (ast->count == ast->capacity) {
+		ast->capacity *= 2;
+		ast->nodes = realloc(ast->nodes, ast->capacity * sizeof(*ast->nodes));
+	}
+	NodeId id = ast->count;
+	ast->count += 1;
+	ast->nodes[id].type = type;
+	ast->nodes[id].proven = 0;
+	return id;
+}
+
+// children are always allocated before their parent, so the offsets are negative
+#define Node_set_child(ast, id, i, child) \
+	((ast)->nodes[id].as[i] = (child) - (id))
+
+// NOTE: moves the subtree from `first` to `last` down to `to` and drops
+// what follows, which works for the same reason
+NodeId Ast_keep(Ast *self, NodeId first, NodeId last, NodeId to)
+{
+	memmove(&self->nodes[to], &self->nodes[first], (last - first + 1) * sizeof(*self->nodes));
+	self->count = to + last - first + 1;
+	return to + last - first;
+}
+
+NodeId NumberNode_new(Ast *ast, double number)
+{
+	NodeId id = Node_alloc(ast, NumberNode);
+	ast->nodes[id].as[0] = Const_add(number);
+	return id;
+}
+
+NodeId IdNode_new(Ast *ast, const char *string, int length)
 {
-	Node *node = Arena_alloc(a, sizeof(*node));
-	node->type = type;
-	return node;
+	NodeId id = Node_alloc(ast, IdNode);
+	ast->nodes[id].as[0] = Symbol_intern(string, length);
+	return id;
 }
 
-Node *NumberNode_new(Arena *a, double number)
+// a number or an identifier, which refers to the same entry of its table
+NodeId LeafNode_copy(Ast *ast, const Node *leaf)
 {
-	Node *node = Node_alloc(a, NumberNode);
-	node->as.number = number;
-	return node;
+	NodeId id = Node_alloc(ast, leaf->type);
+	ast->nodes[id].as[0] = leaf->as[0];
+	return id;
 }
 
-Node *IdNode_new(Arena *a, const char *string, int length)
+static NodeId PairNode_new(Ast *ast, NodeType type, NodeId left, NodeId right, int op)
 {
-	Node *node = Node_alloc(a, IdNode);
-	char *id = Arena_alloc(a, length+1);
-	strncpy(id, string, length);
-	id[length] = '\0';
-	node->as.id = id;
-	return node;
+	NodeId id = Node_alloc(ast, type);
+	Node_set_child(ast, id, 0, left);
+	Node_set_child(ast, id, 1, right);
+	ast->nodes[id].as[2] = op;
+	return id;
 }
 
-static Node *PairNode_new(Arena *a, NodeType type, Node *left, Node *right, int op)
+NodeId ApplicationNode_new(Ast *ast, NodeId left, NodeId right)
 {
-	Node *node = Node_alloc(a, type);
-	node->as.pair.left = left;
-	node->as.pair.right = right;
-	node->as.pair.op = op;
-	return node;
+	return PairNode_new(ast, ApplNode, left, right, -1);
 }
 
-Node *ApplicationNode_new(Arena *a, Node *left, Node *right)
+NodeId OpNode_new(Ast *ast, NodeId left, NodeId right, NodeType type, int op)
 {
-	return PairNode_new(a, ApplNode, left, right, ' ');
+	return PairNode_new(ast, type, left, right, op);
 }
 
-Node *OpNode_new(Arena *a, Node *left, Node *right, NodeType type, int op)
+NodeId IfNode_new(Ast *ast, NodeId cond, NodeId true, NodeId false)
 {
-	return PairNode_new(a, type, left, right, op);
+	NodeId id = Node_alloc(ast, IfNode);
+	Node_set_child(ast, id, 0, cond);
+	Node_set_child(ast, id, 1, true);
+	Node_set_child(ast, id, 2, false);
+	return id;
 }
 
-Node *IfNode_new(Arena *a, Node *cond, Node *true, Node *false)
+NodeId FnNode_new(Ast *ast, NodeId param, NodeId body)
 {
-	Node *node = Node_alloc(a, IfNode);
-	node->as.ifelse.cond = cond;
-	node->as.ifelse.true = true;
-	node->as.ifelse.false = false;
-	return node;
+	NodeId id = Node_alloc(ast, FnNode);
+	Node_set_child(ast, id, 0, param);
+	Node_set_child(ast, id, 1, body);
+	ast->nodes[id].as[2] = -1;
+	return id;
 }
 
-Node *FnNode_new(Arena *a, Node *param, Node *body)
+NodeId LetNode_new(Ast *ast, NodeId name, NodeId value)
 {
-	Node *node = Node_alloc(a, FnNode);
-	node->as.fn.param = param;
-	node->as.fn.body = body;
-	return node;
+	NodeId id = Node_alloc(ast, LetNode);
+	Node_set_child(ast, id, 0, name);
+	Node_set_child(ast, id, 1, value);
+	return id;
 }
 
-Node *LetNode_new(Arena *a, Node *name, Node *value)
+int Node_size(const Node *expr)
 {
-	Node *node = Node_alloc(a, LetNode);
-	node->as.let.name = name;
-	node->as.let.value = value;
-	return node;
+	switch (expr->type) {
+		case NumberNode:
+		case IdNode:
+			return 1;
+		case IfNode:
+			return 1 + Node_size(IfNode_cond(expr)) + Node_size(IfNode_true(expr)) + Node_size(IfNode_false(expr));
+		case FnNode:
+			return 1 + Node_size(FnNode_body(expr));
+		case LetNode:
+			return 1 + Node_size(LetNode_value(expr));
+		default:
+			return 1 + Node_size(PairNode_left(expr)) + Node_size(PairNode_right(expr));
+	}
 }
 
-static void Node_print_parenthesised(const Node *expr)
+static void Node_print_parenthesised(const Node *expr, FILE *out)
 {
-	putchar('(');
-	Node_print(expr);
-	putchar(')');
+	fputc('(', out);
+	Node_print(expr, out);
+	fputc(')', out);
 }
 
-void Node_print(const Node *expr)
+void Node_print(const Node *expr, FILE *out)
 {
 	switch (expr->type) {
 		case NumberNode:
-			printf("%lf", NumNode_value(expr));
+			fprintf(out, "%lf", NumNode_value(expr));
 			break;
 		case IdNode:
-			printf("%s", IdNode_value(expr));
+			fprintf(out, "%s", IdNode_value(expr));
 			break;
 		case ApplNode:
 		case ExptNode:
 		case ProdNode:
 		case SumNode:
 		case CmpNode:
+			Node_print_parenthesised(PairNode_left(expr), out);
+			fputc(expr->type == ApplNode ? ' ' : PairNode_op(expr), out);
+			Node_print_parenthesised(PairNode_right(expr), out);
+			break;
 		case AndNode:
 		case OrNode:
-			Node_print_parenthesised(PairNode_left(expr));
-			putchar(PairNode_op(expr));
-			Node_print_parenthesised(PairNode_right(expr));
+			Node_print_parenthesised(PairNode_left(expr), out);
+			fputs(expr->type == AndNode ? " and " : " or ", out);
+			Node_print_parenthesised(PairNode_right(expr), out);
 			break;
 		case IfNode:
-			printf("if ");
-			Node_print_parenthesised(IfNode_cond(expr));
-			printf(" then ");
-			Node_print_parenthesised(IfNode_true(expr));
-			printf(" else ");
-			Node_print_parenthesised(IfNode_false(expr));
+			fputs("if ", out);
+			Node_print_parenthesised(IfNode_cond(expr), out);
+			fputs(" then ", out);
+			Node_print_parenthesised(IfNode_true(expr), out);
+			fputs(" else ", out);
+			Node_print_parenthesised(IfNode_false(expr), out);
 			break;
 		case FnNode:
-			printf("fn ");
-			Node_print(FnNode_param(expr));
-			printf(": ");
-			Node_print(FnNode_body(expr));
+			fputs("fn ", out);
+			Node_print(FnNode_param(expr), out);
+			fputs(": ", out);
+			Node_print(FnNode_body(expr), out);
 			break;
 		case LetNode:
-			printf("let ");
-			Node_print(LetNode_name(expr));
-			printf("= ");
-			Node_print(LetNode_value(expr));
+			fputs("let ", out);
+			Node_print(LetNode_name(expr), out);
+			fputs("= ", out);
+			Node_print(LetNode_value(expr), out);
 			break;
 	}
 }
 
-void Node_println(const Node *node)
+void Node_println(const Node *node, FILE *out)
 {
-	Node_print(node);
-	putchar('\n');
+	Node_print(node, out);
+	fputc('\n', out);
 }
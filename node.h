@@ -1,8 +1,15 @@
 #ifndef NODE_INCLUDED
 #define NODE_INCLUDED
 
+#include <stdio.h>
+
 #include "arena.h"
+#include "symbol.h"
 
+// The tree is stored flat: all nodes of an expression live in one contiguous
+// block (children before their parents) and refer to each other with 32-bit
+// offsets relative to themselves, so a `const Node *` can be passed around
+// just like before. Numbers and identifiers are kept in separate tables.
 typedef struct Node Node;
 
 typedef enum {
@@ -20,74 +27,77 @@ typedef enum {
 	LetNode,
 } NodeType;
 
-typedef double NumberValue;
+struct Node {
+	NodeType type : 8;
+	unsigned proven : 8; // what the inference proved of its value, 0 without -t
+	int      as[3];      // child offsets or table indices, see the accessors below
+};
 
-#define NumNode_value(nodeptr) ((nodeptr)->as.number)
+#define PROVEN_NUM 1
+#define PROVEN_FN  2 // a closure, compiled or interpreted
 
-typedef char *IdValue;
+#define Node_child(nodeptr, i) ((nodeptr) + (nodeptr)->as[i])
 
-#define IdNode_value(nodeptr) ((nodeptr)->as.id)
+typedef double NumberValue;
 
-typedef struct {
-	Node *left;
-	Node *right;
-	int  op; // used by SumNode, ProdNode and CmpNode to store the operation
-} PairValue;
+#define NumNode_value(nodeptr) (Const_value((nodeptr)->as[0]))
 
-#define PairNode_left(nodeptr) ((nodeptr)->as.pair.left)
-#define PairNode_right(nodeptr) ((nodeptr)->as.pair.right)
-#define PairNode_op(nodeptr) ((nodeptr)->as.pair.op)
+#define IdNode_symbol(nodeptr) ((Symbol)(nodeptr)->as[0])
+#define IdNode_value(nodeptr) (Symbol_name(IdNode_symbol(nodeptr)))
 
-typedef struct {
-	Node *cond;
-	Node *true;
-	Node *false;
-} IfValue;
+// NOTE: the third slot of SumNode, ProdNode and CmpNode stores the operation
+#define PairNode_left(nodeptr) Node_child(nodeptr, 0)
+#define PairNode_right(nodeptr) Node_child(nodeptr, 1)
+#define PairNode_op(nodeptr) ((nodeptr)->as[2])
+// NOTE: likewise, what the thunk of the argument keeps in the lazy mode
+#define ApplNode_captured(nodeptr) ((nodeptr)->as[2])
 
-#define IfNode_cond(nodeptr) ((nodeptr)->as.ifelse.cond)
-#define IfNode_true(nodeptr) ((nodeptr)->as.ifelse.true)
-#define IfNode_false(nodeptr) ((nodeptr)->as.ifelse.false)
+#define IfNode_cond(nodeptr) Node_child(nodeptr, 0)
+#define IfNode_true(nodeptr) Node_child(nodeptr, 1)
+#define IfNode_false(nodeptr) Node_child(nodeptr, 2)
 
-typedef struct {
-	Node *param;
-	Node *body;
-} FnValue;
+#define FnNode_param(nodeptr) Node_child(nodeptr, 0)
+#define FnNode_param_value(nodeptr) IdNode_value(FnNode_param(nodeptr))
+#define FnNode_body(nodeptr) Node_child(nodeptr, 1)
+// NOTE: what the closure keeps of the environment it is created in, and
+// whether the ones of its applications can outlive them, as an entry of the
+// table of eval_analyze, -1 until it has run
+#define FnNode_captured(nodeptr) ((nodeptr)->as[2])
 
-#define FnNode_param(nodeptr) ((nodeptr)->as.fn.param)
-#define FnNode_param_value(nodeptr) IdNode_value(((nodeptr)->as.fn.param))
-#define FnNode_body(nodeptr) ((nodeptr)->as.fn.body)
+#define LetNode_name(nodeptr) Node_child(nodeptr, 0)
+#define LetNode_name_value(nodeptr) IdNode_value(LetNode_name(nodeptr))
+#define LetNode_value(nodeptr) Node_child(nodeptr, 1)
 
-typedef struct {
-	Node *name;
-	Node *value;
-} LetValue;
-
-#define LetNode_name(nodeptr) ((nodeptr)->as.let.name)
-#define LetNode_name_value(nodeptr) IdNode_value(((nodeptr)->as.let.name))
-#define LetNode_value(nodeptr) ((nodeptr)->as.let.value)
-
-typedef union {
-	NumberValue number; // NumberNode
-	IdValue     id;     // IdNode
-	IfValue     ifelse; // IfNode
-	FnValue     fn;     // FnNode
-	LetValue    let;    // LetNode
-	PairValue   pair;   // others
-} NodeValue;
+NumberValue Const_value(int index);
 
-struct Node {
-	NodeType  type;
-	NodeValue as;
-};
+// Nodes are built into an Ast and referred to by their index until the tree
+// is finished and moved into an arena.
+typedef int NodeId;
 
-Node *NumberNode_new(Arena *a, double number);
-Node *IdNode_new(Arena *a, const char *string, int length);
-Node *ApplicationNode_new(Arena *a, Node *left, Node *right);
-Node *OpNode_new(Arena *a, Node *left, Node *right, NodeType type, int op);
-Node *IfNode_new(Arena *a, Node *cond, Node *true, Node *false);
-Node *FnNode_new(Arena *a, Node *param, Node *body);
-Node *LetNode_new(Arena *a, Node *name, Node *value);
-void Node_print(const Node *expr);
-void Node_println(const Node *node);
+typedef struct {
+	Node *nodes;
+	int  count;
+	int  capacity;
+} Ast;
+
+Ast    Ast_make(void);
+void   Ast_destroy(Ast self);
+void   Ast_reset(Ast *self);
+Node   *Ast_finish(Ast *self, NodeId root, Arena *a);
+NodeId Ast_keep(Ast *self, NodeId first, NodeId last, NodeId to);
+
+#define Ast_node(ast, id) (&(ast)->nodes[id])
+
+NodeId NumberNode_new(Ast *ast, double number);
+NodeId IdNode_new(Ast *ast, const char *string, int length);
+NodeId LeafNode_copy(Ast *ast, const Node *leaf);
+NodeId ApplicationNode_new(Ast *ast, NodeId left, NodeId right);
+NodeId OpNode_new(Ast *ast, NodeId left, NodeId right, NodeType type, int op);
+NodeId IfNode_new(Ast *ast, NodeId cond, NodeId true, NodeId false);
+NodeId FnNode_new(Ast *ast, NodeId param, NodeId body);
+NodeId LetNode_new(Ast *ast, NodeId name, NodeId value);
+int  Node_size(const Node *expr);
+void Node_print(const Node *expr, FILE *out);
+void Node_println(const Node *node, FILE *out);
 
 #endif // NODE_INCLUDED
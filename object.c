@@ -15,7 +15,11 @@ void Object_print(const Object *obj)
 			printf("<fn %s>", FnObj_arg(obj));
 			return;
 		case CompfnObject:
-			printf("<compfn %p>", CompFnObj_text(obj));
+			if (CompFnObj_arg(obj)) {
+				printf("<fn %s>", CompFnObj_arg(obj));
+			} else {
+				printf("<compfn %p>", CompFnObj_text(obj));
+			}
 			return;
 		case EnvObject:
 			printf("<env-%p>", obj);
@@ -29,6 +33,9 @@ void Object_print(const Object *obj)
 		case StackObject:
 			printf("<stack-%p>", obj);
 			return;
+		case FrameObject:
+			printf("<frame-%p>", obj);
+			return;
 	}
 }
 
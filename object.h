@@ -11,6 +11,7 @@ typedef enum {
 	ThunkObject,
 	CompthunkObject,
 	StackObject,
+	FrameObject,
 } ObjectType;
 
 typedef struct Object Object;
@@ -19,6 +20,7 @@ struct Object {
 	ObjectType  type;
 	Object      *next;
 	int         mark;
+	int         region; // allocated from a region of the GC, not in the list
 };
 
 #define ValToObj(val) (&(val)->handle)
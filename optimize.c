@@ -0,0 +1,1063 @@
+#include "optimize.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "node.h"
+#include "arena.h"
+#include "symbol.h"
+#include "opts.h"
+
+
+// The tree is rebuilt bottom-up, so what is done to a node sees its
+// children already optimized. Nothing that could fail or run forever is
+// dropped, but for the branches the evaluation wouldn't take anyway.
+static struct {
+	int folded;
+	int simplified;
+	int inlined;
+	int shared;
+	int eliminated;
+} stats = {0};
+
+// The small functions bound only once in the whole input, that don't call
+// themselves, are inlined into the lines after their definition: their
+// parameters are replaced by the arguments where that computes nothing
+// more, less or later than the call would. Nothing is inlined when the
+// input isn't known upfront, as in the repl, any global could be bound
+// again there.
+#define INLINE_SIZE  16
+#define INLINE_ARITY 4
+
+// NOTE: what is inlined can make calls that can be inlined in turn, the tree
+// is optimized again as long as it does, up to this many times
+#define MAX_PASSES 4
+#define PASS_ARENA_PAGE_SIZE 4096
+
+typedef struct {
+	int        count;   // of the lets that bind it
+	int        defined; // a function bound once, whose definition is optimized
+	const Node *fn;     // likewise, NULL when it calls itself
+} Definition;
+
+static struct {
+	Definition *entries; // indexed by symbol
+	int        size;
+} definitions = {0};
+
+typedef struct Bound Bound;
+
+// NOTE: a name bound where the tree is built, a lambda parameter, or one of
+// an inlined function that stands for `arg`, which is in `scope`
+struct Bound {
+	Symbol      name;
+	const Node  *arg;
+	const Bound *scope;
+	const Bound *prev;
+};
+
+static NodeId optimize_expr(const Node *expr, Ast *ast, const Bound *scope);
+
+static const Bound *optimize_lookup(const Bound *scope, Symbol name)
+{
+	for (; scope; scope = scope->prev) {
+		if (scope->name == name) {
+			return scope;
+		}
+	}
+	return NULL;
+}
+
+// NOTE: what eval_pair computes, the results that aren't finite are left to
+// run time, the backends can't write them as literals
+static int optimize_fold(int op, double left, double right, double *value)
+{
+	switch (op) {
+		case '^': *value = pow(left, right);  break;
+		case '*': *value = left * right;      break;
+		case '/': *value = left / right;      break;
+		case '%': *value = fmod(left, right); break;
+		case '+': *value = left + right;      break;
+		case '-': *value = left - right;      break;
+		case '>': *value = left > right;      break;
+		case '<': *value = left < right;      break;
+		case '=': *value = left == right;     break;
+		default: return 0;
+	}
+	return isfinite(*value);
+}
+
+// NOTE: a condition is false when it compares equal to 0, as the interpreter
+// and compiled code test it at run time: -0 is false and NAN is true
+static int optimize_true(double num)
+{
+	return num != 0;
+}
+
+// the zeros of either sign are told apart
+static int optimize_is(const Node *node, double num)
+{
+	return node->type == NumberNode && NumNode_value(node) == num && !signbit(NumNode_value(node)) == !signbit(num);
+}
+
+// NOTE: whether it evaluates to a number when it evaluates at all, so that
+// dropping the operation it is an operand of can't hide a type mismatch,
+// with -t it is known of every operand
+static int optimize_numeric(const Node *node)
+{
+	switch (node->type) {
+		case NumberNode:
+		case ExptNode:
+		case ProdNode:
+		case SumNode:
+		case CmpNode:
+		case AndNode:
+		case OrNode:
+			return 1;
+		case IfNode:
+			return optimize_numeric(IfNode_true(node)) && optimize_numeric(IfNode_false(node));
+		default:
+			return typed;
+	}
+}
+
+// NOTE: x * 1, 1 * x, x / 1, x ^ 1, x - 0, x + -0, -0 + x and --x are x for
+// any number, NaN and the zeros included, returns -1 for none of those
+static NodeId optimize_identity(Ast *ast, int op, NodeId start, NodeId left, NodeId right)
+{
+	const Node *l = Ast_node(ast, left), *r = Ast_node(ast, right);
+	if (((op == '*' || op == '/' || op == '^') && optimize_is(r, 1)) || (op == '-' && optimize_is(r, 0)) || (op == '+' && optimize_is(r, -0.0))) {
+		if (optimize_numeric(l)) {
+			return Ast_keep(ast, start, left, start);
+		}
+	}
+	if ((op == '*' && optimize_is(l, 1)) || (op == '+' && optimize_is(l, -0.0))) {
+		if (optimize_numeric(r)) {
+			return Ast_keep(ast, left + 1, right, start);
+		}
+	}
+	if (op == '*' && optimize_is(r, -1) && l->type == ProdNode && PairNode_op(l) == '*' && optimize_is(PairNode_right(l), -1)) {
+		if (optimize_numeric(PairNode_left(l))) {
+			return Ast_keep(ast, start, left + l->as[0], start);
+		}
+	}
+	return -1;
+}
+
+// NOTE: `start` is where the nodes of the operands begin
+static NodeId optimize_pair(Ast *ast, const Node *expr, NodeId start, NodeId left, NodeId right)
+{
+	const Node *l = Ast_node(ast, left), *r = Ast_node(ast, right);
+	double value;
+	NodeId id;
+	switch (expr->type) {
+		case ApplNode:
+			return ApplicationNode_new(ast, left, right);
+		case AndNode:
+		case OrNode:
+			if (l->type != NumberNode) {
+				break;
+			}
+			if ((expr->type == AndNode) == !optimize_true(NumNode_value(l))) {
+				stats.folded += 1;
+				return Ast_keep(ast, start, left, start);
+			}
+			if (optimize_numeric(r)) {
+				stats.folded += 1;
+				return Ast_keep(ast, left + 1, right, start);
+			}
+			break;
+		default:
+			if (l->type == NumberNode && r->type == NumberNode && optimize_fold(PairNode_op(expr), NumNode_value(l), NumNode_value(r), &value)) {
+				stats.folded += 1;
+				ast->count = start;
+				return NumberNode_new(ast, value);
+			}
+			id = optimize_identity(ast, PairNode_op(expr), start, left, right);
+			if (id >= 0) {
+				stats.simplified += 1;
+				return id;
+			}
+	}
+	return OpNode_new(ast, left, right, expr->type, PairNode_op(expr));
+}
+
+// counts the uses of `name` in `expr`, `certain` are the ones in the places
+// where the argument can be computed instead: outside of the lambdas, and in
+// the strict mode also where they are always evaluated
+static void optimize_uses(const Node *expr, Symbol name, int here, int *all, int *certain)
+{
+	switch (expr->type) {
+		case NumberNode:
+			return;
+		case IdNode:
+			if (IdNode_symbol(expr) == name) {
+				*all += 1;
+				*certain += here;
+			}
+			return;
+		case IfNode:
+			optimize_uses(IfNode_cond(expr), name, here, all, certain);
+			optimize_uses(IfNode_true(expr), name, here && lazy, all, certain);
+			optimize_uses(IfNode_false(expr), name, here && lazy, all, certain);
+			return;
+		case FnNode:
+			if (IdNode_symbol(FnNode_param(expr)) != name) {
+				optimize_uses(FnNode_body(expr), name, 0, all, certain);
+			}
+			return;
+		case LetNode:
+			return;
+		case AndNode:
+		case OrNode:
+			optimize_uses(PairNode_left(expr), name, here, all, certain);
+			optimize_uses(PairNode_right(expr), name, here && lazy, all, certain);
+			return;
+		default:
+			optimize_uses(PairNode_left(expr), name, here, all, certain);
+			optimize_uses(PairNode_right(expr), name, here, all, certain);
+			return;
+	}
+}
+
+// whether a lambda in `expr` binds `name`
+static int optimize_binds(const Node *expr, Symbol name)
+{
+	switch (expr->type) {
+		case NumberNode:
+		case IdNode:
+			return 0;
+		case FnNode:
+			return IdNode_symbol(FnNode_param(expr)) == name || optimize_binds(FnNode_body(expr), name);
+		case IfNode:
+			return optimize_binds(IfNode_cond(expr), name) || optimize_binds(IfNode_true(expr), name) || optimize_binds(IfNode_false(expr), name);
+		case LetNode:
+			return optimize_binds(LetNode_value(expr), name);
+		default:
+			return optimize_binds(PairNode_left(expr), name) || optimize_binds(PairNode_right(expr), name);
+	}
+}
+
+// NOTE: whether a name `expr` refers to, in `scope`, is bound by a lambda of
+// `body`, where `expr` would be put
+static int optimize_captured(const Node *expr, const Bound *scope, const Node *body)
+{
+	const Bound *bound;
+	switch (expr->type) {
+		case NumberNode:
+			return 0;
+		case IdNode:
+			bound = optimize_lookup(scope, IdNode_symbol(expr));
+			if (bound && bound->arg) {
+				return optimize_captured(bound->arg, bound->scope, body);
+			}
+			return optimize_binds(body, IdNode_symbol(expr));
+		case FnNode:
+			return optimize_captured(FnNode_body(expr), &(Bound){IdNode_symbol(FnNode_param(expr)), NULL, NULL, scope}, body);
+		case IfNode:
+			return optimize_captured(IfNode_cond(expr), scope, body) || optimize_captured(IfNode_true(expr), scope, body) || optimize_captured(IfNode_false(expr), scope, body);
+		case LetNode:
+			return optimize_captured(LetNode_value(expr), scope, body);
+		default:
+			return optimize_captured(PairNode_left(expr), scope, body) || optimize_captured(PairNode_right(expr), scope, body);
+	}
+}
+
+// whether a global `expr` refers to, but the names in `local`, is bound in `scope`
+static int optimize_shadowed(const Node *expr, const Bound *local, const Bound *scope)
+{
+	switch (expr->type) {
+		case NumberNode:
+			return 0;
+		case IdNode:
+			return !optimize_lookup(local, IdNode_symbol(expr)) && optimize_lookup(scope, IdNode_symbol(expr));
+		case FnNode:
+			return optimize_shadowed(FnNode_body(expr), &(Bound){IdNode_symbol(FnNode_param(expr)), NULL, NULL, local}, scope);
+		case IfNode:
+			return optimize_shadowed(IfNode_cond(expr), local, scope) || optimize_shadowed(IfNode_true(expr), local, scope) || optimize_shadowed(IfNode_false(expr), local, scope);
+		case LetNode:
+			return optimize_shadowed(LetNode_value(expr), local, scope);
+		default:
+			return optimize_shadowed(PairNode_left(expr), local, scope) || optimize_shadowed(PairNode_right(expr), local, scope);
+	}
+}
+
+// NOTE: an argument that costs nothing to compute again, nor can fail
+static int optimize_trivial(const Node *expr, const Bound *scope)
+{
+	if (expr->type == NumberNode) {
+		return 1;
+	}
+	if (expr->type != IdNode) {
+		return 0;
+	}
+	const Bound *bound = optimize_lookup(scope, IdNode_symbol(expr));
+	if (bound) {
+		return !bound->arg || optimize_trivial(bound->arg, bound->scope);
+	}
+	return IdNode_symbol(expr) < definitions.size && definitions.entries[IdNode_symbol(expr)].defined;
+}
+
+// whether an operand can't fail the check of being a number, a parameter
+// in `params` stands for its argument
+static int optimize_operand(const Node *expr, const Bound *params, int count)
+{
+	for (int i = 0; expr->type == IdNode && i < count; i++) {
+		if (params[i].name == IdNode_symbol(expr)) {
+			return optimize_numeric(params[i].arg);
+		}
+	}
+	return optimize_numeric(expr);
+}
+
+// NOTE: in the strict mode the call computes the arguments in order before
+// the body, so the ones `moved` into it must be reached in the same order,
+// and before anything of it that can fail or not return. Walks `expr` as it
+// is evaluated, `next` is the argument expected, returns 1 once all of them
+// are reached, -1 if something else comes first and 0 otherwise
+static int optimize_ordered(const Node *expr, const Bound *params, const int *moved, int count, int *next)
+{
+	int order;
+	switch (expr->type) {
+		case NumberNode:
+		case FnNode:
+			return 0;
+		case IdNode:
+			for (int i = 0; i < count; i++) {
+				if (params[i].name != IdNode_symbol(expr) || !moved[i]) {
+					continue;
+				}
+				if (i != *next) {
+					return -1;
+				}
+				do {
+					*next += 1;
+				} while (*next < count && !moved[*next]);
+				return *next == count;
+			}
+			return optimize_trivial(expr, &params[count - 1]) ? 0 : -1;
+		case IfNode:
+			order = optimize_ordered(IfNode_cond(expr), params, moved, count, next);
+			return order ? order : -1;
+		case AndNode:
+		case OrNode:
+			order = optimize_ordered(PairNode_left(expr), params, moved, count, next);
+			return order ? order : -1;
+		case ApplNode:
+			order = optimize_ordered(PairNode_left(expr), params, moved, count, next);
+			if (order || !typed) {
+				return order ? order : -1;
+			}
+			order = optimize_ordered(PairNode_right(expr), params, moved, count, next);
+			return order ? order : -1;
+		case ExptNode:
+		case ProdNode:
+		case SumNode:
+		case CmpNode:
+			order = optimize_ordered(PairNode_left(expr), params, moved, count, next);
+			if (order || !optimize_operand(PairNode_left(expr), params, count)) {
+				return order ? order : -1;
+			}
+			order = optimize_ordered(PairNode_right(expr), params, moved, count, next);
+			return order ? order : -1;
+		default:
+			return -1;
+	}
+}
+
+// NOTE: the calls that apply more arguments than it takes lambdas are
+// inlined when the one with as many is, a lambda applied where it is written
+// is too, returns -1 if it isn't
+static NodeId optimize_inline(const Node *expr, Ast *ast, const Bound *scope)
+{
+	const Node *head = expr;
+	int count = 0;
+	for (; head->type == ApplNode; head = PairNode_left(head)) {
+		count += 1;
+	}
+	const Node *body = head->type == FnNode ? head : NULL;
+	if (head->type == IdNode && IdNode_symbol(head) < definitions.size && !optimize_lookup(scope, IdNode_symbol(head))) {
+		body = definitions.entries[IdNode_symbol(head)].fn;
+	}
+	Bound params[INLINE_ARITY];
+	for (int i = 0; i < count; i++) {
+		if (!body || body->type != FnNode || i == INLINE_ARITY) {
+			return -1;
+		}
+		params[i] = (Bound){IdNode_symbol(FnNode_param(body)), NULL, scope, i ? &params[i - 1] : NULL};
+		for (int j = 0; j < i; j++) {
+			if (params[j].name == params[i].name) {
+				return -1;
+			}
+		}
+		body = FnNode_body(body);
+	}
+	if (head->type == IdNode && (Node_size(body) > INLINE_SIZE || optimize_shadowed(body, &params[count - 1], scope))) {
+		return -1;
+	}
+	// NOTE: the names the body binds are checked not to clash with those
+	params[0].prev = scope;
+	const Node *call = expr;
+	int moved[INLINE_ARITY];
+	int first = count;
+	for (int i = count - 1; i >= 0; i--) {
+		params[i].arg = PairNode_right(call);
+		call = PairNode_left(call);
+		int all = 0;
+		int certain = 0;
+		optimize_uses(body, params[i].name, 1, &all, &certain);
+		if (optimize_captured(params[i].arg, scope, body)) {
+			return -1;
+		}
+		moved[i] = !optimize_trivial(params[i].arg, scope);
+		if (moved[i] && (all != certain || all > 1 || (!lazy && !all))) {
+			return -1;
+		}
+		first = moved[i] ? i : first;
+	}
+	if (!lazy && first < count && optimize_ordered(body, params, moved, count, &first) < 0) {
+		return -1;
+	}
+	stats.inlined += 1;
+	return optimize_expr(body, ast, &params[count - 1]);
+}
+
+static NodeId optimize_node(const Node *expr, Ast *ast, const Bound *scope)
+{
+	NodeId start = ast->count;
+	NodeId cond, left, right;
+	const Bound *bound;
+	double value;
+	switch (expr->type) {
+		case NumberNode:
+			return LeafNode_copy(ast, expr);
+		case IdNode:
+			bound = optimize_lookup(scope, IdNode_symbol(expr));
+			if (bound && bound->arg) {
+				return optimize_expr(bound->arg, ast, bound->scope);
+			}
+			return LeafNode_copy(ast, expr);
+		case FnNode:
+			left = LeafNode_copy(ast, FnNode_param(expr));
+			right = optimize_expr(FnNode_body(expr), ast, &(Bound){IdNode_symbol(FnNode_param(expr)), NULL, NULL, scope});
+			return FnNode_new(ast, left, right);
+		case LetNode:
+			left = LeafNode_copy(ast, LetNode_name(expr));
+			return LetNode_new(ast, left, optimize_expr(LetNode_value(expr), ast, scope));
+		case IfNode:
+			cond = optimize_expr(IfNode_cond(expr), ast, scope);
+			if (Ast_node(ast, cond)->type == NumberNode) {
+				stats.folded += 1;
+				value = NumNode_value(Ast_node(ast, cond));
+				ast->count = start;
+				return optimize_expr(optimize_true(value) ? IfNode_true(expr) : IfNode_false(expr), ast, scope);
+			}
+			left = optimize_expr(IfNode_true(expr), ast, scope);
+			right = optimize_expr(IfNode_false(expr), ast, scope);
+			return IfNode_new(ast, cond, left, right);
+		case ApplNode:
+			left = optimize_inline(expr, ast, scope);
+			if (left >= 0) {
+				return left;
+			}
+			// fallthrough
+		default:
+			left = optimize_expr(PairNode_left(expr), ast, scope);
+			right = optimize_expr(PairNode_right(expr), ast, scope);
+			return optimize_pair(ast, expr, start, left, right);
+	}
+}
+
+// NOTE: what a node is rewritten to has the same value, so what the
+// inference proved of it holds there too
+static NodeId optimize_expr(const Node *expr, Ast *ast, const Bound *scope)
+{
+	NodeId id = optimize_node(expr, ast, scope);
+	Ast_node(ast, id)->proven |= expr->proven;
+	return id;
+}
+
+// Repeated subexpressions that make calls are computed once: the smallest
+// part of a function body (or of a line) that holds them is wrapped in a
+// lambda of a fresh name applied to one of them, which is the local let of
+// the tree. The lazy mode makes a thunk of it, computed when it is first
+// needed, the strict mode computes it right away, so there it is only
+// shared where it would be the first thing computed anyway. The arithmetic
+// alone is left to the backends, which don't allocate for it.
+// NOTE: a line is rebuilt for each group it shares, up to this many times
+#define MAX_SHARES 32
+#define MAX_SHARED_NAMES 16
+#define SHARED_PREFIX '_' // no name the lexer makes starts with it
+
+typedef struct {
+	const Node *node;
+	unsigned   hash;
+	int        size;
+} Occurrence;
+
+static struct {
+	Occurrence *entries;
+	int        count;
+	int        capacity;
+	int        fresh;
+} shares = {0};
+
+typedef struct {
+	const Node *at;
+	const Node **members;
+	int        count;
+	const char *name;
+} Share;
+
+typedef struct Binder Binder;
+
+// NOTE: the lambda that binds a name where a member is, which tells the
+// names of the members apart, unlike the Bound of the names alone
+struct Binder {
+	const Node   *fn;
+	const Binder *prev;
+};
+
+static unsigned optimize_mix(unsigned hash, unsigned value)
+{
+	return (hash ^ value) * 16777619u;
+}
+
+static void optimize_occurs(const Node *expr, unsigned hash, int size)
+{
+	if (shares.count == shares.capacity) {
+		shares.capacity = shares.capacity ? shares.capacity * 2 : 256;
+		shares.entries = realloc(shares.entries, shares.capacity * sizeof(*shares.entries));
+	}
+	shares.entries[shares.count++] = (Occurrence){expr, hash, size};
+}
+
+// NOTE: hash-conses `expr`, the parts of it that make calls are recorded
+static unsigned optimize_collect(const Node *expr, int *size, int *calls)
+{
+	unsigned hash = optimize_mix(2166136261u, expr->type);
+	unsigned bits[sizeof(double) / sizeof(unsigned)];
+	int sizes[3] = {0};
+	int inner[3] = {0};
+	*size = 1;
+	*calls = 0;
+	switch (expr->type) {
+		case NumberNode:
+			memcpy(bits, &(double){NumNode_value(expr)}, sizeof(bits));
+			for (size_t i = 0; i < sizeof(bits) / sizeof(*bits); i++) {
+				hash = optimize_mix(hash, bits[i]);
+			}
+			return hash;
+		case IdNode:
+			return optimize_mix(hash, IdNode_symbol(expr));
+		case FnNode:
+			hash = optimize_mix(hash, IdNode_symbol(FnNode_param(expr)));
+			hash = optimize_mix(hash, optimize_collect(FnNode_body(expr), &sizes[0], &inner[0]));
+			*size += sizes[0];
+			return hash;
+		case LetNode:
+			hash = optimize_mix(hash, IdNode_symbol(LetNode_name(expr)));
+			hash = optimize_mix(hash, optimize_collect(LetNode_value(expr), &sizes[0], calls));
+			*size += sizes[0];
+			return hash;
+		case IfNode:
+			hash = optimize_mix(hash, optimize_collect(IfNode_cond(expr), &sizes[0], &inner[0]));
+			hash = optimize_mix(hash, optimize_collect(IfNode_true(expr), &sizes[1], &inner[1]));
+			hash = optimize_mix(hash, optimize_collect(IfNode_false(expr), &sizes[2], &inner[2]));
+			break;
+		default:
+			hash = optimize_mix(hash, PairNode_op(expr));
+			hash = optimize_mix(hash, optimize_collect(PairNode_left(expr), &sizes[0], &inner[0]));
+			hash = optimize_mix(hash, optimize_collect(PairNode_right(expr), &sizes[1], &inner[1]));
+			// NOTE: a lambda applied where it is written only binds a name
+			inner[2] = expr->type == ApplNode && PairNode_left(expr)->type != FnNode;
+	}
+	*size += sizes[0] + sizes[1] + sizes[2];
+	*calls = inner[0] + inner[1] + inner[2];
+	if (*calls) {
+		optimize_occurs(expr, hash, *size);
+	}
+	return hash;
+}
+
+// the larger ones first, the equal ones next to each other, in the order of the tree
+static int optimize_compare(const void *a, const void *b)
+{
+	const Occurrence *l = a, *r = b;
+	if (l->size != r->size) {
+		return r->size - l->size;
+	}
+	if (l->hash != r->hash) {
+		return l->hash < r->hash ? -1 : 1;
+	}
+	return (l->node > r->node) - (l->node < r->node);
+}
+
+static int optimize_equal(const Node *a, const Node *b)
+{
+	if (a->type != b->type) {
+		return 0;
+	}
+	switch (a->type) {
+		case NumberNode:
+			return optimize_is(a, NumNode_value(b));
+		case IdNode:
+			return IdNode_symbol(a) == IdNode_symbol(b);
+		case FnNode:
+			return IdNode_symbol(FnNode_param(a)) == IdNode_symbol(FnNode_param(b)) && optimize_equal(FnNode_body(a), FnNode_body(b));
+		case LetNode:
+			return IdNode_symbol(LetNode_name(a)) == IdNode_symbol(LetNode_name(b)) && optimize_equal(LetNode_value(a), LetNode_value(b));
+		case IfNode:
+			return optimize_equal(IfNode_cond(a), IfNode_cond(b)) && optimize_equal(IfNode_true(a), IfNode_true(b)) && optimize_equal(IfNode_false(a), IfNode_false(b));
+		default:
+			return PairNode_op(a) == PairNode_op(b) && optimize_equal(PairNode_left(a), PairNode_left(b)) && optimize_equal(PairNode_right(a), PairNode_right(b));
+	}
+}
+
+// adds the names `expr` refers to, but the ones in `bound`, to `names`,
+// returns 0 when there are too many of them
+static int optimize_free(const Node *expr, const Bound *bound, Symbol *names, int *count)
+{
+	switch (expr->type) {
+		case NumberNode:
+			return 1;
+		case IdNode:
+			if (optimize_lookup(bound, IdNode_symbol(expr))) {
+				return 1;
+			}
+			for (int i = 0; i < *count; i++) {
+				if (names[i] == IdNode_symbol(expr)) {
+					return 1;
+				}
+			}
+			if (*count == MAX_SHARED_NAMES) {
+				return 0;
+			}
+			names[(*count)++] = IdNode_symbol(expr);
+			return 1;
+		case FnNode:
+			return optimize_free(FnNode_body(expr), &(Bound){IdNode_symbol(FnNode_param(expr)), NULL, NULL, bound}, names, count);
+		case LetNode:
+			return optimize_free(LetNode_value(expr), bound, names, count);
+		case IfNode:
+			return optimize_free(IfNode_cond(expr), bound, names, count) && optimize_free(IfNode_true(expr), bound, names, count) && optimize_free(IfNode_false(expr), bound, names, count);
+		default:
+			return optimize_free(PairNode_left(expr), bound, names, count) && optimize_free(PairNode_right(expr), bound, names, count);
+	}
+}
+
+// NOTE: finds the lambdas that bind the `count` names where each of the
+// members is, NULL for the globals, a row of `binders` per member
+static void optimize_resolve(const Node *expr, const Binder *chain, const Share *share, const Symbol *names, int count, const Node **binders)
+{
+	for (int i = 0; i < share->count; i++) {
+		if (share->members[i] != expr) {
+			continue;
+		}
+		for (int j = 0; j < count; j++) {
+			const Binder *b = chain;
+			while (b && IdNode_symbol(FnNode_param(b->fn)) != names[j]) {
+				b = b->prev;
+			}
+			binders[i * count + j] = b ? b->fn : NULL;
+		}
+		return;
+	}
+	switch (expr->type) {
+		case NumberNode:
+		case IdNode:
+			return;
+		case FnNode:
+			return optimize_resolve(FnNode_body(expr), &(Binder){expr, chain}, share, names, count, binders);
+		case LetNode:
+			return optimize_resolve(LetNode_value(expr), chain, share, names, count, binders);
+		case IfNode:
+			optimize_resolve(IfNode_cond(expr), chain, share, names, count, binders);
+			optimize_resolve(IfNode_true(expr), chain, share, names, count, binders);
+			return optimize_resolve(IfNode_false(expr), chain, share, names, count, binders);
+		default:
+			optimize_resolve(PairNode_left(expr), chain, share, names, count, binders);
+			return optimize_resolve(PairNode_right(expr), chain, share, names, count, binders);
+	}
+}
+
+// NOTE: keeps the members whose names refer to the same as the ones of the
+// first, returns 0 when they refer to too many
+static int optimize_same(const Node *root, Share *share)
+{
+	Symbol names[MAX_SHARED_NAMES];
+	int count = 0;
+	if (!optimize_free(share->members[0], NULL, names, &count)) {
+		return 0;
+	}
+	const Node **binders = malloc((share->count * count + 1) * sizeof(*binders));
+	optimize_resolve(root, NULL, share, names, count, binders);
+	int kept = 0;
+	for (int i = 0; i < share->count; i++) {
+		if (!memcmp(&binders[i * count], binders, count * sizeof(*binders))) {
+			share->members[kept++] = share->members[i];
+		}
+	}
+	share->count = kept;
+	free(binders);
+	return 1;
+}
+
+// NOTE: whether it could be the body of a kernel, which only computes with
+// numbers (see kernel_compatible), a binding would make it a closure again
+static int optimize_kernel_shaped(const Node *expr)
+{
+	switch (expr->type) {
+		case NumberNode:
+		case IdNode:
+			return 1;
+		case FnNode:
+		case LetNode:
+			return 0;
+		case IfNode:
+			return optimize_kernel_shaped(IfNode_cond(expr)) && optimize_kernel_shaped(IfNode_true(expr)) && optimize_kernel_shaped(IfNode_false(expr));
+		default:
+			return optimize_kernel_shaped(PairNode_left(expr)) && optimize_kernel_shaped(PairNode_right(expr));
+	}
+}
+
+// how many of the members `expr` holds
+static int optimize_count(const Node *expr, const Share *share)
+{
+	for (int i = 0; i < share->count; i++) {
+		if (share->members[i] == expr) {
+			return 1;
+		}
+	}
+	switch (expr->type) {
+		case NumberNode:
+		case IdNode:
+			return 0;
+		case FnNode:
+			return optimize_count(FnNode_body(expr), share);
+		case LetNode:
+			return optimize_count(LetNode_value(expr), share);
+		case IfNode:
+			return optimize_count(IfNode_cond(expr), share) + optimize_count(IfNode_true(expr), share) + optimize_count(IfNode_false(expr), share);
+		default:
+			return optimize_count(PairNode_left(expr), share) + optimize_count(PairNode_right(expr), share);
+	}
+}
+
+// NOTE: at most how many of the members one evaluation of `expr` computes,
+// the one in a lambda counts as two, its applications compute it again
+static int optimize_most(const Node *expr, const Share *share)
+{
+	int left, right;
+	for (int i = 0; i < share->count; i++) {
+		if (share->members[i] == expr) {
+			return 1;
+		}
+	}
+	switch (expr->type) {
+		case NumberNode:
+		case IdNode:
+			return 0;
+		case FnNode:
+			return optimize_count(FnNode_body(expr), share) ? 2 : 0;
+		case LetNode:
+			return optimize_most(LetNode_value(expr), share);
+		case IfNode:
+			left = optimize_most(IfNode_true(expr), share);
+			right = optimize_most(IfNode_false(expr), share);
+			return optimize_most(IfNode_cond(expr), share) + (left > right ? left : right);
+		case ApplNode:
+			if (PairNode_left(expr)->type == FnNode) {
+				return optimize_most(FnNode_body(PairNode_left(expr)), share) + optimize_most(PairNode_right(expr), share);
+			}
+			// fallthrough
+		default:
+			return optimize_most(PairNode_left(expr), share) + optimize_most(PairNode_right(expr), share);
+	}
+}
+
+// NOTE: whether a member is what the strict mode computes first of `expr`,
+// before anything that could fail, -1 when nothing of it can
+static int optimize_leads(const Node *expr, const Share *share, const Bound *scope)
+{
+	const Node *fn;
+	Symbol name;
+	int lead;
+	for (int i = 0; i < share->count; i++) {
+		if (share->members[i] == expr) {
+			return 1;
+		}
+	}
+	switch (expr->type) {
+		case NumberNode:
+		case FnNode:
+			return -1;
+		case IdNode:
+			name = IdNode_symbol(expr);
+			if (optimize_lookup(scope, name) || (name < definitions.size && definitions.entries[name].defined)) {
+				return -1;
+			}
+			return 0;
+		case LetNode:
+			return optimize_leads(LetNode_value(expr), share, scope);
+		case IfNode:
+			return optimize_leads(IfNode_cond(expr), share, scope) > 0;
+		case AndNode:
+		case OrNode:
+			return optimize_leads(PairNode_left(expr), share, scope) > 0;
+		case ApplNode:
+			fn = PairNode_left(expr);
+			if (fn->type == FnNode) {
+				lead = optimize_leads(PairNode_right(expr), share, scope);
+				if (lead >= 0) {
+					return lead;
+				}
+				return optimize_leads(FnNode_body(fn), share, &(Bound){IdNode_symbol(FnNode_param(fn)), NULL, NULL, scope});
+			}
+			// NOTE: the function is checked before the argument is computed
+			lead = optimize_leads(fn, share, scope);
+			if (lead >= 0 || !typed) {
+				return lead > 0;
+			}
+			return optimize_leads(PairNode_right(expr), share, scope) > 0;
+		default:
+			// NOTE: likewise, the left operand is checked to be a number
+			lead = optimize_leads(PairNode_left(expr), share, scope);
+			if (lead >= 0 || !optimize_numeric(PairNode_left(expr))) {
+				return lead > 0;
+			}
+			return optimize_leads(PairNode_right(expr), share, scope) > 0;
+	}
+}
+
+// NOTE: the part of `expr` that holds all of the members in it, when they
+// can be shared there, a smaller one with fewer of them otherwise, `body`
+// is the one of the innermost lambda
+static const Node *optimize_place(const Node *expr, const Share *share, const Bound *scope, const Node *body)
+{
+	const Node *children[3] = {NULL, NULL, NULL};
+	const Bound *scopes[3] = {scope, scope, scope};
+	Bound param;
+	int count = optimize_count(expr, share);
+	if (count < 2) {
+		return NULL;
+	}
+	switch (expr->type) {
+		case FnNode:
+			param = (Bound){IdNode_symbol(FnNode_param(expr)), NULL, NULL, scope};
+			children[0] = FnNode_body(expr);
+			scopes[0] = &param;
+			body = children[0];
+			break;
+		case LetNode:
+			// NOTE: a function can only be applied once it is bound
+			param = (Bound){IdNode_symbol(LetNode_name(expr)), NULL, NULL, scope};
+			children[0] = LetNode_value(expr);
+			scopes[0] = children[0]->type == FnNode ? &param : scope;
+			break;
+		case IfNode:
+			children[0] = IfNode_cond(expr);
+			children[1] = IfNode_true(expr);
+			children[2] = IfNode_false(expr);
+			break;
+		default:
+			children[0] = PairNode_left(expr);
+			children[1] = PairNode_right(expr);
+	}
+	for (int i = 0; i < 3 && children[i]; i++) {
+		if (optimize_count(children[i], share) == count) {
+			return optimize_place(children[i], share, scopes[i], body);
+		}
+	}
+	if (typed && !lazy && body && optimize_kernel_shaped(body)) {
+		return NULL;
+	}
+	if (optimize_most(expr, share) >= 2 && (lazy || optimize_leads(expr, share, scope) > 0)) {
+		return expr;
+	}
+	for (int i = 0; i < 3 && children[i]; i++) {
+		const Node *at = optimize_place(children[i], share, scopes[i], body);
+		if (at) {
+			return at;
+		}
+	}
+	return NULL;
+}
+
+static NodeId optimize_copy(const Node *expr, Ast *ast, const Share *share, int inside);
+
+// NOTE: the members in `share->at` are replaced with the name once `inside` it
+static NodeId optimize_copy_node(const Node *expr, Ast *ast, const Share *share, int inside)
+{
+	NodeId left, right, cond;
+	if (share && expr == share->at && !inside) {
+		NodeId param = IdNode_new(ast, share->name, strlen(share->name));
+		NodeId body = optimize_copy(expr, ast, share, 1);
+		NodeId fn = FnNode_new(ast, param, body);
+		return ApplicationNode_new(ast, fn, optimize_copy(share->members[0], ast, NULL, 0));
+	}
+	for (int i = 0; inside && i < share->count; i++) {
+		if (share->members[i] == expr) {
+			return IdNode_new(ast, share->name, strlen(share->name));
+		}
+	}
+	switch (expr->type) {
+		case NumberNode:
+		case IdNode:
+			return LeafNode_copy(ast, expr);
+		case FnNode:
+			left = LeafNode_copy(ast, FnNode_param(expr));
+			return FnNode_new(ast, left, optimize_copy(FnNode_body(expr), ast, share, inside));
+		case LetNode:
+			left = LeafNode_copy(ast, LetNode_name(expr));
+			return LetNode_new(ast, left, optimize_copy(LetNode_value(expr), ast, share, inside));
+		case IfNode:
+			cond = optimize_copy(IfNode_cond(expr), ast, share, inside);
+			left = optimize_copy(IfNode_true(expr), ast, share, inside);
+			right = optimize_copy(IfNode_false(expr), ast, share, inside);
+			return IfNode_new(ast, cond, left, right);
+		case ApplNode:
+			left = optimize_copy(PairNode_left(expr), ast, share, inside);
+			return ApplicationNode_new(ast, left, optimize_copy(PairNode_right(expr), ast, share, inside));
+		default:
+			left = optimize_copy(PairNode_left(expr), ast, share, inside);
+			right = optimize_copy(PairNode_right(expr), ast, share, inside);
+			return OpNode_new(ast, left, right, expr->type, PairNode_op(expr));
+	}
+}
+
+static NodeId optimize_copy(const Node *expr, Ast *ast, const Share *share, int inside)
+{
+	NodeId id = optimize_copy_node(expr, ast, share, inside);
+	Ast_node(ast, id)->proven = expr->proven;
+	return id;
+}
+
+// NOTE: shares the first group of equal subexpressions, the larger ones
+// first, that can be, returns -1 when none can
+static NodeId optimize_share(const Node *expr, Ast *ast)
+{
+	int size, calls;
+	shares.count = 0;
+	optimize_collect(expr, &size, &calls);
+	qsort(shares.entries, shares.count, sizeof(*shares.entries), optimize_compare);
+	const Node **members = malloc(shares.count * sizeof(*members));
+	char name[16];
+	NodeId root = -1;
+	for (int i = 0, j; i < shares.count && root < 0; i = j) {
+		const Occurrence *first = &shares.entries[i];
+		Share share = {NULL, members, 0, name};
+		for (j = i; j < shares.count; j++) {
+			const Occurrence *next = &shares.entries[j];
+			if (next->size != first->size || next->hash != first->hash) {
+				break;
+			}
+			if (optimize_equal(first->node, next->node)) {
+				members[share.count++] = next->node;
+			}
+		}
+		if (share.count < 2 || !optimize_same(expr, &share) || share.count < 2) {
+			continue;
+		}
+		share.at = optimize_place(expr, &share, NULL, NULL);
+		if (!share.at) {
+			continue;
+		}
+		int count = 0;
+		for (int k = 0; k < share.count; k++) {
+			if (optimize_count(share.at, &(Share){NULL, &members[k], 1, NULL})) {
+				members[count++] = members[k];
+			}
+		}
+		share.count = count;
+		stats.shared += 1;
+		stats.eliminated += share.count - 1;
+		snprintf(name, sizeof(name), "%c%d", SHARED_PREFIX, ++shares.fresh);
+		root = optimize_copy(expr, ast, &share, 0);
+	}
+	free(members);
+	return root;
+}
+
+void optimize_declare(const Node *expr)
+{
+	if (expr->type != LetNode) {
+		return;
+	}
+	Symbol name = IdNode_symbol(LetNode_name(expr));
+	if (name >= definitions.size) {
+		int size = definitions.size ? definitions.size : 64;
+		while (size <= name) {
+			size *= 2;
+		}
+		definitions.entries = realloc(definitions.entries, size * sizeof(*definitions.entries));
+		for (int i = definitions.size; i < size; i++) {
+			definitions.entries[i] = (Definition){0, 0, NULL};
+		}
+		definitions.size = size;
+	}
+	definitions.entries[name].count += 1;
+}
+
+// NOTE: the definition is only inlined from the next line on
+static void optimize_define(const Node *expr)
+{
+	if (expr->type != LetNode || LetNode_value(expr)->type != FnNode) {
+		return;
+	}
+	Symbol name = IdNode_symbol(LetNode_name(expr));
+	if (name >= definitions.size || definitions.entries[name].count != 1) {
+		return;
+	}
+	int all = 0;
+	int certain = 0;
+	optimize_uses(LetNode_value(expr), name, 0, &all, &certain);
+	definitions.entries[name].defined = 1;
+	if (!all) {
+		definitions.entries[name].fn = LetNode_value(expr);
+	}
+}
+
+Node *optimize(const Node *expr, Arena *a)
+{
+	Ast ast = Ast_make();
+	Arena passes = Arena_make(PASS_ARENA_PAGE_SIZE);
+	int inlined = stats.inlined;
+	NodeId root = optimize_expr(expr, &ast, NULL);
+	for (int i = 1; i < MAX_PASSES && stats.inlined > inlined; i++) {
+		inlined = stats.inlined;
+		expr = Ast_finish(&ast, root, &passes);
+		Ast_reset(&ast);
+		root = optimize_expr(expr, &ast, NULL);
+	}
+	Ast shared = Ast_make();
+	for (int i = 0; i < MAX_SHARES; i++) {
+		NodeId id = optimize_share(Ast_node(&ast, root), &shared);
+		if (id < 0) {
+			break;
+		}
+		Ast swap = ast;
+		ast = shared;
+		shared = swap;
+		Ast_reset(&shared);
+		root = id;
+	}
+	Node *result = Ast_finish(&ast, root, a);
+	Arena_destroy(passes);
+	Ast_destroy(shared);
+	Ast_destroy(ast);
+	optimize_define(result);
+	if (tree) {
+		Node_println(result, stderr);
+	}
+	return result;
+}
+
+void optimize_print_stats(void)
+{
+	fprintf(stderr, "optimize: %d operations folded, %d identities simplified, %d calls inlined\n", stats.folded, stats.simplified, stats.inlined);
+	fprintf(stderr, "optimize: %d subexpressions shared, %d evaluations eliminated\n", stats.shared, stats.eliminated);
+}
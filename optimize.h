@@ -0,0 +1,15 @@
+#ifndef OPTIMIZE_INCLUDED
+#define OPTIMIZE_INCLUDED
+
+#include "node.h"
+#include "arena.h"
+
+// NOTE: runs once a line is parsed and, with -t, type checked, the tree it
+// returns is built into `a` and the one given is left as is
+Node *optimize(const Node *expr, Arena *a);
+// NOTE: tells about every line of the input before the first one is
+// optimized, when the input is known upfront
+void optimize_declare(const Node *expr);
+void optimize_print_stats(void);
+
+#endif // OPTIMIZE_INCLUDED
@@ -6,10 +6,20 @@
 #define DEBUG_DEFAULT 0
 #define LAZY_DEFAULT  0
 #define TYPED_DEFAULT 0
+#define BATCH_DEFAULT 0
+#define JIT_DEFAULT   0
+#define C_CODE_DEFAULT 0
+#define ELF_DEFAULT   0
+#define TREE_DEFAULT  0
 
 int debug = DEBUG_DEFAULT;
 int lazy  = LAZY_DEFAULT;
 int typed = TYPED_DEFAULT;
+int batch = BATCH_DEFAULT;
+int jit   = JIT_DEFAULT;
+int c_code = C_CODE_DEFAULT;
+int elf   = ELF_DEFAULT;
+int tree  = TREE_DEFAULT;
 
 int parse_args(int argc, char **argv)
 {
@@ -17,17 +27,22 @@ int parse_args(int argc, char **argv)
 		char *arg = argv[optind];
 		if (arg[0] != '-') {
 			errorf("argument error: unexpected positional argument: '%s'", arg);
-			errorf("usage: %s [-dlt]", argv[0]);
+			errorf("usage: %s [-acdejlpt]", argv[0]);
 			return 0;
 		}
 		for (arg++; *arg; arg++) {
 			switch (*arg) {
+				case 'a': tree = 1;  break;
+				case 'c': c_code = 1; break;
 				case 'd': debug = 1; break;
+				case 'e': elf = 1;   break;
+				case 'j': jit = 1;   break;
 				case 'l': lazy = 1;  break;
+				case 'p': batch = 1; break;
 				case 't': typed = 1; break;
 				default:
 					errorf("argument error: unknown flag: '%s'", arg);
-					errorf("usage: %s [-dlt]", argv[0]);
+					errorf("usage: %s [-acdejlpt]", argv[0]);
 					return 0;
 			}
 		}
@@ -4,6 +4,11 @@
 extern int debug;
 extern int lazy;
 extern int typed;
+extern int batch;
+extern int jit;
+extern int c_code;
+extern int elf;
+extern int tree;
 
 int parse_args(int argc, char **argv);
 
@@ -44,6 +44,8 @@ static const Oplevel optable[] = {
 
 #define MAXPREC (int)(sizeof(optable)/sizeof(optable[0]))
 
+#define NO_NODE -1
+
 // OP_TOKEN <- any token from optable
 static const Oplevel *is_op_token(Token token)
 {
@@ -67,13 +69,13 @@ static int is_term_token(Token token)
 	);
 }
 
-static Node *parse_let(Scanner *scanner, Arena *a);
-static Node *parse_expression(Scanner *scanner, Arena *a);
-static Node *parse_if(Scanner *s, Arena *a);
-static Node *parse_fn(Scanner *s, Arena *a);
-static Node *parse_opseq(Scanner *scanner, const Oplevel *op, Arena *a);
-static Node *parse_application(Scanner *s, Arena *a);
-static Node *parse_term(Scanner *s, Arena *a);
+static NodeId parse_let(Scanner *scanner, Ast *ast);
+static NodeId parse_expression(Scanner *scanner, Ast *ast);
+static NodeId parse_if(Scanner *s, Ast *ast);
+static NodeId parse_fn(Scanner *s, Ast *ast);
+static NodeId parse_opseq(Scanner *scanner, const Oplevel *op, Ast *ast);
+static NodeId parse_application(Scanner *s, Ast *ast);
+static NodeId parse_term(Scanner *s, Ast *ast);
 
 // VALID ::= (EXPRESSION | LET)? 'END'
 Node *parse(Scanner *scanner, Arena *a)
@@ -83,173 +85,178 @@ Node *parse(Scanner *scanner, Arena *a)
 	if (next.type == EndToken) {
 		return NULL;
 	}
-	Node *expr = NULL;
+	Ast ast = Ast_make();
+	NodeId expr = NO_NODE;
 	if (next.type == LetToken) {
-		expr = parse_let(scanner, a);
+		expr = parse_let(scanner, &ast);
 	} else {
-		expr = parse_expression(scanner, a);
+		expr = parse_expression(scanner, &ast);
 	}
-	if (!expr) {
-		Scanner_seek_end(scanner);
-		return NULL;
+	if (expr != NO_NODE) {
+		next = Scanner_peek(scanner);
+		if (next.type != EndToken) {
+			tokerror("unexpected token after the expression", next);
+			expr = NO_NODE;
+		}
 	}
-	next = Scanner_peek(scanner);
-	if (next.type != EndToken) {
-		tokerror("unexpected token after the expression", next);
+	if (expr == NO_NODE) {
+		Ast_destroy(ast);
 		Scanner_seek_end(scanner);
 		return NULL;
 	}
-	return expr;
+	Node *root = Ast_finish(&ast, expr, a);
+	Ast_destroy(ast);
+	return root;
 }
 
 // LET_VALUE ::= '=' EXPRESSION | 'ID' LET_VALUE
-static Node *parse_let_value(Scanner *scanner, Arena *a)
+static NodeId parse_let_value(Scanner *scanner, Ast *ast)
 {
 	Token next = Scanner_next(scanner);
 	if (next.type == EqToken) {
 		Scanner_skip_nl(scanner);
-		return parse_expression(scanner, a);
+		return parse_expression(scanner, ast);
 	} else if (next.type == IdToken) {
-		Node *param = IdNode_new(a, next.string, next.length);
+		NodeId param = IdNode_new(ast, next.string, next.length);
 		Scanner_skip_nl(scanner);
-		Node *body = parse_let_value(scanner, a);
-		if (!body) {
-			return NULL;
+		NodeId body = parse_let_value(scanner, ast);
+		if (body == NO_NODE) {
+			return NO_NODE;
 		}
-		return FnNode_new(a, param, body);
+		return FnNode_new(ast, param, body);
 	} else {
 		tokerror("expected '=' or an identifier", next);
-		return NULL;
+		return NO_NODE;
 	}
 }
 
 // LET ::= 'LET' 'ID' LET_VALUE
-static Node *parse_let(Scanner *scanner, Arena *a)
+static NodeId parse_let(Scanner *scanner, Ast *ast)
 {
 	Scanner_next(scanner); // drop 'LET'
 	Scanner_skip_nl(scanner);
 	Token next = Scanner_next(scanner);
 	if (next.type != IdToken) {
 		tokerror("expected identifier", next);
-		return NULL;
+		return NO_NODE;
 	}
-	Node *name = IdNode_new(a, next.string, next.length);
+	NodeId name = IdNode_new(ast, next.string, next.length);
 	Scanner_skip_nl(scanner);
-	Node *value = parse_let_value(scanner, a);
-	if (!value) {
-		return NULL;
+	NodeId value = parse_let_value(scanner, ast);
+	if (value == NO_NODE) {
+		return NO_NODE;
 	}
-	return LetNode_new(a, name, value);
+	return LetNode_new(ast, name, value);
 }
 
 // EXPRESSION ::= IF | FN | OP
-static Node *parse_expression(Scanner *scanner, Arena *a)
+static NodeId parse_expression(Scanner *scanner, Ast *ast)
 {
 	Token next = Scanner_peek(scanner);
 	if (next.type == IfToken) {
-		return parse_if(scanner, a);
+		return parse_if(scanner, ast);
 	}
 	if (next.type == FnToken) {
-		return parse_fn(scanner, a);
+		return parse_fn(scanner, ast);
 	}
-	return parse_opseq(scanner, 0, a);
+	return parse_opseq(scanner, 0, ast);
 }
 
 // FN_BODY ::= ':' EXPRESSION | 'ID' FN_BODY
-static Node *parse_fn_body(Scanner *scanner, Arena *a)
+static NodeId parse_fn_body(Scanner *scanner, Ast *ast)
 {
 	Token next = Scanner_next(scanner);
 	if (next.type == ColonToken) {
 		Scanner_skip_nl(scanner);
-		return parse_expression(scanner, a);
+		return parse_expression(scanner, ast);
 	} else if (next.type == IdToken) {
-		Node *param = IdNode_new(a, next.string, next.length);
+		NodeId param = IdNode_new(ast, next.string, next.length);
 		Scanner_skip_nl(scanner);
-		Node *body = parse_fn_body(scanner, a);
-		if (!body) {
-			return NULL;
+		NodeId body = parse_fn_body(scanner, ast);
+		if (body == NO_NODE) {
+			return NO_NODE;
 		}
-		return FnNode_new(a, param, body);
+		return FnNode_new(ast, param, body);
 	} else {
 		tokerror("expected ':' or and identifier", next);
-		return NULL;
+		return NO_NODE;
 	}
 }
 
 // FN ::= 'FN' FN_BODY
-static Node *parse_fn(Scanner *scanner, Arena *a)
+static NodeId parse_fn(Scanner *scanner, Ast *ast)
 {
 	Scanner_next(scanner); // drop 'FN'
 	Scanner_skip_nl(scanner);
 	Token next = Scanner_next(scanner);
 	if (next.type != IdToken) {
 		tokerror("expected identifier", next);
-		return NULL;
+		return NO_NODE;
 	}
-	Node *param = IdNode_new(a, next.string, next.length);
+	NodeId param = IdNode_new(ast, next.string, next.length);
 	Scanner_skip_nl(scanner);
-	Node *body = parse_fn_body(scanner, a);
-	if (!body) {
-		return NULL;
+	NodeId body = parse_fn_body(scanner, ast);
+	if (body == NO_NODE) {
+		return NO_NODE;
 	}
-	return FnNode_new(a, param, body);
+	return FnNode_new(ast, param, body);
 }
 
 // IF_TAIL ::= 'ELSE' EXPRESSION | IF
-static Node *parse_if_tail(Scanner *scanner, Arena *a)
+static NodeId parse_if_tail(Scanner *scanner, Ast *ast)
 {
 	Token next = Scanner_peek(scanner);
 	if (next.type == ElseToken) {
 		Scanner_next(scanner);
 		Scanner_skip_nl(scanner);
-		return parse_expression(scanner, a);
+		return parse_expression(scanner, ast);
 	} else if (next.type == IfToken) {
-		return parse_if(scanner, a);
+		return parse_if(scanner, ast);
 	} else {
 		tokerror("expected 'if' or 'else'", next);
-		return NULL;
+		return NO_NODE;
 	}
 }
 
 // IF ::= 'IF OPSEQ 'THEN' EXPRESSION IF_TAIL
-static Node *parse_if(Scanner *scanner, Arena *a)
+static NodeId parse_if(Scanner *scanner, Ast *ast)
 {
 	Scanner_next(scanner); // drop 'IF'
 	Scanner_skip_nl(scanner);
-	Node *cond = parse_opseq(scanner, 0, a);
-	if (!cond) {
-		return NULL;
+	NodeId cond = parse_opseq(scanner, 0, ast);
+	if (cond == NO_NODE) {
+		return NO_NODE;
 	}
 	Scanner_skip_nl(scanner);
 	Token next = Scanner_next(scanner);
 	if (next.type != ThenToken) {
 		tokerror("expected 'then'", next);
-		return NULL;
+		return NO_NODE;
 	}
 	Scanner_skip_nl(scanner);
-	Node *true = parse_expression(scanner, a);
-	if (!true) {
-		return NULL;
+	NodeId true = parse_expression(scanner, ast);
+	if (true == NO_NODE) {
+		return NO_NODE;
 	}
 	Scanner_skip_nl(scanner);
-	Node *false = parse_if_tail(scanner, a);
-	if (!false) {
-		return NULL;
+	NodeId false = parse_if_tail(scanner, ast);
+	if (false == NO_NODE) {
+		return NO_NODE;
 	}
-	return IfNode_new(a, cond, true, false);
+	return IfNode_new(ast, cond, true, false);
 }
 
 // LASSOC ::= OP OPSEQ | LASSOC OP OPSEQ
-static Node *parse_lassoc(Scanner *scanner, const Oplevel *op, Node *left, Arena *a)
+static NodeId parse_lassoc(Scanner *scanner, const Oplevel *op, NodeId left, Ast *ast)
 {
 	for (;;) {
 		Token optok = Scanner_next(scanner);
 		Scanner_skip_nl(scanner);
-		Node *right = parse_opseq(scanner, op, a);
-		if (!right) {
-			return NULL;
+		NodeId right = parse_opseq(scanner, op, ast);
+		if (right == NO_NODE) {
+			return NO_NODE;
 		}
-		left = OpNode_new(a, left, right, op->optype, optok.string[0]);
+		left = OpNode_new(ast, left, right, op->optype, optok.string[0]);
 		Token next = Scanner_peek(scanner);
 		const Oplevel *op2 = is_op_token(next);
 		if (op2 < op) {
@@ -259,49 +266,49 @@ static Node *parse_lassoc(Scanner *scanner, const Oplevel *op, Node *left, Arena
 }
 
 // RASSOC ::= OP OPSEQ | OP OPSEQ RASSOC
-static Node *parse_rassoc(Scanner *scanner, const Oplevel *op, Node *left, Arena *a)
+static NodeId parse_rassoc(Scanner *scanner, const Oplevel *op, NodeId left, Ast *ast)
 {
 	Token optok = Scanner_next(scanner);
 	Scanner_skip_nl(scanner);
-	Node *right = parse_opseq(scanner, op, a);
-	if (!right) {
-		return NULL;
+	NodeId right = parse_opseq(scanner, op, ast);
+	if (right == NO_NODE) {
+		return NO_NODE;
 	}
 	Token next = Scanner_peek(scanner);
 	const Oplevel *op2 = is_op_token(next);
 	if (op2 == op) {
-		right = parse_rassoc(scanner, op, right, a);
-		if (!right) {
-			return NULL;
+		right = parse_rassoc(scanner, op, right, ast);
+		if (right == NO_NODE) {
+			return NO_NODE;
 		}
 	}
-	return OpNode_new(a, left, right, op->optype, optok.string[0]);
+	return OpNode_new(ast, left, right, op->optype, optok.string[0]);
 }
 
 // NASSOC ::= OP OPSEQ
-static Node *parse_nassoc(Scanner *scanner, const Oplevel *op, Node *left, Arena *a)
+static NodeId parse_nassoc(Scanner *scanner, const Oplevel *op, NodeId left, Ast *ast)
 {
 	Token optok = Scanner_next(scanner);
 	Scanner_skip_nl(scanner);
-	Node *right = parse_opseq(scanner, op, a);
-	if (!right) {
-		return NULL;
+	NodeId right = parse_opseq(scanner, op, ast);
+	if (right == NO_NODE) {
+		return NO_NODE;
 	}
 	Token next = Scanner_peek(scanner);
 	const Oplevel *op2 = is_op_token(next);
 	if (op2 == op) {
 		tokerror("non-assosiative operator", next);
-		return NULL;
+		return NO_NODE;
 	}
-	return OpNode_new(a, left, right, op->optype, optok.string[0]);
+	return OpNode_new(ast, left, right, op->optype, optok.string[0]);
 }
 
 // OPSEQ ::= APPLICATION | APPLICATION (LASSOC | RASSOC | NASSOC)
-static Node *parse_opseq(Scanner *scanner, const Oplevel *op, Arena *a)
+static NodeId parse_opseq(Scanner *scanner, const Oplevel *op, Ast *ast)
 {
-	Node *left = parse_application(scanner, a);
-	if (!left) {
-		return NULL;
+	NodeId left = parse_application(scanner, ast);
+	if (left == NO_NODE) {
+		return NO_NODE;
 	}
 	for (;;) {
 		Token next = Scanner_peek(scanner);
@@ -311,44 +318,44 @@ static Node *parse_opseq(Scanner *scanner, const Oplevel *op, Arena *a)
 		}
 		switch (op2->assoc) {
 			case LeftAssoc:
-				left = parse_lassoc(scanner, op2, left, a);
+				left = parse_lassoc(scanner, op2, left, ast);
 				break;
 			case RightAssoc:
-				left = parse_rassoc(scanner, op2, left, a);
+				left = parse_rassoc(scanner, op2, left, ast);
 				break;
 			case NoneAssoc:
-				left = parse_nassoc(scanner, op2, left, a);
+				left = parse_nassoc(scanner, op2, left, ast);
 				break;
 		}
-		if (!left) {
-			return NULL;
+		if (left == NO_NODE) {
+			return NO_NODE;
 		}
 	}
-	return NULL;
+	return NO_NODE;
 }
 
 // APPLICATION ::= TERM | APPLICATION TERM
-static Node *parse_application(Scanner *scanner, Arena *a)
+static NodeId parse_application(Scanner *scanner, Ast *ast)
 {
-	Node *operator = parse_term(scanner, a);
-	if (!operator) {
-		return NULL;
+	NodeId operator = parse_term(scanner, ast);
+	if (operator == NO_NODE) {
+		return NO_NODE;
 	}
 	for (;;) {
 		Token next = Scanner_peek(scanner);
 		if (!is_term_token(next)) {
 			return operator;
 		}
-		Node *operand = parse_term(scanner, a);
-		if (!operand) {
-			return NULL;
+		NodeId operand = parse_term(scanner, ast);
+		if (operand == NO_NODE) {
+			return NO_NODE;
 		}
-		operator = ApplicationNode_new(a, operator, operand);
+		operator = ApplicationNode_new(ast, operator, operand);
 	}
 }
 
 // NUMBER ::= DIGIT+ ('.' DIGIT*)?
-static Node *parse_number(Token tok, Arena *a)
+static NodeId parse_number(Token tok, Ast *ast)
 {
 	double number = 0;
 	int i;
@@ -361,39 +368,39 @@ static Node *parse_number(Token tok, Arena *a)
 	for (double factor = 0.1; i < tok.length; i++, factor/=10) {
 		number += (tok.string[i] - '0') * factor;
 	}
-	return NumberNode_new(a, number);
+	return NumberNode_new(ast, number);
 }
 
 // TERM ::= '(' EXPRESSION ')' | 'NUMBER' | 'ID' | '-' TERM
-static Node *parse_term(Scanner *scanner, Arena *a)
+static NodeId parse_term(Scanner *scanner, Ast *ast)
 {
 	Token next = Scanner_next(scanner);
 	if (next.type == MinusToken) {
-		Node *term = parse_term(scanner, a);
-		if (!term) {
-			return NULL;
+		NodeId term = parse_term(scanner, ast);
+		if (term == NO_NODE) {
+			return NO_NODE;
 		}
-		return OpNode_new(a, term, NumberNode_new(a, -1), ProdNode, '*');
+		return OpNode_new(ast, term, NumberNode_new(ast, -1), ProdNode, '*');
 	}
 	if (next.type == LparenToken) {
 		Scanner_skip_nl(scanner);
-		Node *expr = parse_expression(scanner, a);
-		if (!expr) {
-			return NULL;
+		NodeId expr = parse_expression(scanner, ast);
+		if (expr == NO_NODE) {
+			return NO_NODE;
 		}
 		Scanner_skip_nl(scanner);
 		next = Scanner_next(scanner);
 		if (next.type != RparenToken) {
 			tokerror("expected ')'", next);
-			return NULL;
+			return NO_NODE;
 		}
 		return expr;
 	} else if (next.type == NumberToken) {
-		return parse_number(next, a);
+		return parse_number(next, ast);
 	} else if (next.type == IdToken) {
-		return IdNode_new(a, next.string, next.length);
+		return IdNode_new(ast, next.string, next.length);
 	} else {
 		tokerror("expected '(', '-' or a number", next);
-		return NULL;
+		return NO_NODE;
 	}
 }
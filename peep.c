@@ -0,0 +1,444 @@
+#include "peep.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "arena.h"
+
+typedef enum {
+	LineInstr,
+	LineLabel,
+	LineOther, // a directive, a comment, or anything outside of .text
+} LineKind;
+
+#define PEEP_OPERANDS 3
+
+typedef struct {
+	char     *text; // NULL once removed
+	LineKind kind;
+	char     *mnemonic;
+	char     *ops[PEEP_OPERANDS];
+	int      count;
+} Line;
+
+typedef enum {
+	PeepPushPop, // a push right before a pop, or a spill right before its reload
+	PeepLoad,    // a load of what the register holds already
+	PeepJump,    // a jump to the label that follows it
+	PeepMove,    // a move to a register that is overwritten right after
+	PEEP_RULES,
+} PeepRule;
+
+#define PEEP_ARENA_PAGE_SIZE (64 << 10)
+#define PEEP_REGS            32 // the general purpose ones, then the xmm ones
+
+static struct {
+	Arena  arena;
+	Line   *lines;
+	int    count;
+	int    capacity;
+	char   *partial; // the line being emitted
+	size_t partial_size;
+	size_t partial_capacity;
+	int    text;     // whether the lines go to the text section
+	int    fired[PEEP_RULES];
+} peep = {.text = 1};
+
+static char *peep_format(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	int size = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	char *text = Arena_alloc(&peep.arena, size + 1);
+	va_start(args, fmt);
+	vsnprintf(text, size + 1, fmt, args);
+	va_end(args);
+	return text;
+}
+
+// splits the instruction into its mnemonic and operands,
+// the commas in parens don't count
+static void Line_set(Line *line, char *text)
+{
+	line->text = text;
+	line->count = 0;
+	text = strcpy(Arena_alloc(&peep.arena, strlen(text) + 1), text);
+	text += strspn(text, " \t");
+	line->mnemonic = text;
+	text += strcspn(text, " \t");
+	if (*text) {
+		*text++ = '\0';
+	}
+	while (*text && line->count < PEEP_OPERANDS) {
+		text += strspn(text, " \t");
+		line->ops[line->count] = text;
+		line->count += 1;
+		for (int depth = 0; *text && (*text != ',' || depth); text++) {
+			depth += (*text == '(') - (*text == ')');
+		}
+		if (*text) {
+			*text++ = '\0';
+		}
+	}
+}
+
+static void peep_line(const char *text, size_t size)
+{
+	if (peep.count == peep.capacity) {
+		peep.capacity = peep.capacity ? peep.capacity * 2 : 256;
+		peep.lines = realloc(peep.lines, peep.capacity * sizeof(*peep.lines));
+	}
+	Line *line = &peep.lines[peep.count];
+	peep.count += 1;
+	line->text = Arena_alloc(&peep.arena, size + 1);
+	memcpy(line->text, text, size);
+	line->text[size] = '\0';
+	line->kind = LineOther;
+	line->count = 0;
+	if (text[0] == '.') {
+		peep.text = !strncmp(text, ".text", 5);
+	} else if (!peep.text || !size || !strncmp(text, "//", 2)) {
+		return;
+	} else if (text[0] == '\t') {
+		line->kind = LineInstr;
+		Line_set(line, line->text);
+	} else {
+		// NOTE: including a label with something after it
+		line->kind = LineLabel;
+	}
+}
+
+void peep_emit(const char *fmt, va_list args)
+{
+	va_list copy;
+	va_copy(copy, args);
+	size_t size = vsnprintf(NULL, 0, fmt, copy);
+	va_end(copy);
+	if (peep.partial_size + size + 1 > peep.partial_capacity) {
+		peep.partial_capacity = (peep.partial_size + size + 1) * 2;
+		peep.partial = realloc(peep.partial, peep.partial_capacity);
+	}
+	vsnprintf(peep.partial + peep.partial_size, size + 1, fmt, args);
+	peep.partial_size += size;
+	char *start = peep.partial;
+	char *end;
+	while ((end = memchr(start, '\n', peep.partial + peep.partial_size - start))) {
+		peep_line(start, end - start);
+		start = end + 1;
+	}
+	peep.partial_size -= start - peep.partial;
+	memmove(peep.partial, start, peep.partial_size);
+}
+
+static const char *peep_names[] = {
+	"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+	"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+	"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+	"r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+};
+
+// the register named at `name`, -1 for none, `wide` unless it's 32 bits of one
+static int peep_reg_at(const char *name, size_t *len, int *wide)
+{
+	*len = strspn(name, "abcdefghijklmnopqrstuvwxyz0123456789");
+	*wide = 1;
+	if (*len > 3 && !strncmp(name, "xmm", 3)) {
+		return 16 + atoi(name + 3);
+	}
+	for (int i = 0; i < 32; i++) {
+		if (strlen(peep_names[i]) == *len && !strncmp(name, peep_names[i], *len)) {
+			*wide = i < 16;
+			return i % 16;
+		}
+	}
+	return -1;
+}
+
+// the register of an operand that is just a whole one, -1 otherwise
+static int peep_reg(const char *op)
+{
+	size_t len;
+	int wide;
+	if (op[0] != '%') {
+		return -1;
+	}
+	int reg = peep_reg_at(op + 1, &len, &wide);
+	return op[1 + len] || !wide ? -1 : reg;
+}
+
+static int peep_mentions(const char *op, int reg)
+{
+	for (const char *at = strchr(op, '%'); at; at = strchr(at + 1, '%')) {
+		size_t len;
+		int wide;
+		if (peep_reg_at(at + 1, &len, &wide) == reg) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int peep_memory(const char *op)
+{
+	return op[0] != '%' && op[0] != '$';
+}
+
+static int Line_is(const Line *line, const char *mnemonic, int count)
+{
+	return line->kind == LineInstr && line->count == count && !strcmp(line->mnemonic, mnemonic);
+}
+
+// the moves that copy all 64 bits, or what a load zero-extends to them
+static int Line_is_move(const Line *line)
+{
+	if (line->kind != LineInstr || line->count != 2) {
+		return 0;
+	}
+	if (!strcmp(line->mnemonic, "movsd")) {
+		return peep_reg(line->ops[0]) < 0 || peep_reg(line->ops[1]) < 0;
+	}
+	return !strcmp(line->mnemonic, "mov") || !strcmp(line->mnemonic, "movq");
+}
+
+// the next line that is code, -1 for none
+static int peep_next(int i)
+{
+	for (i += 1; i < peep.count; i++) {
+		if (peep.lines[i].text && peep.lines[i].kind != LineOther) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int peep_jump(int i)
+{
+	Line *jump = &peep.lines[i];
+	if (jump->count != 1 || jump->mnemonic[0] != 'j' || jump->ops[0][0] == '*') {
+		return 0;
+	}
+	size_t len = strlen(jump->ops[0]);
+	for (int j = peep_next(i); j >= 0 && peep.lines[j].kind == LineLabel; j = peep_next(j)) {
+		const char *label = peep.lines[j].text;
+		if (!strncmp(label, jump->ops[0], len) && !strcmp(label + len, ":")) {
+			jump->text = NULL;
+			peep.fired[PeepJump] += 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// `push a; pop b` and `sub $8, %rsp; movsd a, (%rsp); movsd (%rsp), b; add $8, %rsp`
+// become a move from a to b, if they differ
+static int peep_push_pop(int i)
+{
+	Line *push = &peep.lines[i];
+	int j = peep_next(i);
+	if (j < 0) {
+		return 0;
+	}
+	Line *pop = &peep.lines[j];
+	if (Line_is(push, "push", 1) && Line_is(pop, "pop", 1) && peep_reg(pop->ops[0]) >= 0) {
+		if (strcmp(push->ops[0], pop->ops[0])) {
+			Line_set(push, peep_format("\tmov %s, %s", push->ops[0], pop->ops[0]));
+		} else {
+			push->text = NULL;
+		}
+		pop->text = NULL;
+		peep.fired[PeepPushPop] += 1;
+		return 1;
+	}
+	int k = peep_next(j);
+	int l = k >= 0 ? peep_next(k) : -1;
+	if (l < 0 || strcmp(push->text, "\tsub $8, %rsp") || strcmp(peep.lines[l].text, "\tadd $8, %rsp")) {
+		return 0;
+	}
+	Line *spill = &peep.lines[j];
+	Line *reload = &peep.lines[k];
+	if (!Line_is(spill, "movsd", 2) || strcmp(spill->ops[1], "(%rsp)") || peep_reg(spill->ops[0]) < 16) {
+		return 0;
+	}
+	if (!Line_is(reload, "movsd", 2) || strcmp(reload->ops[0], "(%rsp)") || peep_reg(reload->ops[1]) < 16) {
+		return 0;
+	}
+	if (strcmp(spill->ops[0], reload->ops[1])) {
+		Line_set(push, peep_format("\tmovsd %s, %s", spill->ops[0], reload->ops[1]));
+	} else {
+		push->text = NULL;
+	}
+	spill->text = NULL;
+	reload->text = NULL;
+	peep.lines[l].text = NULL;
+	peep.fired[PeepPushPop] += 1;
+	return 1;
+}
+
+// `mov a, %r` followed by a move or lea to %r that doesn't read it,
+// or by `mov d(%r), %r`, which loads from d(a) when a is a register
+static int peep_move(int i)
+{
+	Line *move = &peep.lines[i];
+	int j = peep_next(i);
+	int reg = Line_is_move(move) ? peep_reg(move->ops[1]) : -1;
+	if (j < 0 || reg < 0 || reg >= 16) {
+		return 0;
+	}
+	Line *next = &peep.lines[j];
+	if (!(Line_is(next, "mov", 2) || Line_is(next, "lea", 2)) || peep_reg(next->ops[1]) != reg) {
+		return 0;
+	}
+	if (!peep_mentions(next->ops[0], reg)) {
+		move->text = NULL;
+		peep.fired[PeepMove] += 1;
+		return 1;
+	}
+	int from = peep_reg(move->ops[0]);
+	char *base = strchr(next->ops[0], '(');
+	if (from < 0 || from >= 16 || !base || strncmp(base + 1, move->ops[1], strlen(move->ops[1]))) {
+		return 0;
+	}
+	if (strcmp(base + 1 + strlen(move->ops[1]), ")")) {
+		return 0;
+	}
+	Line_set(next, peep_format("\t%s %.*s(%s), %s",
+		next->mnemonic, (int)(base - next->ops[0]), next->ops[0], move->ops[0], next->ops[1]));
+	move->text = NULL;
+	peep.fired[PeepMove] += 1;
+	return 1;
+}
+
+static void peep_forget(const char **known, int reg)
+{
+	for (int i = 0; i < PEEP_REGS; i++) {
+		if (known[i] && (i == reg || peep_mentions(known[i], reg))) {
+			known[i] = NULL;
+		}
+	}
+}
+
+static void peep_forget_memory(const char **known)
+{
+	for (int i = 0; i < PEEP_REGS; i++) {
+		if (known[i] && peep_memory(known[i])) {
+			known[i] = NULL;
+		}
+	}
+}
+
+// what an instruction other than a move writes is forgotten, along with
+// everything across the labels and the instructions it doesn't know
+static void peep_forget_writes(const char **known, const Line *line)
+{
+	const char *m = line->mnemonic;
+	if (!strncmp(m, "cmp", 3) || !strncmp(m, "test", 4) || !strcmp(m, "comisd") || !strcmp(m, "ucomisd")) {
+		return;
+	}
+	if (!strcmp(m, "push") || !strcmp(m, "pop")) {
+		peep_forget(known, 4);
+		peep_forget_memory(known);
+	}
+	static const char *writes[] = {
+		"pop", "add", "sub", "and", "lea", "movl", "movq", "movsd", "addsd", "subsd", "mulsd", "divsd", "xorpd",
+	};
+	for (size_t i = 0; i < sizeof(writes) / sizeof(*writes); i++) {
+		if (!strcmp(m, writes[i]) && line->count) {
+			const char *dst = line->ops[line->count - 1];
+			size_t len;
+			int wide;
+			if (dst[0] == '%') {
+				peep_forget(known, peep_reg_at(dst + 1, &len, &wide));
+			} else {
+				peep_forget_memory(known);
+			}
+			return;
+		}
+	}
+	if (strcmp(m, "push")) {
+		memset(known, 0, PEEP_REGS * sizeof(*known));
+	}
+}
+
+// the loads of what a register holds since an earlier move in the same block
+static int peep_loads(void)
+{
+	const char *known[PEEP_REGS] = {NULL};
+	int fired = 0;
+	for (int i = peep_next(-1); i >= 0; i = peep_next(i)) {
+		Line *line = &peep.lines[i];
+		if (line->kind == LineLabel) {
+			memset(known, 0, sizeof(known));
+			continue;
+		}
+		if (!Line_is_move(line)) {
+			peep_forget_writes(known, line);
+			continue;
+		}
+		const char *src = line->ops[0];
+		const char *dst = line->ops[1];
+		int reg = peep_reg(dst);
+		if (reg >= 0 && known[reg] && !strcmp(known[reg], src)) {
+			line->text = NULL;
+			peep.fired[PeepLoad] += 1;
+			fired = 1;
+			continue;
+		}
+		if (reg >= 0) {
+			peep_forget(known, reg);
+			known[reg] = peep_mentions(src, reg) ? NULL : src;
+		} else if (dst[0] == '%') {
+			size_t len;
+			int wide;
+			peep_forget(known, peep_reg_at(dst + 1, &len, &wide));
+		} else {
+			peep_forget_memory(known);
+			reg = peep_reg(src);
+			if (reg >= 0) {
+				known[reg] = dst;
+			}
+		}
+	}
+	return fired;
+}
+
+void peep_flush(FILE *out)
+{
+	for (int changed = 1; changed;) {
+		changed = 0;
+		for (int i = peep_next(-1); i >= 0; i = peep_next(i)) {
+			if (peep.lines[i].kind == LineInstr) {
+				changed |= peep_jump(i) || peep_push_pop(i) || peep_move(i);
+			}
+		}
+		changed |= peep_loads();
+	}
+	for (int i = 0; i < peep.count; i++) {
+		if (peep.lines[i].text) {
+			fputs(peep.lines[i].text, out);
+			fputc('\n', out);
+		}
+	}
+	peep.count = 0;
+	Arena_reset(&peep.arena);
+}
+
+void peep_begin(void)
+{
+	peep.arena = Arena_make(PEEP_ARENA_PAGE_SIZE);
+}
+
+void peep_print_stats(void)
+{
+	fprintf(stderr, "; peephole: removed %d push/pop pairs, %d redundant loads, %d jumps to the next label, %d dead moves\n",
+		peep.fired[PeepPushPop], peep.fired[PeepLoad], peep.fired[PeepJump], peep.fired[PeepMove]);
+}
+
+void peep_end(void)
+{
+	Arena_destroy(peep.arena);
+	free(peep.lines);
+	free(peep.partial);
+}
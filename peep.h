@@ -0,0 +1,19 @@
+#ifndef PEEP_INCLUDED
+#define PEEP_INCLUDED
+
+#include <stdio.h>
+#include <stdarg.h>
+
+// The assembly is kept as a list of lines until a top-level line, a function
+// of the JIT or the code around the program is complete. A pass over the
+// instructions of the text section then rewrites what the lowering leaves
+// behind at the seams of its pieces, before the list is printed.
+// The code generator emits its assembly through here, a piece at a time.
+void peep_begin(void);
+void peep_emit(const char *fmt, va_list args);
+// prints the lines emitted so far
+void peep_flush(FILE *out);
+void peep_print_stats(void);
+void peep_end(void);
+
+#endif // PEEP_INCLUDED
@@ -0,0 +1,88 @@
+#include "symbol.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define INITIAL_TABLE_SIZE 256
+
+// NOTE: the table is open-addressed and stores symbol+1, so that 0 marks an empty slot
+static struct {
+	char   **names;
+	int    count;
+	int    capacity;
+	Symbol *table;
+	int    size;
+} symbols = {0};
+
+static unsigned long hash(const char *string, int length)
+{
+	unsigned long hash = 5381;
+	for (int i = 0; i < length; i++) {
+		hash = ((hash << 5) + hash) + string[i];
+	}
+	return hash;
+}
+
+static Symbol *find_slot(const char *string, int length)
+{
+	unsigned long i = hash(string, length) % symbols.size;
+	for (;;) {
+		Symbol sym = symbols.table[i] - 1;
+		if (sym < 0) {
+			return &symbols.table[i];
+		}
+		const char *name = symbols.names[sym];
+		if (!strncmp(name, string, length) && name[length] == '\0') {
+			return &symbols.table[i];
+		}
+		i = (i + 1) % symbols.size;
+	}
+}
+
+static void resize(int new_size)
+{
+	Symbol *old = symbols.table;
+	int old_size = symbols.size;
+	symbols.table = calloc(new_size, sizeof(*symbols.table));
+	symbols.size = new_size;
+	for (int i = 0; i < old_size; i++) {
+		if (old[i]) {
+			const char *name = symbols.names[old[i] - 1];
+			*find_slot(name, strlen(name)) = old[i];
+		}
+	}
+	free(old);
+}
+
+Symbol Symbol_intern(const char *string, int length)
+{
+	if (symbols.count >= symbols.size / 2) {
+		resize(symbols.size ? symbols.size * 2 : INITIAL_TABLE_SIZE);
+	}
+	Symbol *slot = find_slot(string, length);
+	if (*slot) {
+		return *slot - 1;
+	}
+	if (symbols.count == symbols.capacity) {
+		symbols.capacity = symbols.capacity ? symbols.capacity * 2 : INITIAL_TABLE_SIZE;
+		symbols.names = realloc(symbols.names, symbols.capacity * sizeof(*symbols.names));
+	}
+	char *name = malloc(length + 1);
+	memcpy(name, string, length);
+	name[length] = '\0';
+	symbols.names[symbols.count] = name;
+	symbols.count += 1;
+	*slot = symbols.count;
+	return symbols.count - 1;
+}
+
+const char *Symbol_name(Symbol sym)
+{
+	return symbols.names[sym];
+}
+
+int Symbol_count(void)
+{
+	return symbols.count;
+}
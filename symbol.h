@@ -0,0 +1,11 @@
+#ifndef SYMBOL_INCLUDED
+#define SYMBOL_INCLUDED
+
+// Interned identifiers: equal names always get the same small integer.
+typedef int Symbol;
+
+Symbol     Symbol_intern(const char *string, int length);
+const char *Symbol_name(Symbol sym);
+int        Symbol_count(void);
+
+#endif // SYMBOL_INCLUDED
@@ -14,12 +14,15 @@ static Type *Type_alloc(Arena *a, TypeKind kind)
 	return type;
 }
 
-static long long unsigned id = 0;
+// NOTE: thread-local, so that independent expressions can be inferred concurrently
+static __thread long long unsigned id = 0;
 
-Type *VarType_new(Arena *a)
+Type *VarType_new(Arena *a, int level)
 {
 	Type *var = Type_alloc(a, VarType);
-	var->as.var = id++;
+	var->as.var.id = id++;
+	var->as.var.level = level;
+	var->as.var.bound = NULL;
 	return var;
 }
 
@@ -31,7 +34,9 @@ void VarType_reset()
 static Type *VarType_new_from_value(Arena *a, int value)
 {
 	Type *var = Type_alloc(a, VarType);
-	var->as.var = value;
+	var->as.var.id = value;
+	var->as.var.level = GENERIC_LEVEL;
+	var->as.var.bound = NULL;
 	return var;
 }
 
@@ -102,17 +107,17 @@ void Type_drop(Type *type)
 	}
 }
 
-Type *Type_copy(const Type *type)
+Type *Type_copy(Arena *a, const Type *type)
 {
 	switch (type->kind) {
 		case VarType:
-			return VarType_new_from_value(NULL, VarType_value(type));
+			return VarType_new_from_value(a, VarType_value(type));
 		case NumType:
 			return NumType_get();
 		case FnType:
-			return FnType_new(NULL, Type_copy(FnType_from(type)), Type_copy(FnType_to(type)));
+			return FnType_new(a, Type_copy(a, FnType_from(type)), Type_copy(a, FnType_to(type)));
 		case GenType:
-			return GenType_new(NULL, Type_copy(GenType_inner(type)));
+			return GenType_new(a, Type_copy(a, GenType_inner(type)));
 	}
 	return NULL;
 }
@@ -143,33 +148,54 @@ int Type_eq(const Type *t1, const Type *t2)
 	return 1;
 }
 
-void TypeEnv_push(TypeEnv **env, const char *name, const Type *type)
+TypeEnv TypeEnv_make(void)
 {
-	TypeEnv *new = malloc(sizeof(*new));
-	new->name = strdup(name);
-	new->type = Type_copy(type);
-	new->prev = *env;
-	*env = new;
+	return (TypeEnv){NULL, 0};
 }
 
-Type *TypeEnv_lookup(const TypeEnv *env, const char *name)
+void TypeEnv_reserve(TypeEnv *env, int symbols)
 {
-	while (env != TYPEENV_EMPTY) {
-		if (!strcmp(env->name, name)) {
-			return env->type;
+	if (symbols <= env->size) {
+		return;
+	}
+	int size = env->size ? env->size : 64;
+	while (size < symbols) {
+		size *= 2;
+	}
+	env->types = realloc(env->types, size * sizeof(*env->types));
+	memset(env->types + env->size, 0, (size - env->size) * sizeof(*env->types));
+	env->size = size;
+}
+
+void TypeEnv_define(TypeEnv *env, Symbol name, const Type *type)
+{
+	TypeEnv_reserve(env, name + 1);
+	if (env->types[name]) {
+		Type_drop(env->types[name]);
+	}
+	env->types[name] = Type_copy(NULL, type);
+}
+
+Type *TypeEnv_lookup(const TypeEnv *env, const TypeScope *scope, Symbol name)
+{
+	while (scope != TYPESCOPE_EMPTY) {
+		if (scope->name == name) {
+			return scope->type;
 		}
-		env = env->prev;
+		scope = scope->prev;
 	}
-	return NULL;
+	if (name >= env->size) {
+		return NULL;
+	}
+	return env->types[name];
 }
 
-void TypeEnv_drop(TypeEnv *env)
+void TypeEnv_drop(TypeEnv env)
 {
-	while (env != TYPEENV_EMPTY) {
-		TypeEnv *prev = env->prev;
-		Type_drop(env->type);
-		free(env->name);
-		free(env);
-		env = prev;
+	for (int i = 0; i < env.size; i++) {
+		if (env.types[i]) {
+			Type_drop(env.types[i]);
+		}
 	}
+	free(env.types);
 }
@@ -2,6 +2,7 @@
 #define TYPES_INCLUDED
 
 #include "arena.h"
+#include "symbol.h"
 
 typedef struct Type Type;
 
@@ -21,13 +22,25 @@ typedef struct {
 #define FnType_from(typeptr) ((typeptr)->as.fn.from)
 #define FnType_to(typeptr) ((typeptr)->as.fn.to)
 
+// NOTE: variables are mutable, unification binds them to other types
+typedef struct {
+	int  id;
+	int  level; // the let-nesting depth the variable was created at
+	Type *bound;
+} VarTypeValue;
+
+#define VarType_value(typeptr) ((typeptr)->as.var.id)
+#define VarType_level(typeptr) ((typeptr)->as.var.level)
+#define VarType_bound(typeptr) ((typeptr)->as.var.bound)
+
+// variables of a polytype live at this level
+#define GENERIC_LEVEL 0x7fffffff
+
 typedef union {
-	int         var;
-	FnTypeValue fn;
-	Type        *gen;
+	VarTypeValue var;
+	FnTypeValue  fn;
+	Type         *gen;
 } TypeValue;
-
-#define VarType_value(typeptr) ((typeptr)->as.var)
 #define GenType_inner(typeptr) ((typeptr)->as.gen)
 
 struct Type {
@@ -39,27 +52,37 @@ void Type_print(const Type *type);
 void Type_println(const Type *type);
 
 Type *NumType_get(void);
-Type *VarType_new(Arena *a);
+Type *VarType_new(Arena *a, int level);
 void VarType_reset(void);
 Type *FnType_new(Arena *a, Type *from, Type *to);
 Type *GenType_new(Arena *a, Type *inner);
 
-Type *Type_copy(const Type *type); // NOTE: the return value is malloc'ed, must be Type_drop'ed
+Type *Type_copy(Arena *a, const Type *type); // NOTE: if `a` is NULL the copy is malloc'ed and must be Type_drop'ed
 void Type_drop(Type *type);
 int  Type_eq(const Type *t1, const Type *t2);
 
-typedef struct TypeEnv TypeEnv;
+// The top-level bindings are indexed directly by their symbol. The bindings
+// introduced while inferring a single expression (parameters and the name
+// of a let) are chained on the stack and shadow them.
+typedef struct {
+	Type **types; // owned polytypes, NULL for the unbound symbols
+	int  size;
+} TypeEnv;
+
+typedef struct TypeScope TypeScope;
 
-struct TypeEnv {
-	char    *name;
-	Type    *type;
-	TypeEnv *prev;
+struct TypeScope {
+	Symbol          name;
+	Type            *type;
+	const TypeScope *prev;
 };
 
-#define TYPEENV_EMPTY (TypeEnv *)0
+#define TYPESCOPE_EMPTY (const TypeScope *)0
 
-void TypeEnv_push(TypeEnv **env, const char *name, const Type *type);
-Type *TypeEnv_lookup(const TypeEnv *env, const char *name);
-void TypeEnv_drop(TypeEnv *env);
+TypeEnv TypeEnv_make(void);
+void    TypeEnv_reserve(TypeEnv *env, int symbols);
+void    TypeEnv_define(TypeEnv *env, Symbol name, const Type *type);
+Type    *TypeEnv_lookup(const TypeEnv *env, const TypeScope *scope, Symbol name);
+void    TypeEnv_drop(TypeEnv env);
 
 #endif // TYPES_INCLUDED
@@ -4,23 +4,32 @@
 #include "object.h"
 #include "node.h"
 
+// NOTE: `arg`, `env` and `text` are where they are in CompFn, so that
+// compiled code calls an interpreted closure like a compiled one, its text is
+// either the bridge back into the interpreter or the compiled code of its body
 typedef struct {
-	Object     *env;
+	int        escapes; // see FnNode_captured
 	const Node *body;
 	const char *arg;
+	Object     *env;
+	const void *text;
 	Object     handle;
 } Fn;
 
 #define FnObj_env(objptr) (ObjToVal(objptr, Fn)->env)
 #define FnObj_body(objptr) (ObjToVal(objptr, Fn)->body)
 #define FnObj_arg(objptr) (ObjToVal(objptr, Fn)->arg)
+#define FnObj_text(objptr) (ObjToVal(objptr, Fn)->text)
+#define FnObj_escapes(objptr) (ObjToVal(objptr, Fn)->escapes)
 
 typedef struct {
+	const char *arg; // NULL outside of the interpreter's JIT
 	Object     *env;
 	const void *text;
 	Object     handle;
 } CompFn;
 
+#define CompFnObj_arg(objptr) (ObjToVal(objptr, CompFn)->arg)
 #define CompFnObj_env(objptr) (ObjToVal(objptr, CompFn)->env)
 #define CompFnObj_text(objptr) (ObjToVal(objptr, CompFn)->text)
 
@@ -58,4 +67,14 @@ typedef struct {
 
 #define NumObj_num(objptr) (ObjToVal(objptr, Num)->num)
 
+// NOTE: a compiled function's activation, the parameter is its only slot
+typedef struct {
+	Object *prev;
+	Object *value;
+	Object handle;
+} Frame;
+
+#define FrameObj_prev(objptr) (ObjToVal(objptr, Frame)->prev)
+#define FrameObj_value(objptr) (ObjToVal(objptr, Frame)->value)
+
 #endif // VALUES_INCLUDED